@@ -0,0 +1,103 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_ADMISSION_H_
+#define CLERK_ADMISSION_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "util.h"
+
+namespace clerk {
+
+// AdmissionFilter keeps one-packet flows, like those from scans and spoofed
+// floods, out of a packet thread's flow table.  A new flow is only admitted
+// on its second packet:  the first just marks its hash as seen.
+//
+// Seen hashes are kept in a Bloom filter with two bit positions per hash, in
+// two generations.  Hashes are marked in the current generation and looked
+// for in both, and Age() drops the older one, so flows seen in the current or
+// previous interval are admitted straight away, and a scan's marks don't pile
+// up into false positives forever.
+//
+// Clearing a generation touches every one of its bits, which is too slow for
+// a packet thread mid-swap, so we keep a third, spare, generation.  Age()
+// just rotates the spare in, and the dropped generation becomes the spare,
+// which ClearStale() clears later, on another thread.
+class AdmissionFilter {
+ public:
+  // Each generation holds 'bits' bits, rounded down to a power of two.
+  explicit AdmissionFilter(size_t bits)
+      : mask_(RoundDown(std::max<size_t>(bits, 64)) - 1),
+        current_((mask_ + 1) / 64),
+        old_((mask_ + 1) / 64),
+        spare_((mask_ + 1) / 64),
+        spare_clear_(true) {}
+
+  // Marks a flow with the given hash as seen, returning whether it had been
+  // seen before (or, rarely, another flow with the same bits had).
+  bool Admit(uint64_t hash) {
+    const uint64_t a = hash & mask_;
+    const uint64_t b = (hash >> 32 | hash << 32) & mask_;
+    const bool seen = (Get(current_, a) && Get(current_, b)) ||
+                      (Get(old_, a) && Get(old_, b));
+    Set(&current_, a);
+    Set(&current_, b);
+    return seen;
+  }
+  // Starts a new generation, forgetting flows last seen two generations ago.
+  // Constant time, unless ClearStale() wasn't called since the last Age().
+  void Age() {
+    if (!spare_clear_) ClearStale();
+    spare_.swap(old_);
+    old_.swap(current_);
+    spare_clear_ = false;
+  }
+  // Clears the generation dropped by the last Age().  Only touches that
+  // generation, so it may run on another thread while this one calls
+  // Admit(), as long as it's ordered before the next Age() (as the main
+  // thread's handling of a swapped-out state is, before the next swap).
+  void ClearStale() {
+    std::fill(spare_.begin(), spare_.end(), 0);
+    spare_clear_ = true;
+  }
+
+ private:
+  static size_t RoundDown(size_t n) {
+    size_t p = 1;
+    while (p <= n / 2) p *= 2;
+    return p;
+  }
+  static bool Get(const std::vector<uint64_t>& bits, uint64_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+  }
+  static void Set(std::vector<uint64_t>* bits, uint64_t i) {
+    (*bits)[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  uint64_t mask_;
+  std::vector<uint64_t> current_;
+  std::vector<uint64_t> old_;
+  std::vector<uint64_t> spare_;
+  bool spare_clear_;
+
+  DISALLOW_COPY_AND_ASSIGN(AdmissionFilter);
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_ADMISSION_H_
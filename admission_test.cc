@@ -0,0 +1,77 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "admission.h"
+
+namespace clerk {
+
+class AdmissionFilterTest : public ::testing::Test {};
+
+TEST_F(AdmissionFilterTest, TestSecondPacket) {
+  AdmissionFilter f(1 << 16);
+  EXPECT_FALSE(f.Admit(0x123456789abcdef0));
+  EXPECT_TRUE(f.Admit(0x123456789abcdef0));
+  EXPECT_FALSE(f.Admit(0x0fedcba987654321));
+  EXPECT_TRUE(f.Admit(0x0fedcba987654321));
+}
+
+TEST_F(AdmissionFilterTest, TestAge) {
+  AdmissionFilter f(1 << 16);
+  EXPECT_FALSE(f.Admit(1));
+  // Seen last generation, so still admitted, and marked again.
+  f.Age();
+  EXPECT_TRUE(f.Admit(1));
+  f.Age();
+  EXPECT_TRUE(f.Admit(1));
+  // Unseen for a whole generation, so forgotten.
+  f.Age();
+  f.Age();
+  EXPECT_FALSE(f.Admit(1));
+}
+
+// Clearing the stale generation ahead of time changes nothing.
+TEST_F(AdmissionFilterTest, TestClearStale) {
+  AdmissionFilter f(1 << 16);
+  EXPECT_FALSE(f.Admit(1));
+  f.Age();
+  f.ClearStale();
+  EXPECT_TRUE(f.Admit(1));
+  EXPECT_FALSE(f.Admit(2));
+  f.Age();
+  f.ClearStale();
+  f.ClearStale();
+  EXPECT_TRUE(f.Admit(2));
+  f.Age();
+  f.ClearStale();
+  f.Age();
+  EXPECT_FALSE(f.Admit(1));
+  EXPECT_FALSE(f.Admit(2));
+}
+
+TEST_F(AdmissionFilterTest, TestFalsePositives) {
+  // With 16 bits per flow, about 1.4% of new flows should look seen.
+  AdmissionFilter f(1 << 20);
+  std::mt19937_64 rng(1);
+  int admitted = 0;
+  for (int i = 0; i < (1 << 16); i++) {
+    admitted += f.Admit(rng());
+  }
+  EXPECT_LT(admitted, (1 << 16) / 40);
+}
+
+}  // namespace clerk
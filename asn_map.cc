@@ -82,6 +82,16 @@ uint32_t ASNMap::ASN(const uint8_t* addr) const {
   return NoASN;
 }
 
+uint32_t ASNMap::ASN4(uint32_t ip4) const {
+  uint8_t addr[16];
+  memset(addr, 0, 12);
+  addr[12] = ip4 >> 24;
+  addr[13] = ip4 >> 16;
+  addr[14] = ip4 >> 8;
+  addr[15] = ip4;
+  return ASN(addr);
+}
+
 namespace internal {
 
 // Pull out a CSV value from a line pointed to by *val.  Returns a
@@ -36,9 +36,13 @@ class ASNMap {
   // IPv4-mapped IPv6 addresses in the lowest-order bytes (e.g. ::192.168.1.1).
   // Returns NoASN if not found.
   uint32_t ASN(const uint8_t* addr) const;
+  // Like ASN, but for an IPv4 address in host byte order.
+  uint32_t ASN4(uint32_t ip4) const;
 
   // Clear removes all current mapping from this map.
   void Clear() { set_.clear(); }
+  // Swap exchanges this map's mappings with other's, in constant time.
+  void Swap(ASNMap* other) { set_.swap(other->set_); }
 
   static const uint32_t NoASN;  // == 0
 
@@ -15,20 +15,39 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include "asn_map.h"
+#include "filter.h"
+#include "flow.h"
 #include "ipfix.h"
+#include "send.h"
+#include "slab.h"
 #include "testimony.h"
+#include "thread_pool.h"
 
 #include "util.h"
 
 using google::ParseCommandLineFlags;
 
 DEFINE_string(testimony, "", "Name of testimony socket");
-DEFINE_string(collector, "127.0.0.1:6555", "Socket address of collector");
+DEFINE_string(collector, "127.0.0.1:6555",
+              "Socket address of collector, or a comma-separated list of "
+              "them.  Flows are spread over collectors by the hash of their "
+              "keys, so each gets a consistent subset.  If 'stdout', flows "
+              "are written to stdout as text instead.");
+DEFINE_int32(sockets_per_collector, 1,
+             "Number of UDP sockets, each with its own source port, to send "
+             "to each collector with.  Flows are spread over them by hash, so "
+             "a collector's RSS can spread them over its cores.");
 DEFINE_double(upload_every_secs, 60, "Upload IPFIX to collector once every X");
 DEFINE_double(flow_timeout_secs, 60 * 5, "Time out flows after X");
 DEFINE_string(asns_csv, "",
@@ -36,40 +55,217 @@ DEFINE_string(asns_csv, "",
               "data readable by clerk.");
 DEFINE_double(asns_reread_every_secs, 86400,
               "Reread ASN CSV file once every X seconds");
+DEFINE_int64(max_flow_memory_mb, 0,
+             "If nonzero, bound memory used to track flows, across all packet "
+             "threads, to X MB, including the peak while one interval's flows "
+             "are merged and the next's are tracked.  When full, flows are "
+             "evicted and exported with end reason LACK_OF_RESOURCES, or "
+             "dropped (and logged) once too many are waiting for export.");
+DEFINE_int32(merge_threads, 0,
+             "Number of threads used to merge flows from all packet threads "
+             "each interval.  If 0, use one per CPU.");
+DEFINE_bool(flow_consistent_fanout, false,
+            "Set if testimony's fanout sends all of a flow's packets to the "
+            "same thread (e.g. hash fanout).  Each thread's flows are then "
+            "exported directly and in parallel, without merging, each "
+            "thread with its own observation domain and sequence numbers.");
+DEFINE_int32(observation_domain, 12345,
+             "IPFIX observation domain ID.  With --flow_consistent_fanout, "
+             "packet thread i uses this plus i.  With --stream_ended_flows, "
+             "streamed flows use the next one after those.");
+DEFINE_bool(rxhash_hints, false,
+            "Use the flow hash the kernel provides with each packet "
+            "(tp_rxhash) to find flows faster.  Requires testimony to "
+            "request TP_FT_REQ_FILL_RXHASH; without it, hashes are zero and "
+            "are ignored.");
+DEFINE_string(ipfix_format, "full",
+              "Fields to export in each IPFIX record.  'full' exports all of "
+              "them; 'compact' drops ASNs, VLANs, and the ICMP type/code "
+              "field, writing ICMP type and code into the destination port.");
+DEFINE_int32(max_packet_size, clerk::ipfix::kDefaultPacketSize,
+             "Largest IPFIX packet to send, in bytes of UDP payload.  Raise "
+             "it for collectors reachable over jumbo frames.");
+DEFINE_double(export_packets_per_sec, 0,
+              "If nonzero, send IPFIX packets no faster than this, across all "
+              "collectors, so collectors' socket buffers don't overflow.");
+DEFINE_double(export_bytes_per_sec, 0,
+              "If nonzero, send IPFIX no faster than this many bytes/sec, "
+              "across all collectors.");
+DEFINE_double(export_spread_fraction, 0,
+              "If nonzero, spread each export's packets over this fraction of "
+              "--upload_every_secs, rather than sending them all at once.");
+DEFINE_bool(stream_ended_flows, false,
+            "Export flows as soon as packet threads see them end (with a FIN "
+            "or RST) or evict them, rather than at the next upload.  Most "
+            "exact with --flow_consistent_fanout.");
+DEFINE_double(stream_every_secs, 1,
+              "With --stream_ended_flows, export ended flows once every X.");
+DEFINE_double(stream_linger_secs, 2,
+              "With --stream_ended_flows, flows which see a FIN or RST end "
+              "once they've seen no packets for X.");
+DEFINE_double(shed_load_lag_secs, 0,
+              "If nonzero, packet threads which fall more than X behind start "
+              "sampling packets, scaling up their counters, and report the "
+              "sampling rate with each export.");
+DEFINE_int32(max_sampling_interval, 64,
+             "With --shed_load_lag_secs, packet threads take at least one in "
+             "every X packets.");
+DEFINE_string(filter, "",
+              "If set, only track packets matching this expression, like "
+              "'not vlan 100-110 and not multicast'; see filter.h for the "
+              "syntax.  Other packets are dropped before reaching a flow "
+              "table.");
+DEFINE_int32(admission_filter_mb, 0,
+             "If nonzero, each packet thread only tracks a flow once it's "
+             "seen its second packet, using X MB to remember flows it's seen "
+             "once, so scans and spoofed floods don't fill flow tables.  "
+             "First packets are only counted, and their running totals "
+             "exported in options records of their own, not as flows.");
 
-// CombineGather parallelizes the process of combining multiple IPFIX states
-// together, by synchronously combining half of them with the other half, until
-// there's only one left.
-void CombineGather(std::vector<std::unique_ptr<clerk::State>>* states) {
-  while (states->size() > 1) {
-    std::vector<std::thread> threads;
-    // New size is 1/2 the old size, rounded up.
-    int new_size = states->size() / 2 + states->size() % 2;
-    LOG(INFO) << "Combining " << states->size() << " states into " << new_size;
-    for (int i = 0; i < new_size; i++) {
-      size_t other = i + new_size;
-      if (other < states->size()) {  // not always true, if states.size() is odd
-        threads.emplace_back(std::thread([states, i, other]() {
-          // Actual combination implemented with += operator.
-          *reinterpret_cast<clerk::IPFIX*>((*states)[i].get()) +=
-              *reinterpret_cast<clerk::IPFIX*>((*states)[other].get());
-        }));
-      }
+// SamplingInterval returns the average sampling interval of 'packets'
+// packets which stood for 'seen' packets, rounded to the nearest integer.
+uint32_t SamplingInterval(uint64_t seen, uint64_t packets) {
+  if (packets == 0) return 1;
+  return std::max<uint64_t>(1, (seen + packets / 2) / packets);
+}
+
+// TakeFlows takes the flows from all packet threads' states, one table per
+// state, and their sampling intervals, one per state in 'intervals' and
+// overall in 'interval'.  The packets and bytes each state didn't admit to its
+// table go in 'unadmitted_stats', one per state.
+void TakeFlows(std::vector<std::unique_ptr<clerk::State>>* states,
+               std::vector<clerk::flow::Table>* tables,
+               std::vector<uint32_t>* intervals, uint32_t* interval,
+               std::vector<clerk::flow::Stats>* unadmitted_stats) {
+  uint64_t evicted = 0, dropped = 0, dropped_packets = 0, dropped_bytes = 0,
+           packets = 0, seen = 0, filtered = 0, unadmitted = 0;
+  tables->resize(states->size());
+  intervals->resize(states->size());
+  unadmitted_stats->resize(states->size());
+  for (size_t i = 0; i < states->size(); i++) {
+    auto state = reinterpret_cast<clerk::IPFIX*>((*states)[i].get());
+    evicted += state->evicted();
+    dropped += state->dropped();
+    dropped_packets += state->dropped_packets();
+    dropped_bytes += state->dropped_bytes();
+    packets += state->packets();
+    seen += state->packets_seen();
+    filtered += state->filtered();
+    unadmitted += state->unadmitted();
+    (*unadmitted_stats)[i].packets = state->unadmitted();
+    (*unadmitted_stats)[i].bytes = state->unadmitted_bytes();
+    (*intervals)[i] = SamplingInterval(state->packets_seen(), state->packets());
+    state->SwapFlows(&(*tables)[i]);
+  }
+  if (evicted) {
+    LOG(WARNING) << "Flow tables full, evicted " << evicted << " flows";
+  }
+  if (dropped) {
+    // These never reach the collector, so this is the only record of them.
+    LOG(WARNING) << "Dropped " << dropped << " flows this interval, with "
+                 << dropped_packets << " packets and " << dropped_bytes
+                 << " bytes, which didn't fit in flow tables' export lists";
+  }
+  VLOG(1) << "Filtered out " << filtered << " of " << packets
+          << " packets, and didn't admit " << unadmitted << " flows";
+  *interval = SamplingInterval(seen, packets);
+  if (seen > packets) {
+    LOG(WARNING) << "Falling behind, sampled " << packets << " of " << seen
+                 << " packets";
+  }
+}
+
+// MergeTables merges the flows from all packet threads' tables into
+// partitions, which it then brings up to date with the flows in 'retained'
+// (one per partition).  Each table's flows are split by partition, then each
+// partition is merged and retained, all in parallel on 'pool', with no two
+// tasks writing the same table.
+void MergeTables(std::vector<clerk::flow::Table>* tables,
+                 clerk::ThreadPool* pool, uint64_t cutoff_ns, size_t max,
+                 std::vector<clerk::flow::Table>* retained,
+                 std::vector<std::mutex>* retained_mu,
+                 std::vector<clerk::flow::Table>* partitions) {
+  const size_t n = retained->size();
+  std::vector<std::vector<clerk::flow::Shard>> shards(
+      tables->size(), std::vector<clerk::flow::Shard>(n));
+  pool->Run(tables->size(), [&](size_t i) {
+    clerk::flow::SplitTable((*tables)[i], &shards[i]);
+    // Free the thread's table here, so the work of freeing is parallel too.
+    clerk::flow::Table().swap((*tables)[i]);
+  });
+  const size_t max_per_partition = max ? std::max<size_t>(1, max / n) : 0;
+  pool->Run(n, [&](size_t p) {
+    std::vector<const clerk::flow::Shard*> mine;
+    for (const auto& s : shards) {
+      mine.push_back(&s[p]);
     }
-    for (size_t i = 0; i < threads.size(); i++) {
-      threads[i].join();
+    clerk::flow::MergeShards(mine, &(*partitions)[p]);
+    std::unique_lock<std::mutex> ml((*retained_mu)[p]);
+    clerk::flow::Retain(&(*retained)[p], &(*partitions)[p], cutoff_ns,
+                        max_per_partition);
+  });
+}
+
+// ExportPerThread exports each packet thread's table with that thread's own
+// sender, in parallel on 'pool', without merging them.  This is only correct
+// when every flow's packets all go to the same thread, so no flow is in more
+// than one table.  'retained' holds one table per thread.
+void ExportPerThread(
+    std::vector<clerk::flow::Table>* tables, clerk::ThreadPool* pool,
+    uint64_t cutoff_ns, size_t max, std::vector<clerk::flow::Table>* retained,
+    std::vector<std::mutex>* retained_mu,
+    const std::vector<std::unique_ptr<clerk::Sender>>& senders) {
+  CHECK_EQ(tables->size(), retained->size());
+  CHECK_EQ(tables->size(), senders.size());
+  pool->Run(tables->size(), [&](size_t i) {
+    std::vector<clerk::flow::Table> mine(1);
+    mine[0].swap((*tables)[i]);
+    {
+      std::unique_lock<std::mutex> ml((*retained_mu)[i]);
+      clerk::flow::Retain(&(*retained)[i], &mine[0], cutoff_ns, max);
     }
-    // Now throw away the second half, since it was combined with the first
-    // and is now redundant.
-    states->resize(new_size);
-  }
+    senders[i]->Send(mine);
+  });
 }
 
-void AddASNsTo(clerk::flow::Table* t, const clerk::ASNMap& asns) {
-  LOG(INFO) << "Adding ASNs to flows";
-  for (auto iter = t->begin(); iter != t->end(); ++iter) {
-    iter->second.src_asn = asns.ASN(iter->first.src_ip);
-    iter->second.dst_asn = asns.ASN(iter->first.dst_ip);
+// StreamEnded runs forever, exporting the flows packet threads have ended
+// once every --stream_every_secs.  Each flow is first forgotten by the
+// retained table that would otherwise carry it on:  with flow-consistent
+// fanout, its packet thread's, else its partition's.  'sender' is only used
+// under 'sender_mu', which guards its ASN map.
+void StreamEnded(clerk::EndedStreams* streams,
+                 std::vector<clerk::flow::Table>* retained,
+                 std::vector<std::mutex>* retained_mu, clerk::Sender* sender,
+                 std::mutex* sender_mu) {
+  const size_t n = retained->size();
+  while (1) {
+    SleepForSeconds(FLAGS_stream_every_secs);
+    std::vector<clerk::flow::Table> ended;
+    streams->Drain(&ended);
+    std::vector<clerk::flow::Table> partitions(n);
+    if (FLAGS_flow_consistent_fanout) {
+      CHECK_EQ(n, ended.size());
+      partitions.swap(ended);
+    } else {
+      std::vector<clerk::flow::Shard> shards(n);
+      for (const auto& table : ended) {
+        clerk::flow::SplitTable(table, &shards);
+      }
+      for (size_t p = 0; p < n; p++) {
+        clerk::flow::MergeShards({&shards[p]}, &partitions[p]);
+      }
+    }
+    size_t count = 0;
+    for (size_t p = 0; p < n; p++) {
+      if (partitions[p].size() == 0) continue;
+      count += partitions[p].size();
+      std::unique_lock<std::mutex> ml((*retained_mu)[p]);
+      clerk::flow::Forget(&(*retained)[p], &partitions[p]);
+    }
+    if (count) {
+      std::unique_lock<std::mutex> ml(*sender_mu);
+      sender->Send(partitions);
+    }
   }
 }
 
@@ -125,23 +321,135 @@ int main(int argc, char** argv) {
   double last_asn_read_secs = GetCurrentTimeSeconds();
 
   clerk::IPFIXFactory factory;
+  factory.SetRxHashHints(FLAGS_rxhash_hints);
+  const clerk::ipfix::Format* format =
+      clerk::ipfix::FormatNamed(FLAGS_ipfix_format);
+  CHECK(format != nullptr) << "Unknown --ipfix_format " << FLAGS_ipfix_format;
+  factory.SetFormat(format);
+  CHECK_GE(FLAGS_max_packet_size, 256);
+  CHECK_LE(size_t(FLAGS_max_packet_size), clerk::ipfix::kMaxPacketSize);
+  factory.SetMaxPacketSize(FLAGS_max_packet_size);
+  std::unique_ptr<clerk::Filter> filter;
+  if (!FLAGS_filter.empty()) {
+    std::string error;
+    filter = clerk::Filter::Compile(FLAGS_filter, &error);
+    CHECK(filter != nullptr) << "Bad --filter: " << error;
+    factory.SetFilter(filter.get());
+  }
+  CHECK_GE(FLAGS_admission_filter_mb, 0);
+  // Each packet thread's filter has three generations, one of them spare.
+  factory.SetAdmissionBits(size_t(FLAGS_admission_filter_mb) * 8 * 1024 *
+                           1024 / 3);
+  clerk::EndedStreams streams;
+  if (FLAGS_stream_ended_flows) {
+    factory.SetStreams(&streams,
+                       FLAGS_stream_linger_secs * kNumNanosPerSecond);
+  }
 
-  std::unique_ptr<clerk::Sender> sender;
-  if (FLAGS_collector == "stdout") {
-    sender.reset(new clerk::FileSender(stdout, &factory));
-  } else {
-    struct sockaddr_storage ss;
-    socklen_t ss_size;
-    StringToSocketStorage(FLAGS_collector, &ss, &ss_size);
-    int fd = socket(ss.ss_family, SOCK_DGRAM, 0);
-    PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&ss), ss_size) >= 0)
-        << "Connect to " << FLAGS_collector << " failed";
-    sender.reset(new clerk::PacketSender(fd, &factory));
+  std::vector<int> fds;
+  if (FLAGS_collector != "stdout") {
+    CHECK_GT(FLAGS_sockets_per_collector, 0);
+    std::stringstream collectors(FLAGS_collector);
+    std::string collector;
+    while (std::getline(collectors, collector, ',')) {
+      struct sockaddr_storage ss;
+      socklen_t ss_size;
+      StringToSocketStorage(collector, &ss, &ss_size);
+      // Each socket is bound to its own ephemeral source port on connect.
+      for (int i = 0; i < FLAGS_sockets_per_collector; i++) {
+        int fd = socket(ss.ss_family, SOCK_DGRAM, 0);
+        PCHECK(fd >= 0) << "Socket for " << collector << " failed";
+        PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&ss), ss_size) >= 0)
+            << "Connect to " << collector << " failed";
+        fds.push_back(fd);
+      }
+    }
+    LOG(INFO) << "Exporting to " << fds.size() << " sockets";
   }
 
   clerk::TestimonyProcessor processor(FLAGS_testimony, &factory);
+  if (FLAGS_shed_load_lag_secs > 0) {
+    CHECK_GT(FLAGS_max_sampling_interval, 0);
+    processor.SetLoadShedding(FLAGS_shed_load_lag_secs * kNumNanosPerSecond,
+                              FLAGS_max_sampling_interval);
+  }
   double last_upload_secs = GetCurrentTimeSeconds();
   processor.StartThreads();
+  if (FLAGS_max_flow_memory_mb > 0) {
+    size_t max_flows = (FLAGS_max_flow_memory_mb << 20) /
+                       processor.NumThreads() /
+                       clerk::IPFIXFactory::kMaxBytesPerFlow;
+    LOG(INFO) << "Tracking at most " << max_flows << " flows per thread";
+    factory.SetMaxFlowsPerThread(max_flows);
+  }
+  // Flows are merged, retained, and exported in partitions, by a pool of
+  // threads with one thread per partition.  If fanout is flow-consistent,
+  // each packet thread's flows are their own partition instead, exported with
+  // their own sender (and so, observation domain).
+  size_t merge_threads = FLAGS_merge_threads;
+  if (merge_threads == 0) {
+    merge_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  const size_t num_partitions = FLAGS_flow_consistent_fanout
+                                    ? processor.NumThreads()
+                                    : merge_threads;
+  LOG(INFO) << "Handling flows in " << num_partitions << " partitions on "
+            << merge_threads << " threads";
+  clerk::ThreadPool pool(merge_threads);
+  // Each partition's tables come from its own allocator, so each gets back
+  // the blocks its previous table freed:  a shared allocator only keeps a few
+  // free blocks of each size, fewer than there are partitions.
+  std::deque<clerk::SlabAllocator> partition_allocs(num_partitions);
+  // Flows active across intervals, which only the main thread's pool (and,
+  // when streaming, the streaming exporter) touches, each partition under its
+  // own lock.
+  std::vector<clerk::flow::Table> retained(num_partitions);
+  std::vector<std::mutex> retained_mu(num_partitions);
+  std::vector<std::unique_ptr<clerk::Sender>> senders(
+      FLAGS_flow_consistent_fanout ? processor.NumThreads() : 1);
+  // Senders export concurrently, so rate limits are split between them, and
+  // the streaming exporter's if any.
+  const size_t concurrent = senders.size() + FLAGS_stream_ended_flows;
+  clerk::ipfix::Pacing pacing;
+  pacing.packets_per_sec = FLAGS_export_packets_per_sec / concurrent;
+  pacing.bytes_per_sec = FLAGS_export_bytes_per_sec / concurrent;
+  pacing.spread_secs = FLAGS_export_spread_fraction * FLAGS_upload_every_secs;
+  factory.SetPacing(pacing);
+  for (size_t i = 0; i < senders.size(); i++) {
+    if (fds.empty()) {
+      senders[i].reset(new clerk::FileSender(stdout, &factory));
+    } else {
+      senders[i].reset(new clerk::PacketSender(
+          fds, &factory, &asns, FLAGS_observation_domain + i,
+          // Per-thread senders already run on the pool, so encode serially.
+          FLAGS_flow_consistent_fanout ? nullptr : &pool));
+    }
+  }
+  // The streamer exports concurrently with the main thread, so it has its own
+  // copy of the ASN map, which the main thread only replaces under
+  // streamer_mu, once it's built a new one.
+  std::unique_ptr<clerk::Sender> streamer;
+  clerk::ASNMap streamer_asns;
+  std::mutex streamer_mu;
+  if (FLAGS_stream_ended_flows) {
+    streamer_asns = asns;
+    if (fds.empty()) {
+      streamer.reset(new clerk::FileSender(stdout, &factory));
+    } else {
+      auto sender = new clerk::PacketSender(
+          fds, &factory, &streamer_asns,
+          FLAGS_observation_domain + senders.size(),
+          nullptr);
+      // Streamed exports are small and frequent, so aren't spread out.
+      clerk::ipfix::Pacing unspread = pacing;
+      unspread.spread_secs = 0;
+      sender->SetPacing(unspread);
+      streamer.reset(sender);
+    }
+    std::thread(StreamEnded, &streams, &retained, &retained_mu,
+                streamer.get(), &streamer_mu)
+        .detach();
+  }
   while (1) {
     SleepForSeconds(last_upload_secs + FLAGS_upload_every_secs -
                     GetCurrentTimeSeconds());
@@ -150,15 +458,62 @@ int main(int argc, char** argv) {
                            kNumNanosPerSecond);
     std::vector<std::unique_ptr<clerk::State>> states;
     processor.Gather(&states, false);
-    CombineGather(&states);
-    clerk::IPFIX* first = reinterpret_cast<clerk::IPFIX*>(states[0].get());
-    clerk::flow::Table f;
-    first->SwapFlows(&f);
-    AddASNsTo(&f, asns);
-    sender->Send(f);
+    std::vector<clerk::flow::Table> tables;
+    std::vector<uint32_t> intervals;
+    uint32_t interval;
+    std::vector<clerk::flow::Stats> unadmitted;
+    TakeFlows(&states, &tables, &intervals, &interval, &unadmitted);
+    states.clear();
+    // Each per-thread sender reports its own thread's sampling, and the
+    // others all threads'.  Unadmitted packets are reported once, by the
+    // sender that exports their thread's flows, and never by the streamer.
+    for (size_t i = 0; i < senders.size(); i++) {
+      senders[i]->SetSamplingInterval(FLAGS_flow_consistent_fanout
+                                          ? intervals[i]
+                                          : interval);
+    }
+    for (size_t i = 0; i < unadmitted.size(); i++) {
+      senders[FLAGS_flow_consistent_fanout ? i : 0]->AddUnadmitted(
+          unadmitted[i].packets, unadmitted[i].bytes);
+    }
+    if (streamer) {
+      streamer->SetSamplingInterval(interval);
+    }
+    if (FLAGS_flow_consistent_fanout) {
+      ExportPerThread(&tables, &pool, factory.CutoffNanos(),
+                      factory.MaxFlowsPerThread(), &retained, &retained_mu,
+                      senders);
+    } else {
+      std::vector<clerk::flow::Table> partitions;
+      partitions.reserve(retained.size());
+      for (size_t i = 0; i < retained.size(); i++) {
+        partitions.emplace_back(&partition_allocs[i]);
+      }
+      MergeTables(&tables, &pool, factory.CutoffNanos(),
+                  factory.MaxFlowsPerThread() * processor.NumThreads(),
+                  &retained, &retained_mu, &partitions);
+      senders[0]->Send(partitions);
+    }
+    double export_secs = GetCurrentTimeSeconds() - last_upload_secs;
+    if (export_secs > FLAGS_upload_every_secs) {
+      LOG(WARNING) << "Export took " << export_secs << " secs, overrunning "
+                   << "the " << FLAGS_upload_every_secs << " sec interval";
+    } else {
+      LOG(INFO) << "Export took " << export_secs << " secs";
+    }
+    size_t active = 0;
+    for (const auto& r : retained) {
+      active += r.tracked();
+    }
+    LOG(INFO) << "Retaining " << active << " active flows";
     if (last_upload_secs - last_asn_read_secs > FLAGS_asns_reread_every_secs) {
       last_asn_read_secs = last_upload_secs;
       ReadASNs(&asns);
+      if (streamer) {
+        clerk::ASNMap fresh(asns);
+        std::unique_lock<std::mutex> ml(streamer_mu);
+        streamer_asns.Swap(&fresh);
+      }
     }
   }
 }
@@ -0,0 +1,330 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "filter.h"
+
+#include <arpa/inet.h>  // inet_pton
+#include <ctype.h>
+#include <netinet/in.h>  // IPPROTO_*
+#include <stdlib.h>
+#include <string.h>
+
+#include <utility>
+
+namespace clerk {
+
+// Ast is an expression as parsed, before its sets are built.
+struct Filter::Ast {
+  explicit Ast(Kind k, Dir d = EITHER) : kind(k), dir(d), family(0) {}
+
+  // A net's address, in network order, and prefix length.
+  struct Prefix {
+    int family;  // 4 or 6
+    uint8_t addr[16];
+    int len;
+  };
+
+  Kind kind;
+  Dir dir;
+  int family;
+  std::vector<std::unique_ptr<Ast>> kids;
+  std::unique_ptr<Bits> bits;     // for VLAN, PROTO, and PORT
+  std::vector<Prefix> prefixes;  // for NET
+};
+
+// Parser is a recursive descent parser for the grammar in filter.h.
+class Filter::Parser {
+ public:
+  explicit Parser(const std::string& expr) : pos_(0) {
+    std::string token;
+    for (char c : expr) {
+      if (isspace(c) || c == '(' || c == ')') {
+        if (!token.empty()) tokens_.push_back(token);
+        token.clear();
+        if (c == '(' || c == ')') tokens_.push_back(std::string(1, c));
+      } else {
+        token += c;
+      }
+    }
+    if (!token.empty()) tokens_.push_back(token);
+  }
+
+  std::unique_ptr<Ast> Parse(std::string* error) {
+    auto ast = Expr();
+    if (ast && pos_ < tokens_.size()) {
+      ast = Fail("unexpected '" + tokens_[pos_] + "'");
+    }
+    if (!ast) *error = error_;
+    return ast;
+  }
+
+ private:
+  // Records the first error, and returns null for callers to pass on.
+  std::unique_ptr<Ast> Fail(const std::string& error) {
+    if (error_.empty()) error_ = error;
+    return nullptr;
+  }
+  bool Accept(const char* word) {
+    if (pos_ < tokens_.size() && tokens_[pos_] == word) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  std::unique_ptr<Ast> Expr() { return List(OR, "or", &Parser::Term); }
+  std::unique_ptr<Ast> Term() { return List(AND, "and", &Parser::Factor); }
+
+  // Parses a list of one or more items joined by 'op'.
+  std::unique_ptr<Ast> List(Kind kind, const char* op,
+                            std::unique_ptr<Ast> (Parser::*item)()) {
+    auto first = (this->*item)();
+    if (!first || pos_ == tokens_.size() || tokens_[pos_] != op) {
+      return first;
+    }
+    std::unique_ptr<Ast> list(new Ast(kind));
+    list->kids.push_back(std::move(first));
+    while (Accept(op)) {
+      auto next = (this->*item)();
+      if (!next) return nullptr;
+      list->kids.push_back(std::move(next));
+    }
+    if (kind == OR) MergeSets(list.get());
+    if (list->kids.size() == 1) return std::move(list->kids[0]);
+    return list;
+  }
+
+  // Merges an OR's primitives of the same kind and direction into one.
+  static void MergeSets(Ast* list) {
+    std::vector<std::unique_ptr<Ast>> kids;
+    for (auto& kid : list->kids) {
+      Ast* same = nullptr;
+      if (kid->bits || kid->kind == NET) {
+        for (auto& k : kids) {
+          if (k->kind == kid->kind && k->dir == kid->dir) same = k.get();
+        }
+      }
+      if (same == nullptr) {
+        kids.push_back(std::move(kid));
+      } else if (same->bits) {
+        same->bits->Or(*kid->bits);
+      } else {
+        same->prefixes.insert(same->prefixes.end(), kid->prefixes.begin(),
+                              kid->prefixes.end());
+      }
+    }
+    list->kids.swap(kids);
+  }
+
+  std::unique_ptr<Ast> Factor() {
+    if (Accept("not")) {
+      auto kid = Factor();
+      if (!kid) return nullptr;
+      std::unique_ptr<Ast> ast(new Ast(NOT));
+      ast->kids.push_back(std::move(kid));
+      return ast;
+    }
+    if (Accept("(")) {
+      auto ast = Expr();
+      if (ast && !Accept(")")) return Fail("missing ')'");
+      return ast;
+    }
+    return Primitive();
+  }
+
+  std::unique_ptr<Ast> Primitive() {
+    Dir dir = EITHER;
+    if (Accept("src")) {
+      dir = SRC;
+    } else if (Accept("dst")) {
+      dir = DST;
+    }
+    if (pos_ == tokens_.size()) return Fail("unexpected end of filter");
+    const std::string word = tokens_[pos_++];
+    if (dir != EITHER && word != "port" && word != "net" && word != "host") {
+      return Fail("'src' and 'dst' must be followed by 'port', 'net', or "
+                  "'host', not '" + word + "'");
+    }
+    if (word == "vlan") return Set(VLAN, EITHER, 4096);
+    if (word == "port") return Set(PORT, dir, 65536);
+    if (word == "proto") return Set(PROTO, EITHER, 256);
+    size_t protocol;
+    if (Protocol(word, &protocol)) {
+      std::unique_ptr<Ast> ast(new Ast(PROTO));
+      ast->bits.reset(new Bits(256));
+      ast->bits->Set(protocol);
+      return ast;
+    }
+    if (word == "net" || word == "host") {
+      if (pos_ == tokens_.size()) return Fail("missing address");
+      std::unique_ptr<Ast> ast(new Ast(NET, dir));
+      if (!AddPrefix(tokens_[pos_++], ast.get())) return nullptr;
+      return ast;
+    }
+    if (word == "multicast") {
+      std::unique_ptr<Ast> ast(new Ast(NET, DST));
+      AddPrefix("224.0.0.0/4", ast.get());
+      AddPrefix("ff00::/8", ast.get());
+      return ast;
+    }
+    if (word == "ip" || word == "ip6") {
+      std::unique_ptr<Ast> ast(new Ast(FAMILY));
+      ast->family = word == "ip" ? 4 : 6;
+      return ast;
+    }
+    return Fail("unknown primitive '" + word + "'");
+  }
+
+  // Parses a number or range of numbers, each less than 'size', into a set of
+  // that size.  Protocols may be given by name.
+  std::unique_ptr<Ast> Set(Kind kind, Dir dir, size_t size) {
+    if (pos_ == tokens_.size()) return Fail("missing number");
+    const std::string& token = tokens_[pos_++];
+    size_t from, to;
+    const auto dash = token.find('-');
+    if (kind == PROTO && Protocol(token, &from)) {
+      to = from;
+    } else if (!Number(token.substr(0, dash), &from) ||
+               !Number(dash == std::string::npos ? token
+                                                 : token.substr(dash + 1),
+                       &to) ||
+               from > to || to >= size) {
+      return Fail("bad number or range '" + token + "'");
+    }
+    std::unique_ptr<Ast> ast(new Ast(kind, dir));
+    ast->bits.reset(new Bits(size));
+    for (size_t i = from; i <= to; i++) {
+      ast->bits->Set(i);
+    }
+    return ast;
+  }
+
+  static bool Protocol(const std::string& name, size_t* protocol) {
+    const struct {
+      const char* name;
+      int protocol;
+    } protocols[] = {
+        {"tcp", IPPROTO_TCP},
+        {"udp", IPPROTO_UDP},
+        {"icmp", IPPROTO_ICMP},
+        {"icmp6", IPPROTO_ICMPV6},
+    };
+    for (const auto& p : protocols) {
+      if (name == p.name) {
+        *protocol = p.protocol;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool Number(const std::string& s, size_t* n) {
+    if (s.empty() || !isdigit(s[0])) return false;
+    char* end;
+    *n = strtoul(s.c_str(), &end, 10);
+    return *end == '\0';
+  }
+
+  // Parses an address with an optional prefix length into ast's prefixes.
+  bool AddPrefix(const std::string& token, Ast* ast) {
+    Ast::Prefix p;
+    memset(&p, 0, sizeof(p));
+    const auto slash = token.find('/');
+    const std::string addr = token.substr(0, slash);
+    p.family = addr.find(':') == std::string::npos ? 4 : 6;
+    const size_t max = p.family == 4 ? 32 : 128;
+    size_t len = max;
+    if (inet_pton(p.family == 4 ? AF_INET : AF_INET6, addr.c_str(), p.addr) !=
+            1 ||
+        (slash != std::string::npos &&
+         (!Number(token.substr(slash + 1), &len) || len > max))) {
+      Fail("bad address '" + token + "'");
+      return false;
+    }
+    p.len = len;
+    ast->prefixes.push_back(p);
+    return true;
+  }
+
+  std::vector<std::string> tokens_;
+  size_t pos_;  // of the next token
+  std::string error_;
+};
+
+std::unique_ptr<Filter> Filter::Compile(const std::string& expr,
+                                        std::string* error) {
+  auto ast = Parser(expr).Parse(error);
+  if (!ast) return nullptr;
+  std::unique_ptr<Filter> filter(new Filter());
+  filter->root_ = filter->Emit(*ast);
+  return filter;
+}
+
+size_t Filter::Emit(const Ast& ast) {
+  Node node;
+  node.kind = ast.kind;
+  node.dir = ast.dir;
+  node.family = ast.family;
+  node.set = 0;
+  for (const auto& kid : ast.kids) {
+    node.kids.push_back(Emit(*kid));
+  }
+  if (ast.bits) {
+    node.set = bits_.size();
+    bits_.push_back(*ast.bits);
+  }
+  if (ast.kind == NET) {
+    node.set = nets4_.size();
+    nets4_.emplace_back();
+    nets6_.emplace_back();
+    for (const auto& p : ast.prefixes) {
+      if (p.family == 4) {
+        nets4_.back().Add(p.addr, 4, p.len);
+      } else {
+        nets6_.back().Add(p.addr, 16, p.len);
+      }
+    }
+  }
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+void Filter::Prefixes::Add(const uint8_t* addr, size_t size,
+                           int prefix_len) {
+  if (prefix_len == 0) {
+    all_ = true;
+    return;
+  }
+  // Bytes before the last one the prefix touches each lead to a child.
+  const size_t last = (prefix_len - 1) / 8;
+  size_t n = 0;
+  for (size_t i = 0; i < last; i++) {
+    uint32_t next = nodes_[n].child[addr[i]];
+    if (next == 0) {
+      next = nodes_.size();
+      nodes_.emplace_back();
+      nodes_[n].child[addr[i]] = next;
+    }
+    n = next;
+  }
+  // The last byte matches every value its 1-8 prefix bits cover.
+  const uint8_t mask = 0xFF << (8 - (prefix_len - 8 * last));
+  const unsigned from = addr[last] & mask;
+  const unsigned to = from | uint8_t(~mask);
+  for (unsigned b = from; b <= to; b++) {
+    nodes_[n].match[b / 64] |= uint64_t(1) << (b % 64);
+  }
+}
+
+}  // namespace clerk
@@ -0,0 +1,194 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_FILTER_H_
+#define CLERK_FILTER_H_
+
+#include <arpa/inet.h>  // htonl
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "flow.h"
+#include "util.h"
+
+namespace clerk {
+
+// Filter decides which packets are worth tracking, from their flow keys, so
+// traffic we'd only throw away downstream never reaches a flow table.
+//
+// Filters are written in a small language, a little like tcpdump's:
+//
+//   expr := term ['or' term]...      term := factor ['and' factor]...
+//   factor := 'not' factor | '(' expr ')' | primitive
+//   primitive := 'vlan' N[-M]
+//              | 'proto' (tcp|udp|icmp|icmp6|N)  or just tcp, udp, icmp, icmp6
+//              | [src|dst] port N[-M]            (never matches ICMP)
+//              | [src|dst] net ADDR[/LEN]        (IPv4 or IPv6; 'host' too)
+//              | 'multicast'                     (by destination)
+//              | 'ip' | 'ip6'
+//
+// Without src or dst, ports and nets match either end.  A packet is tracked
+// if the expression matches it, so 'not vlan 100-110 and not multicast' drops
+// two VLANs' traffic and all multicast.
+//
+// Compiling turns each primitive into a set, so matching never loops over a
+// list:  VLANs, protocols, and ports into bitsets, and nets into prefix tries,
+// one per address family.  Primitives of the same kind and direction which are
+// or'd together share a single set, so 'port 22 or port 80 or port 443' costs
+// a single lookup.
+class Filter {
+ public:
+  // Returns the compiled filter, or nullptr with an explanation in 'error' if
+  // expr isn't valid.
+  static std::unique_ptr<Filter> Compile(const std::string& expr,
+                                         std::string* error);
+
+  bool Matches(const flow::Key4& key) const { return Eval(root_, key); }
+  bool Matches(const flow::Key6& key) const { return Eval(root_, key); }
+
+  // Number of nodes in the compiled expression, for testing.
+  size_t nodes() const { return nodes_.size(); }
+
+ private:
+  class Parser;
+  struct Ast;
+
+  // Bits is a fixed-size bitset.
+  class Bits {
+   public:
+    explicit Bits(size_t n) : words_((n + 63) / 64) {}
+    void Set(size_t i) { words_[i / 64] |= uint64_t(1) << (i % 64); }
+    bool Get(size_t i) const { return (words_[i / 64] >> (i % 64)) & 1; }
+    void Or(const Bits& b) {
+      for (size_t i = 0; i < words_.size(); i++) words_[i] |= b.words_[i];
+    }
+
+   private:
+    std::vector<uint64_t> words_;
+  };
+
+  // Prefixes is a set of address prefixes, as a trie with 8-bit strides.
+  // Prefixes whose length isn't a multiple of 8 are expanded into every byte
+  // value they cover at their last level, so a lookup reads at most one node
+  // per address byte, and stops at the first prefix that covers the address.
+  class Prefixes {
+   public:
+    Prefixes() : nodes_(1), all_(false) {}
+    // addr holds 'size' bytes, in network order.
+    void Add(const uint8_t* addr, size_t size, int prefix_len);
+    bool Contains(const uint8_t* addr, size_t size) const {
+      if (all_) return true;
+      size_t n = 0;
+      for (size_t i = 0; i < size; i++) {
+        const Node& node = nodes_[n];
+        const uint8_t b = addr[i];
+        if ((node.match[b / 64] >> (b % 64)) & 1) return true;
+        n = node.child[b];
+        if (n == 0) return false;
+      }
+      return false;
+    }
+
+   private:
+    struct Node {
+      Node() : child(), match() {}
+      uint32_t child[256];  // node index, or 0 for none
+      uint64_t match[4];    // bits set for bytes which complete a prefix
+    };
+    std::vector<Node> nodes_;  // nodes_[0] is the root
+    bool all_;                 // if we hold a zero-length prefix
+  };
+
+  enum Kind { AND, OR, NOT, VLAN, PROTO, PORT, NET, FAMILY };
+  enum Dir { SRC = 1, DST = 2, EITHER = SRC | DST };
+  struct Node {
+    Kind kind;
+    Dir dir;                   // for PORT and NET
+    int family;                // for FAMILY, 4 or 6
+    std::vector<size_t> kids;  // for AND, OR, and NOT
+    size_t set;  // for VLAN, PROTO, and PORT, index into bits_, for NET into
+                 // nets4_ and nets6_
+  };
+
+  Filter() : root_(0) {}
+  // Adds the nodes for ast, returning the index of its root.
+  size_t Emit(const Ast& ast);
+
+  // Returns whether node n matches key.
+  template <class K>
+  bool Eval(size_t n, const K& key) const;
+  static int Family(const flow::Key4&) { return 4; }
+  static int Family(const flow::Key6&) { return 6; }
+  bool Net(const Node& node, const flow::Key4& key) const {
+    const uint32_t src = htonl(key.src_ip), dst = htonl(key.dst_ip);
+    const Prefixes& p = nets4_[node.set];
+    return ((node.dir & SRC) &&
+            p.Contains(reinterpret_cast<const uint8_t*>(&src), 4)) ||
+           ((node.dir & DST) &&
+            p.Contains(reinterpret_cast<const uint8_t*>(&dst), 4));
+  }
+  bool Net(const Node& node, const flow::Key6& key) const {
+    const Prefixes& p = nets6_[node.set];
+    return ((node.dir & SRC) && p.Contains(key.src_ip.addr, 16)) ||
+           ((node.dir & DST) && p.Contains(key.dst_ip.addr, 16));
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<Bits> bits_;
+  std::vector<Prefixes> nets4_;
+  std::vector<Prefixes> nets6_;
+  size_t root_;
+
+  DISALLOW_COPY_AND_ASSIGN(Filter);
+};
+
+template <class K>
+inline bool Filter::Eval(size_t n, const K& key) const {
+  const Node& node = nodes_[n];
+  switch (node.kind) {
+    case AND:
+      for (size_t kid : node.kids) {
+        if (!Eval(kid, key)) return false;
+      }
+      return true;
+    case OR:
+      for (size_t kid : node.kids) {
+        if (Eval(kid, key)) return true;
+      }
+      return false;
+    case NOT:
+      return !Eval(node.kids[0], key);
+    case VLAN:
+      return bits_[node.set].Get(key.vlan & 0x0FFF);
+    case PROTO:
+      return bits_[node.set].Get(key.protocol);
+    case PORT:
+      // ICMP keeps its type and code in dst_port, which aren't ports.
+      return !key.is_icmp() &&
+             (((node.dir & SRC) && bits_[node.set].Get(key.src_port)) ||
+              ((node.dir & DST) && bits_[node.set].Get(key.dst_port)));
+    case NET:
+      return Net(node, key);
+    case FAMILY:
+      return node.family == Family(key);
+  }
+  return false;
+}
+
+}  // namespace clerk
+
+#endif  // CLERK_FILTER_H_
@@ -0,0 +1,159 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+
+#include "filter.h"
+
+namespace clerk {
+
+using flow::Key4;
+using flow::Key6;
+
+class FilterTest : public ::testing::Test {
+ protected:
+  // Returns whether filter expr matches key, failing if it doesn't compile.
+  template <class K>
+  bool Match(const std::string& expr, const K& key) {
+    std::string error;
+    auto f = Filter::Compile(expr, &error);
+    EXPECT_TRUE(f != nullptr) << expr << ": " << error;
+    return f != nullptr && f->Matches(key);
+  }
+  Key4 V4(const char* src, const char* dst, uint8_t protocol,
+          uint16_t src_port, uint16_t dst_port, uint16_t vlan = 0) {
+    Key4 k;
+    inet_pton(AF_INET, src, &k.src_ip);
+    inet_pton(AF_INET, dst, &k.dst_ip);
+    k.src_ip = ntohl(k.src_ip);
+    k.dst_ip = ntohl(k.dst_ip);
+    k.protocol = protocol;
+    k.src_port = src_port;
+    k.dst_port = dst_port;
+    k.vlan = vlan;
+    return k;
+  }
+  Key6 V6(const char* src, const char* dst, uint8_t protocol,
+          uint16_t src_port, uint16_t dst_port) {
+    Key6 k;
+    inet_pton(AF_INET6, src, k.src_ip.addr);
+    inet_pton(AF_INET6, dst, k.dst_ip.addr);
+    k.protocol = protocol;
+    k.src_port = src_port;
+    k.dst_port = dst_port;
+    return k;
+  }
+};
+
+TEST_F(FilterTest, TestErrors) {
+  for (const char* expr : {"", "vlan", "vlan 4096", "vlan 3-2", "vlan x",
+                           "port 65536", "port 1-", "proto 256", "src vlan 1",
+                           "net 1.2.3.4/33", "net ::1/129", "net 1.2.3",
+                           "host", "bogus", "tcp and", "(tcp", "tcp)",
+                           "not", "tcp udp"}) {
+    std::string error;
+    EXPECT_TRUE(Filter::Compile(expr, &error) == nullptr) << expr;
+    EXPECT_FALSE(error.empty()) << expr;
+  }
+}
+
+TEST_F(FilterTest, TestPrimitives) {
+  const Key4 k = V4("10.1.2.3", "192.168.0.1", IPPROTO_TCP, 1234, 80, 7);
+  EXPECT_TRUE(Match("vlan 7", k));
+  EXPECT_TRUE(Match("vlan 5-10", k));
+  EXPECT_FALSE(Match("vlan 8", k));
+  EXPECT_TRUE(Match("tcp", k));
+  EXPECT_TRUE(Match("proto tcp", k));
+  EXPECT_TRUE(Match("proto 6", k));
+  EXPECT_FALSE(Match("udp", k));
+  EXPECT_TRUE(Match("port 80", k));
+  EXPECT_TRUE(Match("port 1234", k));
+  EXPECT_TRUE(Match("dst port 80", k));
+  EXPECT_FALSE(Match("src port 80", k));
+  EXPECT_TRUE(Match("src port 1000-2000", k));
+  EXPECT_TRUE(Match("net 10.0.0.0/8", k));
+  EXPECT_TRUE(Match("src net 10.1.2.0/23", k));
+  EXPECT_FALSE(Match("dst net 10.0.0.0/8", k));
+  EXPECT_TRUE(Match("dst host 192.168.0.1", k));
+  EXPECT_FALSE(Match("host 192.168.0.2", k));
+  EXPECT_TRUE(Match("net 0.0.0.0/0", k));
+  EXPECT_TRUE(Match("net 192.168.0.0/17", k));
+  EXPECT_FALSE(Match("net 192.168.128.0/17", k));
+  EXPECT_TRUE(Match("ip", k));
+  EXPECT_FALSE(Match("ip6", k));
+  EXPECT_FALSE(Match("multicast", k));
+  EXPECT_TRUE(
+      Match("multicast", V4("10.0.0.1", "239.1.1.1", IPPROTO_UDP, 1, 2)));
+}
+
+TEST_F(FilterTest, TestICMPHasNoPorts) {
+  Key4 k = V4("1.1.1.1", "2.2.2.2", IPPROTO_ICMP, 0, 0);
+  k.set_icmp(8, 0);  // echo request, stored as dst_port 0x0800
+  EXPECT_FALSE(Match("port 2048", k));
+  EXPECT_FALSE(Match("port 0-65535", k));
+  EXPECT_TRUE(Match("icmp", k));
+}
+
+TEST_F(FilterTest, TestIPv6) {
+  const Key6 k = V6("2001:db8::1", "ff02::1", IPPROTO_UDP, 546, 547);
+  EXPECT_TRUE(Match("ip6", k));
+  EXPECT_TRUE(Match("multicast", k));
+  EXPECT_TRUE(Match("src net 2001:db8::/32", k));
+  EXPECT_TRUE(Match("src net 2001:db8::/33", k));
+  EXPECT_FALSE(Match("src net 2001:db9::/32", k));
+  EXPECT_TRUE(Match("host 2001:db8::1", k));
+  EXPECT_FALSE(Match("host 2001:db8::2", k));
+  // IPv4 nets never match IPv6 addresses, and vice versa.
+  EXPECT_FALSE(Match("net 0.0.0.0/0", k));
+  EXPECT_TRUE(Match("net 0.0.0.0/0 or net ::/0", k));
+  EXPECT_FALSE(
+      Match("net ::/0", V4("1.1.1.1", "2.2.2.2", IPPROTO_UDP, 1, 2)));
+}
+
+TEST_F(FilterTest, TestLogic) {
+  const Key4 k = V4("10.1.2.3", "192.168.0.1", IPPROTO_TCP, 1234, 80, 7);
+  EXPECT_TRUE(Match("not udp", k));
+  EXPECT_FALSE(Match("not not udp", k));
+  EXPECT_TRUE(Match("tcp and port 80", k));
+  EXPECT_FALSE(Match("tcp and port 81", k));
+  EXPECT_TRUE(Match("udp or port 80", k));
+  // 'and' binds tighter than 'or'.
+  EXPECT_TRUE(Match("tcp or udp and port 81", k));
+  EXPECT_FALSE(Match("(tcp or udp) and port 81", k));
+  EXPECT_TRUE(Match("not vlan 100-110 and not multicast", k));
+  EXPECT_FALSE(Match("not (vlan 7 or multicast)", k));
+}
+
+TEST_F(FilterTest, TestMergesOr) {
+  std::string error;
+  auto nodes = [&error](const char* expr) {
+    return Filter::Compile(expr, &error)->nodes();
+  };
+  EXPECT_EQ(nodes("vlan 1 or vlan 2 or vlan 3"), 1u);
+  EXPECT_EQ(nodes("port 22 or port 80 or tcp"), 3u);
+  // Different directions can't share a set.
+  EXPECT_EQ(nodes("src port 1 or dst port 2"), 3u);
+  auto f = Filter::Compile(
+      "net 10.0.0.0/8 or udp or net 2001:db8::/32 or host 1.2.3.4", &error);
+  EXPECT_EQ(f->nodes(), 3u);
+  EXPECT_TRUE(f->Matches(V4("9.9.9.9", "1.2.3.4", IPPROTO_TCP, 1, 2)));
+  EXPECT_TRUE(f->Matches(V4("10.9.9.9", "9.9.9.9", IPPROTO_TCP, 1, 2)));
+  EXPECT_FALSE(f->Matches(V4("9.9.9.9", "9.9.9.9", IPPROTO_TCP, 1, 2)));
+  EXPECT_TRUE(f->Matches(V6("2001:db8::5", "::1", IPPROTO_TCP, 1, 2)));
+  EXPECT_FALSE(f->Matches(V6("2001:db9::5", "::1", IPPROTO_TCP, 1, 2)));
+}
+
+}  // namespace clerk
@@ -0,0 +1,495 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_FLAT_MAP_H_
+#define CLERK_FLAT_MAP_H_
+
+// FlatMap is an open-addressing hash map in the style of a Swiss table, built
+// for the small, trivially copyable keys and values we keep per flow.
+//
+// All slots live in a single flat array, so a lookup touches one metadata
+// group and (usually) one slot, instead of chasing a bucket list of
+// individually allocated nodes.  Each slot has a one-byte control value:
+//
+//   0x00        empty
+//   0x01        deleted (tombstone)
+//   0x80 | h2   full, where h2 is the low 7 bits of the key's hash
+//
+// Slots are grouped into aligned groups of kGroupWidth.  A lookup picks a
+// starting group from the high bits of the hash, then compares all control
+// bytes in the group against h2 at once (with SSE2 when available), only
+// comparing full keys on h2 matches.  Probing moves on to further groups in a
+// triangular sequence until it finds the key or a group with an empty slot.
+//
+// Slots of up to a cache line are padded to a power-of-two size and aligned to
+// it, so that looking at a single slot never touches two cache lines.
+//
+// Note that an all-zero block of memory is a valid, empty control array.
+//
+// Storage comes from an optional SlabAllocator, which lets tables that are
+// rebuilt every interval reuse the same memory instead of going to malloc.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+#include "slab.h"
+
+namespace clerk {
+
+namespace internal {  // exposed just for testing.
+
+const size_t kGroupWidth = 16;
+const uint8_t kCtrlEmpty = 0x00;
+const uint8_t kCtrlDeleted = 0x01;
+const uint8_t kCtrlFull = 0x80;
+
+// Group provides bitmasks over kGroupWidth control bytes.  Bit i of a returned
+// mask corresponds to control byte i.
+class Group {
+ public:
+  explicit Group(const uint8_t* ctrl) {
+#ifdef __SSE2__
+    ctrl_ = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+    memcpy(ctrl_, ctrl, kGroupWidth);
+#endif
+  }
+
+  // Bits set for all full slots with the given h2.
+  uint32_t Match(uint8_t h2) const {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl_, _mm_set1_epi8(kCtrlFull | h2)));
+#else
+    return Mask(kCtrlFull | h2);
+#endif
+  }
+  // Bits set for all empty slots.
+  uint32_t MatchEmpty() const {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_, _mm_setzero_si128()));
+#else
+    return Mask(kCtrlEmpty);
+#endif
+  }
+  // Bits set for all full slots.
+  uint32_t MatchFull() const {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(ctrl_);
+#else
+    uint32_t out = 0;
+    for (size_t i = 0; i < kGroupWidth; i++) {
+      if (ctrl_[i] & kCtrlFull) out |= 1 << i;
+    }
+    return out;
+#endif
+  }
+  // Bits set for all slots that are empty or deleted.
+  uint32_t MatchAvailable() const { return ~MatchFull() & 0xFFFF; }
+
+ private:
+#ifdef __SSE2__
+  __m128i ctrl_;
+#else
+  uint32_t Mask(uint8_t want) const {
+    uint32_t out = 0;
+    for (size_t i = 0; i < kGroupWidth; i++) {
+      if (ctrl_[i] == want) out |= 1 << i;
+    }
+    return out;
+  }
+  uint8_t ctrl_[kGroupWidth];
+#endif
+};
+
+inline size_t LowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+
+// SlotAlignment returns the alignment (and thus padded size) we use for slots
+// holding values of the given size and natural alignment.
+constexpr size_t SlotAlignment(size_t size, size_t align, size_t pow2 = 1) {
+  return size > 64 ? align
+                   : pow2 >= size ? (pow2 > align ? pow2 : align)
+                                  : SlotAlignment(size, align, pow2 * 2);
+}
+
+}  // namespace internal
+
+template <class K, class V, class Hash = std::hash<K>>
+class FlatMap {
+ public:
+  typedef std::pair<K, V> value_type;
+  typedef Hash hasher;
+
+  template <class M, class T>
+  class Iterator {
+   public:
+    Iterator() : map_(nullptr), i_(0) {}
+    T& operator*() const { return map_->slots_[i_].v; }
+    T* operator->() const { return &map_->slots_[i_].v; }
+    Iterator& operator++() {
+      i_ = map_->NextFull(i_ + 1);
+      return *this;
+    }
+    bool operator==(const Iterator& o) const { return i_ == o.i_; }
+    bool operator!=(const Iterator& o) const { return i_ != o.i_; }
+
+   private:
+    friend class FlatMap;
+    Iterator(M* map, size_t i) : map_(map), i_(i) {}
+    M* map_;
+    size_t i_;
+  };
+  typedef Iterator<FlatMap, value_type> iterator;
+  typedef Iterator<const FlatMap, const value_type> const_iterator;
+
+  // If alloc is non-null, it must outlive this map, and will be used for all
+  // of its storage.  Otherwise, storage comes directly from the system.
+  explicit FlatMap(SlabAllocator* alloc = nullptr)
+      : alloc_(alloc),
+        ctrl_(nullptr),
+        slots_(nullptr),
+        capacity_(0),
+        size_(0),
+        deleted_(0) {
+    static_assert(std::is_trivially_copyable<K>::value,
+                  "FlatMap keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable<V>::value,
+                  "FlatMap values must be trivially copyable");
+  }
+  FlatMap(const FlatMap& other) : FlatMap(other.alloc_) { *this = other; }
+  FlatMap(FlatMap&& other) : FlatMap() { swap(other); }
+  ~FlatMap() { Free(); }
+
+  FlatMap& operator=(const FlatMap& other) {
+    if (this == &other) return *this;
+    Free();
+    if (other.capacity_) {
+      Allocate(other.capacity_);
+      memcpy(ctrl_, other.ctrl_, capacity_);
+      memcpy(static_cast<void*>(slots_), other.slots_,
+             capacity_ * sizeof(Slot));
+      size_ = other.size_;
+      deleted_ = other.deleted_;
+    }
+    return *this;
+  }
+  FlatMap& operator=(FlatMap&& other) {
+    swap(other);
+    return *this;
+  }
+
+  void swap(FlatMap& other) {
+    std::swap(alloc_, other.alloc_);
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(deleted_, other.deleted_);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Number of slots in the table, analogous to unordered_map's buckets.
+  size_t bucket_count() const { return capacity_; }
+
+  iterator begin() { return iterator(this, NextFull(0)); }
+  iterator end() { return iterator(this, capacity_); }
+  const_iterator begin() const { return const_iterator(this, NextFull(0)); }
+  const_iterator end() const { return const_iterator(this, capacity_); }
+
+  iterator find(const K& key) { return find(key, hash(key)); }
+  const_iterator find(const K& key) const { return find(key, hash(key)); }
+
+  // Batched lookups.  Looking up a key in a big table usually means two cache
+  // misses, one for its group's control bytes and one for its slot.  Callers
+  // with many keys to look up can overlap those misses:  compute each key's
+  // hash, Prefetch(hash) each, PrefetchSlot(hash) each (by which time its
+  // control bytes should have arrived), then find or emplace each with its
+  // precomputed hash.
+  size_t hash(const K& key) const { return Hash()(key); }
+  void Prefetch(size_t hash) const {
+    if (capacity_) __builtin_prefetch(ctrl_ + GroupFor(hash));
+  }
+  // Prefetches the first slot in hash's group whose control byte matches.
+  void PrefetchSlot(size_t hash) const {
+    if (!capacity_) return;
+    const size_t base = GroupFor(hash);
+    uint32_t m = internal::Group(ctrl_ + base).Match(H2(hash));
+    if (m) __builtin_prefetch(&slots_[base + internal::LowestBit(m)]);
+  }
+  iterator find(const K& key, size_t hash) {
+    return iterator(this, Find(key, hash));
+  }
+  const_iterator find(const K& key, size_t hash) const {
+    return const_iterator(this, Find(key, hash));
+  }
+
+  // Returns the first entry at or after slot i % bucket_count(), wrapping
+  // around if necessary, which is handy for sampling entries.  The map must
+  // not be empty.
+  iterator SampleAt(size_t i) {
+    DCHECK_NE(size_, 0);
+    size_t j = NextFull(i & (capacity_ - 1));
+    return iterator(this, j == capacity_ ? NextFull(0) : j);
+  }
+
+  // Slot index of an entry, and the entry at a slot index, for callers that
+  // remember where entries live.  Entries move when the map is rehashed, and
+  // slots are reused after erases, so AtIndex may return end() or some other
+  // entry:  callers must check it's the entry they expect.
+  size_t index(const_iterator it) const { return it.i_; }
+  size_t index(iterator it) const { return it.i_; }
+  void PrefetchIndex(size_t i) const {
+    if (i < capacity_) __builtin_prefetch(&slots_[i]);
+  }
+  iterator AtIndex(size_t i) {
+    if (i >= capacity_ || !(ctrl_[i] & internal::kCtrlFull)) return end();
+    return iterator(this, i);
+  }
+
+  // Inserts key/value if key is not yet present.  Returns an iterator to the
+  // key's entry, and whether an insertion happened.  Like
+  // unordered_map::emplace, an existing value is left unmodified.
+  std::pair<iterator, bool> emplace(const K& key, const V& value) {
+    return emplace(key, value, hash(key));
+  }
+  // As above, with key's precomputed hash.
+  std::pair<iterator, bool> emplace(const K& key, const V& value,
+                                    size_t hash) {
+    size_t available = capacity_;
+    size_t i = FindOrAvailable(key, hash, &available);
+    if (i != capacity_) {
+      return std::make_pair(iterator(this, i), false);
+    }
+    if (available == capacity_ ||
+        (ctrl_[available] == internal::kCtrlEmpty &&
+         size_ + deleted_ + 1 > GrowthLimit(capacity_))) {
+      // We need more room, or we'd go past our maximum load by filling an
+      // empty slot.  Rehash, then find where our key goes in the new table.
+      // If it's mostly tombstones that fill us, we rehash at the same size,
+      // so tables which churn at a fixed size (say, evicting to stay under
+      // a flow limit) don't keep growing.
+      Rehash((size_ + 1) * 32 > capacity_ * 25
+                 ? std::max(capacity_ * 2, internal::kGroupWidth)
+                 : capacity_);
+      FindOrAvailable(key, hash, &available);
+      CHECK_NE(available, capacity_);
+    }
+    if (ctrl_[available] == internal::kCtrlDeleted) {
+      deleted_--;
+    }
+    SetCtrl(available, internal::kCtrlFull | H2(hash));
+    slots_[available].v.first = key;
+    slots_[available].v.second = value;
+    size_++;
+    return std::make_pair(iterator(this, available), true);
+  }
+
+  // Removes the entry at 'pos', returning an iterator to the next entry.
+  iterator erase(iterator pos) {
+    size_t i = pos.i_;
+    DCHECK(ctrl_[i] & internal::kCtrlFull);
+    // If this slot's group already has an empty slot, no probe sequence has
+    // ever continued past it, so we can safely mark this slot empty instead of
+    // leaving a tombstone.
+    size_t group = i & ~(internal::kGroupWidth - 1);
+    if (internal::Group(ctrl_ + group).MatchEmpty()) {
+      SetCtrl(i, internal::kCtrlEmpty);
+    } else {
+      SetCtrl(i, internal::kCtrlDeleted);
+      deleted_++;
+    }
+    size_--;
+    return iterator(this, NextFull(i + 1));
+  }
+  size_t erase(const K& key) {
+    auto it = find(key);
+    if (it == end()) return 0;
+    erase(it);
+    return 1;
+  }
+
+  void clear() {
+    if (capacity_) memset(ctrl_, internal::kCtrlEmpty, capacity_);
+    size_ = 0;
+    deleted_ = 0;
+  }
+
+  // Makes room for at least n entries without further rehashing.  Like
+  // unordered_map::reserve, this may also shrink the table, if n (and the
+  // current size) fit in fewer slots than we currently have.
+  void reserve(size_t n) {
+    if (n < size_) n = size_;
+    size_t want = CapacityFor(n);
+    if (want != capacity_ || deleted_) {
+      Rehash(want);
+    }
+  }
+
+ private:
+  static size_t H1(size_t hash) { return hash >> 7; }
+  static uint8_t H2(size_t hash) { return hash & 0x7F; }
+  // Offset of the first group in hash's probe sequence.
+  size_t GroupFor(size_t hash) const {
+    return (H1(hash) & (capacity_ / internal::kGroupWidth - 1)) *
+           internal::kGroupWidth;
+  }
+  // We allow tables to fill up to 7/8 of their slots before growing.
+  static size_t GrowthLimit(size_t capacity) {
+    return capacity - capacity / 8;
+  }
+  static size_t CapacityFor(size_t n) {
+    if (n == 0) return 0;
+    size_t capacity = internal::kGroupWidth;
+    while (GrowthLimit(capacity) < n) capacity *= 2;
+    return capacity;
+  }
+
+  void SetCtrl(size_t i, uint8_t c) { ctrl_[i] = c; }
+
+  // Returns the first full slot at or after i, or capacity_ if none.
+  size_t NextFull(size_t i) const {
+    while (i < capacity_) {
+      size_t group = i & ~(internal::kGroupWidth - 1);
+      uint32_t full =
+          internal::Group(ctrl_ + group).MatchFull() >> (i - group);
+      if (full) return i + internal::LowestBit(full);
+      i = group + internal::kGroupWidth;
+    }
+    return capacity_;
+  }
+
+  size_t Find(const K& key, size_t hash) const {
+    size_t ignored;
+    return FindOrAvailable(key, hash, &ignored);
+  }
+
+  // Probes for key.  Returns its slot if found, or capacity_ if not.  If not
+  // found, *available is set to the first empty-or-deleted slot on the key's
+  // probe sequence, or capacity_ if the table is full.
+  size_t FindOrAvailable(const K& key, size_t hash, size_t* available) const {
+    *available = capacity_;
+    if (capacity_ == 0) return capacity_;
+    const size_t group_mask = capacity_ / internal::kGroupWidth - 1;
+    const uint8_t h2 = H2(hash);
+    size_t group = H1(hash) & group_mask;
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+      const size_t base = group * internal::kGroupWidth;
+      internal::Group g(ctrl_ + base);
+      for (uint32_t m = g.Match(h2); m; m &= m - 1) {
+        size_t i = base + internal::LowestBit(m);
+        if (__builtin_expect(slots_[i].v.first == key, true)) return i;
+      }
+      if (*available == capacity_) {
+        uint32_t avail = g.MatchAvailable();
+        if (avail) *available = base + internal::LowestBit(avail);
+      }
+      if (g.MatchEmpty()) break;
+      group = (group + step) & group_mask;
+    }
+    return capacity_;
+  }
+
+  struct alignas(internal::SlotAlignment(sizeof(value_type),
+                                          alignof(value_type))) Slot {
+    value_type v;
+  };
+  static const size_t kBlockAlign =
+      alignof(Slot) > internal::kGroupWidth ? alignof(Slot)
+                                            : internal::kGroupWidth;
+  static_assert(kBlockAlign <= SlabAllocator::kAlignment,
+                "SlabAllocator blocks aren't aligned enough for our slots");
+
+  // Control bytes come first in our block, padded so slots stay aligned.
+  static size_t CtrlSize(size_t capacity) {
+    return (capacity + kBlockAlign - 1) & ~(kBlockAlign - 1);
+  }
+  static size_t BlockSize(size_t capacity) {
+    return CtrlSize(capacity) + capacity * sizeof(Slot);
+  }
+  void Allocate(size_t capacity) {
+    capacity_ = capacity;
+    char* block;
+    if (alloc_) {
+      // Empty control bytes are zero, so a block with its control bytes zeroed
+      // is an empty table.
+      block = reinterpret_cast<char*>(
+          alloc_->Allocate(BlockSize(capacity), capacity));
+    } else {
+      block = reinterpret_cast<char*>(
+          aligned_alloc(kBlockAlign, BlockSize(capacity)));
+      CHECK(block != nullptr) << "Failed to allocate " << capacity << " slots";
+      memset(block, internal::kCtrlEmpty, capacity);
+    }
+    ctrl_ = reinterpret_cast<uint8_t*>(block);
+    slots_ = reinterpret_cast<Slot*>(block + CtrlSize(capacity));
+    size_ = 0;
+    deleted_ = 0;
+  }
+  void Free() {
+    if (alloc_) {
+      // Zero our control bytes now, so whoever allocates this block next
+      // needn't.  Tables are mostly freed on the main thread, and allocated
+      // on packet threads.
+      if (capacity_) memset(ctrl_, internal::kCtrlEmpty, capacity_);
+      alloc_->Free(ctrl_, BlockSize(capacity_), capacity_);
+    } else {
+      free(ctrl_);
+    }
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = size_ = deleted_ = 0;
+  }
+
+  void Rehash(size_t capacity) {
+    if (capacity < CapacityFor(size_)) capacity = CapacityFor(size_);
+    FlatMap old(alloc_);
+    swap(old);
+    if (capacity == 0) return;
+    Allocate(capacity);
+    for (size_t i = old.NextFull(0); i < old.capacity_;
+         i = old.NextFull(i + 1)) {
+      const value_type& v = old.slots_[i].v;
+      size_t hash = Hash()(v.first);
+      size_t available;
+      FindOrAvailable(v.first, hash, &available);
+      SetCtrl(available, internal::kCtrlFull | H2(hash));
+      slots_[available].v = v;
+      size_++;
+    }
+  }
+
+  SlabAllocator* alloc_;
+  uint8_t* ctrl_;
+  Slot* slots_;
+  size_t capacity_;
+  size_t size_;
+  size_t deleted_;
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_FLAT_MAP_H_
@@ -0,0 +1,174 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <map>
+
+#include <gtest/gtest.h>
+
+#include "flat_map.h"
+
+namespace clerk {
+
+class GroupTest : public ::testing::Test {};
+
+TEST_F(GroupTest, TestMatch) {
+  alignas(16) uint8_t ctrl[internal::kGroupWidth] = {0};
+  ctrl[1] = internal::kCtrlFull | 5;
+  ctrl[3] = internal::kCtrlDeleted;
+  ctrl[7] = internal::kCtrlFull | 5;
+  ctrl[15] = internal::kCtrlFull | 6;
+  internal::Group g(ctrl);
+  EXPECT_EQ(g.Match(5), (1 << 1) | (1 << 7));
+  EXPECT_EQ(g.Match(6), 1 << 15);
+  EXPECT_EQ(g.Match(7), 0);
+  EXPECT_EQ(g.MatchFull(), (1 << 1) | (1 << 7) | (1 << 15));
+  EXPECT_EQ(g.MatchEmpty(), 0xFFFF & ~((1 << 1) | (1 << 3) | (1 << 7) |
+                                       (1 << 15)));
+  EXPECT_EQ(g.MatchAvailable(), 0xFFFF & ~((1 << 1) | (1 << 7) | (1 << 15)));
+}
+
+// BadHash sends every key to the same group with the same h2, so we exercise
+// probing across groups and key comparison on h2 collisions.
+struct BadHash {
+  size_t operator()(int) const { return 0; }
+};
+
+class FlatMapTest : public ::testing::Test {};
+
+TEST_F(FlatMapTest, TestInsertFind) {
+  FlatMap<int, int> m;
+  EXPECT_TRUE(m.empty());
+  EXPECT_TRUE(m.find(1) == m.end());
+  for (int i = 0; i < 1000; i++) {
+    auto got = m.emplace(i, i * 2);
+    EXPECT_TRUE(got.second);
+    EXPECT_EQ(got.first->first, i);
+    EXPECT_EQ(got.first->second, i * 2);
+  }
+  EXPECT_EQ(m.size(), 1000);
+  for (int i = 0; i < 1000; i++) {
+    auto got = m.emplace(i, 0);
+    EXPECT_FALSE(got.second);
+    EXPECT_EQ(got.first->second, i * 2);
+    ASSERT_TRUE(m.find(i) != m.end());
+    EXPECT_EQ(m.find(i)->second, i * 2);
+  }
+  EXPECT_TRUE(m.find(1000) == m.end());
+}
+
+TEST_F(FlatMapTest, TestCollisions) {
+  FlatMap<int, int, BadHash> m;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(m.emplace(i, i).second);
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(m.find(i) != m.end());
+    EXPECT_EQ(m.find(i)->second, i);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    EXPECT_EQ(m.erase(i), 1);
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(m.find(i) != m.end(), i % 2 == 1) << i;
+  }
+}
+
+TEST_F(FlatMapTest, TestEraseAndIterate) {
+  FlatMap<int, int> m;
+  std::map<int, int> want;
+  for (int i = 0; i < 5000; i++) {
+    m.emplace(i, i);
+    want[i] = i;
+  }
+  for (auto iter = m.begin(); iter != m.end();) {
+    if (iter->first % 3 == 0) {
+      want.erase(iter->first);
+      iter = m.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  std::map<int, int> got;
+  for (const auto& iter : m) {
+    got[iter.first] = iter.second;
+  }
+  EXPECT_EQ(got, want);
+  EXPECT_EQ(m.size(), want.size());
+  // Reinserting over tombstones must neither duplicate nor lose entries.
+  for (int i = 0; i < 5000; i++) {
+    m.emplace(i, -1);
+  }
+  EXPECT_EQ(m.size(), 5000);
+  for (int i = 0; i < 5000; i++) {
+    EXPECT_EQ(m.find(i)->second, i % 3 == 0 ? -1 : i);
+  }
+}
+
+TEST_F(FlatMapTest, TestReserveShrinks) {
+  FlatMap<int, int> m;
+  for (int i = 0; i < 10000; i++) {
+    m.emplace(i, i);
+  }
+  size_t big = m.bucket_count();
+  for (auto iter = m.begin(); iter != m.end();) {
+    iter = iter->first < 100 ? ++iter : m.erase(iter);
+  }
+  m.reserve(200);
+  EXPECT_LT(m.bucket_count(), big);
+  EXPECT_EQ(m.size(), 100);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(m.find(i)->second, i);
+  }
+}
+
+TEST_F(FlatMapTest, TestCopySwap) {
+  FlatMap<int, int> a;
+  for (int i = 0; i < 100; i++) {
+    a.emplace(i, i);
+  }
+  FlatMap<int, int> b(a);
+  a.clear();
+  EXPECT_EQ(a.size(), 0);
+  EXPECT_TRUE(a.find(5) == a.end());
+  EXPECT_EQ(b.size(), 100);
+  EXPECT_EQ(b.find(5)->second, 5);
+  a.swap(b);
+  EXPECT_EQ(a.size(), 100);
+  EXPECT_EQ(b.size(), 0);
+}
+
+TEST_F(FlatMapTest, TestBatched) {
+  FlatMap<int, int> m;
+  // Prefetching an empty map is harmless.
+  m.Prefetch(m.hash(1));
+  m.PrefetchSlot(m.hash(1));
+  size_t hashes[100];
+  for (int i = 0; i < 100; i++) {
+    hashes[i] = m.hash(i);
+    m.Prefetch(hashes[i]);
+    m.PrefetchSlot(hashes[i]);
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(m.emplace(i, i, hashes[i]).second);
+  }
+  for (int i = 0; i < 100; i++) {
+    m.PrefetchSlot(hashes[i]);
+    ASSERT_TRUE(m.find(i, hashes[i]) != m.end());
+    EXPECT_EQ(m.find(i, hashes[i]), m.find(i));
+    EXPECT_EQ(m.index(m.find(i)), m.index(m.AtIndex(m.index(m.find(i)))));
+  }
+  EXPECT_TRUE(m.AtIndex(m.bucket_count()) == m.end());
+}
+
+}  // namespace clerk
@@ -13,27 +13,29 @@
 // limitations under the License.
 #include "flow.h"
 
+#include <stdint.h>
+
+#include <algorithm>
+
 #include <glog/logging.h>
-#include <city.h>
 
 
 namespace clerk {
 namespace flow {
 
-Key::Key() { memset(this, 0, sizeof(*this)); }
-
-bool Key::operator==(const Key& other) const {
-  return memcmp(this, &other, sizeof(Key)) == 0;
-}
-
-size_t Key::hash() const {
-  return CityHash64(reinterpret_cast<const char*>(this), sizeof(*this));
-}
+template struct Key<uint32_t>;
+template struct Key<IP6>;
 
 Stats::Stats() { memset(this, 0, sizeof(*this)); }
 
 Stats::Stats(uint64_t b, uint64_t p, uint64_t ts_ns)
-    : bytes(b), packets(p), tcp_flags(0), first_ns(ts_ns), last_ns(ts_ns) {}
+    : bytes(b),
+      packets(p),
+      first_ns(ts_ns),
+      last_ns(ts_ns),
+      tcp_flags(0),
+      end_reason(0),
+      timer(0) {}
 
 const Stats& Stats::operator+=(const Stats& f) {
   bytes += f.bytes;
@@ -44,20 +46,211 @@ const Stats& Stats::operator+=(const Stats& f) {
   return *this;
 }
 
-const Stats& AddToTable(Table* t, const Key& key, const Stats& stats) {
-  auto finder = t->find(key);
-  if (finder == t->end()) {
-    auto emplaced = t->emplace(key, stats);
-    return emplaced.first->second;
+void CombineTable(Table* dst, const Table& src) {
+  for (const auto& iter : src.v4.table) {
+    AddToTable(&dst->v4.table, iter.first, iter.second);
+  }
+  for (const auto& iter : src.v6.table) {
+    AddToTable(&dst->v6.table, iter.first, iter.second);
   }
-  finder->second += stats;
-  return finder->second;
+  dst->v4.ended.insert(dst->v4.ended.end(), src.v4.ended.begin(),
+                       src.v4.ended.end());
+  dst->v6.ended.insert(dst->v6.ended.end(), src.v6.ended.begin(),
+                       src.v6.ended.end());
 }
 
-void CombineTable(Table* dst, const Table& src) {
-  for (const auto& iter : src) {
-    AddToTable(dst, iter.first, iter.second);
+namespace {
+
+// The ShardFlows<K> Shard::* arguments below pick an address family's flows
+// out of a Shard.
+
+template <class K>
+void SplitFlows(const Flows<K>& src, ShardFlows<K> Shard::*family,
+                std::vector<Shard>* shards) {
+  const size_t n = shards->size();
+  for (const auto& iter : src.table) {
+    size_t hash = src.table.hash(iter.first);
+    ShardFlows<K>* shard = &((*shards)[PartitionOf(hash, n)].*family);
+    shard->flows.push_back(iter);
+    shard->hashes.push_back(hash);
+  }
+  for (const auto& iter : src.ended) {
+    size_t hash = src.table.hash(iter.first);
+    ((*shards)[PartitionOf(hash, n)].*family).ended.push_back(iter);
+  }
+}
+
+template <class K>
+void MergeFlows(const std::vector<const Shard*>& shards,
+                ShardFlows<K> Shard::*family, Flows<K>* dst) {
+  size_t tracked = 0;
+  for (const Shard* shard : shards) {
+    tracked += (shard->*family).flows.size();
+  }
+  // Usually, most flows are seen by only one packet thread.
+  dst->table.reserve(dst->table.size() + tracked);
+  for (const Shard* shard : shards) {
+    const ShardFlows<K>& src = shard->*family;
+    for (size_t i = 0; i < src.flows.size(); i++) {
+      auto emplaced = dst->table.emplace(src.flows[i].first,
+                                         src.flows[i].second, src.hashes[i]);
+      if (!emplaced.second) {
+        emplaced.first->second += src.flows[i].second;
+      }
+    }
+    dst->ended.insert(dst->ended.end(), src.ended.begin(), src.ended.end());
+  }
+}
+
+template <class K>
+void ForgetFlows(Flows<K>* retained, Flows<K>* ended) {
+  auto* kept = &retained->table;
+  for (auto& iter : ended->ended) {
+    auto finder = kept->find(iter.first);
+    if (finder != kept->end()) {
+      iter.second.first_ns =
+          std::min(iter.second.first_ns, finder->second.first_ns);
+      kept->erase(finder);
+    }
+  }
+}
+
+// Timers tick once a second, which is plenty fine enough for timeouts measured
+// in minutes.
+const uint64_t kTimerTickNs = 1000000000ULL;
+
+template <class K>
+void RetainFlows(Flows<K>* retained, Flows<K>* interval, uint64_t cutoff_ns) {
+  auto* kept = &retained->table;
+  if (!retained->timers) {
+    retained->timers.reset(new TimerWheel<K>(kTimerTickNs, cutoff_ns));
+  }
+  TimerWheel<K>* timers = retained->timers.get();
+  // Flows ended by packet threads (say, evicted) have already ended.
+  ForgetFlows(retained, interval);
+  // Retained stats only hold times; counters are per interval.
+  for (auto& iter : interval->table) {
+    Stats* stats = &iter.second;
+    auto emplaced = kept->emplace(iter.first, Stats());
+    Stats* times = &emplaced.first->second;
+    if (!emplaced.second) {
+      stats->first_ns = std::min(stats->first_ns, times->first_ns);
+    }
+    times->first_ns = stats->first_ns;
+    times->last_ns = std::max(times->last_ns, stats->last_ns);
+    if (stats->Finished(cutoff_ns) != Stats::ACTIVE_TIMEOUT) {
+      kept->erase(emplaced.first);
+    } else if (!times->timer) {
+      // A flow's timer is set for when it was last seen, as of when it was
+      // set.  Flows seen since are rescheduled once their timer fires.
+      timers->Schedule(iter.first, times->last_ns);
+      times->timer = 1;
+    }
+  }
+  // Flows whose timers fire may have seen no packets since before our cutoff,
+  // in which case they've timed out.
+  timers->Advance(cutoff_ns, [&](const K& key) {
+    auto iter = kept->find(key);
+    if (iter == kept->end()) {
+      return;  // already ended, or evicted
+    }
+    if (iter->second.last_ns < cutoff_ns) {
+      interval->ended.push_back(*iter);
+      interval->ended.back().second.end_reason = Stats::IDLE_TIMEOUT;
+      kept->erase(iter);
+    } else {
+      timers->Schedule(key, iter->second.last_ns);
+    }
+  });
+}
+
+// Evicts one of retained's flows, which must not be empty.  If the flow was
+// also seen this interval, it's exported once, as evicted, with this
+// interval's counters, rather than again from the interval's table.
+template <class K>
+void EvictRetained(Flows<K>* retained, Flows<K>* interval, uint64_t r) {
+  Evict(retained, SIZE_MAX, r);
+  auto* evicted = &retained->ended.back();
+  auto iter = interval->table.find(evicted->first);
+  if (iter != interval->table.end()) {
+    evicted->second += iter->second;
+    interval->table.erase(iter);
+  }
+}
+
+// Flows which end or are evicted leave their timers behind, until they fire.
+// If a flow's key comes back before then, it gets a timer of its own, and both
+// carry on.  Once left-behind timers outnumber retained flows (give or take
+// kTimerSlack), we drop them, keeping one timer per retained flow, so the
+// timers we hold stay proportional to the flows we retain, and the work of
+// dropping them to the number dropped.
+const size_t kTimerSlack = 1024;
+
+template <class K>
+void DropStaleTimers(Flows<K>* retained) {
+  TimerWheel<K>* timers = retained->timers.get();
+  auto* kept = &retained->table;
+  if (!timers || timers->size() <= 2 * kept->size() + kTimerSlack) return;
+  // Every flow marked as having a timer has at least one.  Keep the first we
+  // find, unmarking the flow so we drop any others, then mark them again.
+  timers->Filter([kept](const K& key) {
+    auto iter = kept->find(key);
+    if (iter == kept->end() || !iter->second.timer) return false;
+    iter->second.timer = 0;
+    return true;
+  });
+  timers->Filter([kept](const K& key) {
+    kept->find(key)->second.timer = 1;
+    return true;
+  });
+}
+
+template <class K>
+void MoveEnded(Flows<K>* from, Flows<K>* to) {
+  to->ended.insert(to->ended.end(), from->ended.begin(), from->ended.end());
+  from->ended.clear();
+}
+
+}  // namespace
+
+void SplitTable(const Table& src, std::vector<Shard>* shards) {
+  SplitFlows(src.v4, &Shard::v4, shards);
+  SplitFlows(src.v6, &Shard::v6, shards);
+}
+
+void MergeShards(const std::vector<const Shard*>& shards, Table* dst) {
+  MergeFlows(shards, &Shard::v4, &dst->v4);
+  MergeFlows(shards, &Shard::v6, &dst->v6);
+}
+
+void Forget(Table* retained, Table* ended) {
+  ForgetFlows(&retained->v4, &ended->v4);
+  ForgetFlows(&retained->v6, &ended->v6);
+  DropStaleTimers(&retained->v4);
+  DropStaleTimers(&retained->v6);
+}
+
+void Retain(Table* retained, Table* interval, uint64_t cutoff_ns,
+            size_t max) {
+  RetainFlows(&retained->v4, &interval->v4, cutoff_ns);
+  RetainFlows(&retained->v6, &interval->v6, cutoff_ns);
+  if (max > 0) {
+    // Evict from whichever family holds more flows, using an LCG to pick
+    // samples.
+    uint64_t r = retained->tracked();
+    while (retained->tracked() > max) {
+      r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+      if (retained->v4.table.size() >= retained->v6.table.size()) {
+        EvictRetained(&retained->v4, &interval->v4, r);
+      } else {
+        EvictRetained(&retained->v6, &interval->v6, r);
+      }
+    }
+    MoveEnded(&retained->v4, &interval->v4);
+    MoveEnded(&retained->v6, &interval->v6);
   }
+  DropStaleTimers(&retained->v4);
+  DropStaleTimers(&retained->v6);
 }
 
 }  // namespace flow
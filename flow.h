@@ -15,85 +15,74 @@
 #ifndef CLERK_FLOW_H_
 #define CLERK_FLOW_H_
 
-#include <unordered_map>
+#include <netinet/in.h>  // IPPROTO_ICMP, IPPROTO_ICMPV6
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 
+#include "flat_map.h"
+#include "hash.h"
+#include "slab.h"
+#include "timer_wheel.h"
+
 namespace clerk {
 namespace flow {
 
+// IP6 is an IPv6 address, in network byte order.
+struct IP6 {
+  uint8_t addr[16];
+};
+
+// Key identifies a flow.  It's templated on the IP address type, so that IPv4
+// flows (Key4) don't pay for the space of IPv6 addresses (Key6).  A Key4 is 16
+// bytes, small enough that it and its Stats share a single cache line.
+//
+// Keys are compared and hashed as raw bytes, and have no padding.
+template <class IP>
 struct Key {
-  Key();
+  Key() { memset(this, 0, sizeof(*this)); }
 
-  uint8_t src_ip[16];
-  uint8_t dst_ip[16];
+  IP src_ip;
+  IP dst_ip;
   uint16_t src_port;
-  uint16_t dst_port;
+  uint16_t dst_port;  // For ICMP, holds type and code; see set_icmp.
   uint16_t vlan;
-  uint8_t icmp_type;
-  uint8_t icmp_code;
-  uint8_t network;  // 0 = unknown, 4 = ipv4, 6 = ipv6
   uint8_t protocol;
   uint8_t tos;  // IPv4 TOS, IPv6 traffic class
 
-  bool operator==(const Key& b) const;
+  bool operator==(const Key& b) const {
+    return memcmp(this, &b, sizeof(Key)) == 0;
+  }
   inline bool operator!=(const Key& b) const { return !operator==(b); }
-  size_t hash() const;
-  void set_src_ip4(uint32_t ip4);
-  void set_dst_ip4(uint32_t ip4);
-  void set_network(uint8_t net);
-  uint32_t get_src_ip4() const;
-  uint32_t get_dst_ip4() const;
-  void set_src_ip6(const char* ip6);
-  void set_dst_ip6(const char* ip6);
-};
+  // Hashes this key with hash policy H; see hash.h.
+  template <class H = ::clerk::hash::Default>
+  size_t hash() const {
+    return H::Hash(this, sizeof(*this));
+  }
 
-inline void Key::set_network(uint8_t net) {
-  if (__builtin_expect((network == 6 && net == 4), false)) {
-    // If we switch from v6 to v4, we need to clear the bits of the IPs.
-    memset(src_ip, 0, sizeof(src_ip));
-    memset(dst_ip, 0, sizeof(dst_ip));
+  // ICMP has no ports.  Like NetFlow v5, we store the ICMP type and code in
+  // dst_port instead, which keeps our keys small.
+  void set_icmp(uint8_t type, uint8_t code) {
+    dst_port = (uint16_t(type) << 8) | code;
   }
-  network = net;
-}
-inline void Key::set_src_ip4(uint32_t ip4) {
-  set_network(4);
-  src_ip[12] = ip4 >> 24;
-  src_ip[13] = ip4 >> 16;
-  src_ip[14] = ip4 >> 8;
-  src_ip[15] = ip4;
-}
-inline void Key::set_dst_ip4(uint32_t ip4) {
-  set_network(4);
-  dst_ip[12] = ip4 >> 24;
-  dst_ip[13] = ip4 >> 16;
-  dst_ip[14] = ip4 >> 8;
-  dst_ip[15] = ip4;
-}
-#define LEFT_SHIFT_32(x, by) (((uint32_t)(x)) << (by))
-inline uint32_t Key::get_src_ip4() const {
-  CHECK_EQ(network, 4);
-  return LEFT_SHIFT_32(src_ip[12], 24) |
-         LEFT_SHIFT_32(src_ip[13], 16) |
-         LEFT_SHIFT_32(src_ip[14], 8) |
-         LEFT_SHIFT_32(src_ip[15], 0);
-}
-inline uint32_t Key::get_dst_ip4() const {
-  CHECK_EQ(network, 4);
-  return LEFT_SHIFT_32(dst_ip[12], 24) |
-         LEFT_SHIFT_32(dst_ip[13], 16) |
-         LEFT_SHIFT_32(dst_ip[14], 8) |
-         LEFT_SHIFT_32(dst_ip[15], 0);
-}
-#undef LEFT_SHIFT_32
-inline void Key::set_src_ip6(const char* ip6) {
-  set_network(6);
-  memcpy(src_ip, ip6, sizeof(src_ip));
-}
-inline void Key::set_dst_ip6(const char* ip6) {
-  set_network(6);
-  memcpy(dst_ip, ip6, sizeof(dst_ip));
-}
+  bool is_icmp() const {
+    return protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6;
+  }
+  uint8_t icmp_type() const { return is_icmp() ? dst_port >> 8 : 0; }
+  uint8_t icmp_code() const { return is_icmp() ? dst_port & 0xFF : 0; }
+};
+
+typedef Key<uint32_t> Key4;  // IPs in host byte order.
+typedef Key<IP6> Key6;
+static_assert(sizeof(Key4) == 16, "Key4 should be 16 bytes with no padding");
+static_assert(sizeof(Key6) == 40, "Key6 should be 40 bytes with no padding");
 
 struct Stats {
   // From http://www.iana.org/assignments/ipfix/ipfix.xhtml
@@ -116,19 +105,22 @@ struct Stats {
   Stats();
   Stats(uint64_t b, uint64_t p, uint64_t ts_ns);
 
+  // Only counters updated per packet live here.  Anything derivable from the
+  // key (like ASNs) is looked up at export time instead.
   uint64_t bytes;
   uint64_t packets;
-  uint8_t tcp_flags;
   uint64_t first_ns, last_ns;  // nanos since epoch
-
-
-  // Actually part of the key, but filled in later on, when the key is already
-  // constant and unmodifiable.
-  uint32_t src_asn;
-  uint32_t dst_asn;
+  uint8_t tcp_flags;
+  // Nonzero if we've already stopped tracking this flow, for this reason.
+  uint8_t end_reason;
+  // For retained flows (see Retain), whether a timer is scheduled for them.
+  uint8_t timer;
 
   const Stats& operator+=(const Stats& f);
   uint8_t Finished(uint64_t cutoff_ns) const {
+    if (end_reason) {
+      return end_reason;
+    }
     if (last_ns < cutoff_ns) {
       return IDLE_TIMEOUT;
     }
@@ -138,15 +130,16 @@ struct Stats {
     return ACTIVE_TIMEOUT;
   }
 };
+static_assert(sizeof(Stats) == 40, "Stats should be 40 bytes");
 
 }  // namespace flow
 }  // namespace clerk
 
 namespace std {
 
-template <>
-struct hash<clerk::flow::Key> {
-  size_t operator()(const clerk::flow::Key& k) const { return k.hash(); }
+template <class IP>
+struct hash<clerk::flow::Key<IP>> {
+  size_t operator()(const clerk::flow::Key<IP>& k) const { return k.hash(); }
 };
 
 }  // namespace std
@@ -154,10 +147,270 @@ struct hash<clerk::flow::Key> {
 namespace clerk {
 namespace flow {
 
-typedef std::unordered_map<Key, Stats> Table;
-const Stats& AddToTable(Table* t, const Key& key, const Stats& stats);
+// KeyHash hashes keys with hash policy H, for tables that want something
+// other than hash::Default.
+template <class H>
+struct KeyHash {
+  template <class K>
+  size_t operator()(const K& k) const {
+    return k.template hash<H>();
+  }
+};
+
+typedef FlatMap<Key4, Stats> Table4;
+typedef FlatMap<Key6, Stats> Table6;
+static_assert(sizeof(Table4::value_type) <= 64,
+              "IPv4 flows should fit in a single cache line");
+
+// Flows holds all flows of a single address family.
+template <class K>
+struct Flows {
+  explicit Flows(SlabAllocator* alloc)
+      : table(alloc), ended(SlabStlAllocator<std::pair<K, Stats>>(alloc)) {}
+
+  // Flows we're currently tracking.
+  FlatMap<K, Stats> table;
+  // Flows we've stopped tracking, which still need to be exported.  Their
+  // Stats have end_reason set.  Like table, they live in our allocator.
+  std::vector<std::pair<K, Stats>, SlabStlAllocator<std::pair<K, Stats>>>
+      ended;
+  // Only retained flows (see Retain) time out, so only retained tables have
+  // timers, which say when each flow might next be idle for long enough.
+  std::unique_ptr<TimerWheel<K>> timers;
+
+  size_t size() const { return table.size() + ended.size(); }
+  void swap(Flows& other) {
+    table.swap(other.table);
+    ended.swap(other.ended);
+    timers.swap(other.timers);
+  }
+  // Calls fn(key, stats) on every tracked and ended flow.
+  template <class F>
+  void ForEach(F fn) const {
+    for (const auto& iter : table) fn(iter.first, iter.second);
+    for (const auto& iter : ended) fn(iter.first, iter.second);
+  }
+};
+
+// Table holds a set of flows, split by address family.
+struct Table {
+  explicit Table(SlabAllocator* alloc = nullptr) : v4(alloc), v6(alloc) {}
+
+  Flows<Key4> v4;
+  Flows<Key6> v6;
+
+  size_t size() const { return v4.size() + v6.size(); }
+  // Number of flows currently being tracked.
+  size_t tracked() const { return v4.table.size() + v6.table.size(); }
+  void swap(Table& other) {
+    v4.swap(other.v4);
+    v6.swap(other.v6);
+  }
+  // get<K>() returns our flows with key type K.
+  template <class K>
+  const Flows<K>& get() const;
+};
+template <>
+inline const Flows<Key4>& Table::get<Key4>() const {
+  return v4;
+}
+template <>
+inline const Flows<Key6>& Table::get<Key6>() const {
+  return v6;
+}
+
+template <class K, class H>
+inline const Stats& AddToTable(FlatMap<K, Stats, H>* t, const K& key,
+                               const Stats& stats) {
+  auto emplaced = t->emplace(key, stats);
+  if (!emplaced.second) {
+    emplaced.first->second += stats;
+  }
+  return emplaced.first->second;
+}
 void CombineTable(Table* dst, const Table& src);
 
+// Partitions.  To merge, retain, and export flows in parallel, we split them
+// into partitions by the hash of their keys, so each flow always lands in the
+// same partition.  We use the hash's high bits, which tables barely use, so
+// keys within a partition still spread evenly over its tables.
+inline size_t PartitionOf(size_t hash, size_t n) {
+  return ((hash >> 32) * n) >> 32;
+}
+
+// ShardFlows holds the flows of one address family from one table which fall
+// into a single partition, with each tracked flow's hash, so merging them into
+// the partition's table needn't hash them again.
+template <class K>
+struct ShardFlows {
+  std::vector<std::pair<K, Stats>> flows;
+  std::vector<size_t> hashes;  // of flows
+  std::vector<std::pair<K, Stats>> ended;
+};
+struct Shard {
+  ShardFlows<Key4> v4;
+  ShardFlows<Key6> v6;
+};
+
+// SplitTable splits src's flows into shards->size() partitions.
+void SplitTable(const Table& src, std::vector<Shard>* shards);
+// MergeShards combines shards, all of the same partition, into dst.
+void MergeShards(const std::vector<const Shard*>& shards, Table* dst);
+
+// Retain carries flows across intervals.  Packet threads only track the flows
+// they see during a single interval, so a long-lived flow shows up afresh in
+// each interval's table.  'retained' remembers, for each flow that's still
+// active, when it started and when it was last seen.
+//
+// Retain merges an interval's flows into 'retained', and readies the interval
+// for export:  each flow's first_ns becomes the time the flow really started,
+// and retained flows which have been idle since before cutoff_ns are added to
+// the interval's ended flows with end reason IDLE_TIMEOUT.  Idle flows are
+// found with retained's timers, rather than by looking at every flow, so the
+// work done is proportional to the flows seen this interval and the flows
+// which time out, not to all retained flows.  Flows which end or are evicted
+// leave their timers behind until they fire, but once those outnumber
+// retained flows, they're dropped.  Flows which end this interval are dropped
+// from 'retained'.  If 'retained' would hold more than max flows (0 for no
+// limit), we evict some, which are exported with end reason
+// LACK_OF_RESOURCES, and with their counters from this interval, in place of
+// their entries in the interval's table.
+void Retain(Table* retained, Table* interval, uint64_t cutoff_ns, size_t max);
+// Forget readies flows which packet threads have already ended for export,
+// outside of Retain:  each ended flow is dropped from 'retained', and its
+// first_ns becomes the time it really started.
+void Forget(Table* retained, Table* ended);
+
+// Hints remembers where in a flow table the flows for recently seen packets
+// live, keyed by a hash the packet arrived with (the kernel's tp_rxhash), so
+// packets for those flows can skip hashing their key.  A hint is only ever a
+// guess:  the entry it points to is compared against the full key, and we
+// fall back to a normal lookup if it doesn't match.
+//
+// If packet hashes turn out not to identify flows (say, the NIC hashes only
+// addresses, or hashes packets of one flow differently), hints mostly miss,
+// and a miss costs more than it saves.  So we track our hit rate, and stop
+// using hints if it's poor.  Only lookups for flows already in the table
+// count:  a flow's first packet can't have a hint, so its miss says nothing
+// about whether packet hashes identify flows.
+//
+// We keep two hints per table slot (at least kMinSize), so most flows have a
+// hint to themselves however big the table.  Like flow tables, hints are
+// allocated from a packet thread's SlabAllocator, if given one, and zeroed as
+// they're freed rather than as they're allocated.
+template <class K>
+class Hints {
+ public:
+  // Least number of hints kept.
+  static const size_t kMinSize = 1 << 14;
+  // Hit rate is checked every kCheckEvery lookups.
+  static const size_t kCheckEvery = 1 << 16;
+
+  // Makes hints for a table with 'capacity' slots.
+  explicit Hints(size_t capacity, SlabAllocator* alloc = nullptr)
+      : mask_(SizeFor(capacity) - 1),
+        alloc_(alloc),
+        hints_(static_cast<uint32_t*>(
+            alloc ? alloc->Allocate(bytes(), bytes())
+                  : calloc(mask_ + 1, sizeof(uint32_t)))),
+        lookups_(0),
+        hits_(0),
+        enabled_(true) {
+    CHECK(hints_ != nullptr) << "Failed to allocate hints";
+  }
+  ~Hints() {
+    if (alloc_) {
+      memset(hints_, 0, bytes());
+      alloc_->Free(hints_, bytes(), bytes());
+    } else {
+      free(hints_);
+    }
+  }
+
+  bool enabled() const { return enabled_; }
+  size_t size() const { return mask_ + 1; }
+
+  // Returns t's entry for key if rxhash's hint points to it, else t->end().
+  // A hit counts towards our hit rate; if the caller then finds key in t
+  // anyway, it should call Missed().
+  typename FlatMap<K, Stats>::iterator Find(FlatMap<K, Stats>* t,
+                                            const K& key, uint32_t rxhash) {
+    auto iter = t->AtIndex(hints_[rxhash & mask_] - 1);
+    if (iter != t->end() && iter->first == key) {
+      Count(true);
+      return iter;
+    }
+    return t->end();
+  }
+  // Counts a miss, for a flow that was in the table after all.
+  void Missed() { Count(false); }
+  // Starts fetching the entry rxhash's hint points to.
+  void Prefetch(const FlatMap<K, Stats>& t, uint32_t rxhash) const {
+    t.PrefetchIndex(hints_[rxhash & mask_] - 1);
+  }
+  // Remembers that the flow for packets with rxhash lives at slot index i.
+  void Remember(uint32_t rxhash, size_t i) { hints_[rxhash & mask_] = i + 1; }
+
+ private:
+  static size_t SizeFor(size_t capacity) {
+    size_t size = kMinSize;
+    while (size < 2 * capacity) size *= 2;
+    return size;
+  }
+  size_t bytes() const { return size() * sizeof(uint32_t); }
+  void Count(bool hit) {
+    hits_ += hit;
+    if (++lookups_ == kCheckEvery) {
+      // Hints must hit at least half the time to pay for themselves.
+      enabled_ = hits_ >= kCheckEvery / 2;
+      LOG_IF(INFO, !enabled_) << "Packet hashes matched flows on only "
+                              << hits_ << "/" << lookups_
+                              << " lookups, disabling hints";
+      lookups_ = hits_ = 0;
+    }
+  }
+
+  size_t mask_;
+  SlabAllocator* alloc_;
+  uint32_t* hints_;  // slot index + 1, or 0 for none
+  size_t lookups_;
+  size_t hits_;
+  bool enabled_;
+
+  DISALLOW_COPY_AND_ASSIGN(Hints);
+};
+
+// Evict stops tracking one of f's flows to make room for another, queueing it
+// for export with end reason LACK_OF_RESOURCES.  We approximate LRU by
+// sampling a few flows and evicting the one that's been idle longest; 'r' is a
+// random value used to pick the samples.  f's table must not be empty.  If f
+// already has max_ended ended flows queued, the evicted flow is dropped
+// instead, its counters are added to *dropped (if non-null), and Evict returns
+// false.
+template <class K>
+bool Evict(Flows<K>* f, size_t max_ended, uint64_t r,
+           Stats* dropped = nullptr) {
+  const size_t kSamples = 8;
+  const size_t stride = f->table.bucket_count() / kSamples;
+  auto victim = f->table.SampleAt(r);
+  for (size_t i = 1; i < kSamples; i++) {
+    auto sample = f->table.SampleAt(r + i * stride);
+    if (sample->second.last_ns < victim->second.last_ns) {
+      victim = sample;
+    }
+  }
+  bool queued = f->ended.size() < max_ended;
+  if (queued) {
+    f->ended.push_back(*victim);
+    f->ended.back().second.end_reason = Stats::LACK_OF_RESOURCES;
+  } else if (dropped) {
+    dropped->packets += victim->second.packets;
+    dropped->bytes += victim->second.bytes;
+  }
+  f->table.erase(victim);
+  return queued;
+}
+
 }  // namespace flow
 }  // namespace clerk
 
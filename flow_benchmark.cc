@@ -0,0 +1,403 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for flow table operations.  Run with 'make benchmark'.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "flat_map.h"
+#include "flow.h"
+#include "hash.h"
+#include "ipfix.h"
+#include "thread_pool.h"
+#include "util.h"
+
+DEFINE_int64(benchmark_max_flows, 4 << 20,
+             "Largest flow table size to benchmark");
+DEFINE_int64(benchmark_lookups, 8 << 20,
+             "Number of packets to add to each table");
+
+namespace clerk {
+namespace flow {
+namespace {
+
+std::vector<Key4> RandomKeys(size_t n, std::mt19937_64* rng) {
+  std::vector<Key4> keys(n);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t r = (*rng)();
+    keys[i].src_ip = r;
+    keys[i].dst_ip = r >> 32;
+    keys[i].src_port = (*rng)();
+    keys[i].dst_port = 443;
+    keys[i].protocol = 6;
+  }
+  return keys;
+}
+
+// Packets picks which flow each benchmarked packet belongs to, uniformly at
+// random, so lookups hit all over the table like they do on a busy link.
+std::vector<uint32_t> Packets(size_t flows, std::mt19937_64* rng) {
+  std::vector<uint32_t> packets(FLAGS_benchmark_lookups);
+  for (size_t i = 0; i < packets.size(); i++) {
+    packets[i] = (*rng)() % flows;
+  }
+  return packets;
+}
+
+void Report(const char* name, size_t flows, size_t ops, int64_t nanos) {
+  printf("%-24s %10zu flows %8.1f ns/packet\n", name, flows,
+         double(nanos) / ops);
+}
+
+typedef std::unordered_map<Key4, Stats> UnorderedTable;
+
+const Stats& AddToUnorderedTable(UnorderedTable* t, const Key4& key,
+                                 const Stats& stats) {
+  auto finder = t->find(key);
+  if (finder == t->end()) {
+    return t->emplace(key, stats).first->second;
+  }
+  finder->second += stats;
+  return finder->second;
+}
+
+template <class T, class F>
+void BenchmarkAdd(const char* name, const std::vector<Key4>& keys,
+                  const std::vector<uint32_t>& packets, F add) {
+  T table;
+  // Fill the table first, so we measure steady state rather than growth.
+  for (const auto& key : keys) {
+    add(&table, key, Stats(1, 1, 1));
+  }
+  int64_t start = GetCurrentTimeNanos();
+  for (size_t i = 0; i < packets.size(); i++) {
+    add(&table, keys[packets[i]], Stats(100, 1, i));
+  }
+  Report(name, keys.size(), packets.size(), GetCurrentTimeNanos() - start);
+}
+
+typedef FlatMap<Key4, Stats, KeyHash<hash::City>> CityTable;
+typedef FlatMap<Key4, Stats, KeyHash<hash::CRC32C>> CRCTable;
+
+// ScanKeys looks like a port scan:  one source walking through ports on
+// consecutive destination addresses.  Keys differ only in a few low bits.
+std::vector<Key4> ScanKeys(size_t n) {
+  std::vector<Key4> keys(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i].src_ip = 0x0a000001;
+    keys[i].dst_ip = 0xc0a80000 + i / 1024;
+    keys[i].src_port = 40000;
+    keys[i].dst_port = i % 1024;
+    keys[i].protocol = 6;
+  }
+  return keys;
+}
+
+// CRCCollisionKeys returns keys that an attacker controlling only source IPs
+// and ports can craft to share a CRC32C, whatever the seed.  A CRC is linear,
+// so crc(seed, a) == crc(seed, b) iff crc(0, a ^ b) == 0.  The 48 bits of
+// source IP and port map onto 32 bits of CRC, so there are at least 2^16
+// differences which CRC to zero;  XOR any combination of them into a key to
+// get a colliding one.
+std::vector<Key4> CRCCollisionKeys(size_t n) {
+  const int kBits = 48;
+  auto flip = [](Key4* k, int bit) {
+    if (bit < 32) {
+      k->src_ip ^= 1U << bit;
+    } else {
+      k->src_port ^= 1 << (bit - 32);
+    }
+  };
+  // Gaussian elimination over GF(2), finding the kernel of bit -> crc.
+  uint32_t pivot_crc[32] = {0};
+  uint64_t pivot_bits[32] = {0};
+  std::vector<uint64_t> kernel;
+  for (int bit = 0; bit < kBits; bit++) {
+    Key4 k;
+    flip(&k, bit);
+    uint32_t crc = hash::CRC32CUpdate(0, &k, sizeof(k));
+    uint64_t bits = uint64_t(1) << bit;
+    for (int p = 31; p >= 0 && crc; p--) {
+      if (!(crc & (1U << p))) continue;
+      if (!pivot_crc[p]) {
+        pivot_crc[p] = crc;
+        pivot_bits[p] = bits;
+        break;
+      }
+      crc ^= pivot_crc[p];
+      bits ^= pivot_bits[p];
+    }
+    if (!crc) kernel.push_back(bits);
+  }
+  Key4 base;
+  base.dst_ip = 0xc0a80001;
+  base.dst_port = 80;
+  base.protocol = 6;
+  std::vector<Key4> keys;
+  for (size_t i = 0; i < n && i < (size_t(1) << kernel.size()); i++) {
+    Key4 k = base;
+    for (size_t j = 0; j < kernel.size(); j++) {
+      if (!(i & (size_t(1) << j))) continue;
+      for (int bit = 0; bit < kBits; bit++) {
+        if (kernel[j] & (uint64_t(1) << bit)) flip(&k, bit);
+      }
+    }
+    keys.push_back(k);
+  }
+  return keys;
+}
+
+// Hashes are summed into hash_sink, so hashing isn't optimized away.
+volatile size_t hash_sink;
+
+// BenchmarkHash reports how evenly hash policy H spreads keys across the
+// 16-slot groups of a table sized for them, and how long inserting them
+// takes.  Well-spread keys rarely overflow their group;  badly spread ones
+// make inserts and lookups probe group after group.
+template <class H>
+void BenchmarkHash(const char* hash_name, const char* keys_name,
+                   const std::vector<Key4>& keys) {
+  size_t groups = 1;
+  while (groups * 14 < keys.size()) groups *= 2;
+  std::vector<size_t> load(groups);
+  int64_t start = GetCurrentTimeNanos();
+  for (const auto& key : keys) {
+    hash_sink += key.hash<H>();
+  }
+  int64_t hash_ns = GetCurrentTimeNanos() - start;
+  for (const auto& key : keys) {
+    load[(key.hash<H>() >> 7) & (groups - 1)]++;
+  }
+  size_t max = 0, overfull = 0;
+  for (size_t l : load) {
+    max = std::max(max, l);
+    if (l > 16) overfull++;
+  }
+  FlatMap<Key4, Stats, KeyHash<H>> table;
+  start = GetCurrentTimeNanos();
+  for (const auto& key : keys) {
+    AddToTable(&table, key, Stats(1, 1, 1));
+  }
+  int64_t insert_ns = GetCurrentTimeNanos() - start;
+  printf(
+      "%-10s %-16s %6.1f ns/hash %8.1f ns/insert  max %6zu/group  "
+      "%5.1f%% groups overfull\n",
+      hash_name, keys_name, double(hash_ns) / keys.size(),
+      double(insert_ns) / keys.size(), max, 100.0 * overfull / groups);
+}
+
+// BenchmarkHinted is like BenchmarkAdd for Table4, but finds flows through
+// Hints, as IPFIX::Add does when packets come with an rxhash.  Each flow gets
+// a fixed pseudorandom rxhash, as if the NIC had hashed its 5-tuple.  Like a
+// packet thread's, the table and its hints start each run empty, sized for
+// the flows to come.
+void BenchmarkHinted(const std::vector<Key4>& keys,
+                     const std::vector<uint32_t>& packets) {
+  Table4 table;
+  table.reserve(keys.size());
+  Hints<Key4> hints(table.bucket_count());
+  auto add = [&](uint32_t flow, const Stats& stats) {
+    uint32_t rxhash = (flow + 1) * 2654435761U;
+    const bool hinted = hints.enabled();
+    if (hinted) {
+      auto iter = hints.Find(&table, keys[flow], rxhash);
+      if (iter != table.end()) {
+        iter->second += stats;
+        return;
+      }
+    }
+    auto emplaced = table.emplace(keys[flow], stats);
+    if (!emplaced.second) {
+      emplaced.first->second += stats;
+      if (hinted) hints.Missed();
+    }
+    if (hinted) hints.Remember(rxhash, table.index(emplaced.first));
+  };
+  for (size_t i = 0; i < keys.size(); i++) {
+    add(i, Stats(1, 1, 1));
+  }
+  int64_t start = GetCurrentTimeNanos();
+  for (size_t i = 0; i < packets.size(); i++) {
+    add(packets[i], Stats(100, 1, i));
+  }
+  const int64_t nanos = GetCurrentTimeNanos() - start;
+  // Otherwise we'd have timed the unhinted path.
+  CHECK(hints.enabled()) << "Hints disabled themselves with " << keys.size()
+                         << " flows";
+  Report("flow::Table4+Hints", keys.size(), packets.size(), nanos);
+}
+
+// BenchmarkBatched is like BenchmarkAdd for Table4, but works on windows of
+// packets as IPFIX::ProcessBatch does:  hash and prefetch for every packet in
+// the window, then update them all.
+void BenchmarkBatched(const std::vector<Key4>& keys,
+                      const std::vector<uint32_t>& packets) {
+  const size_t kWindow = 16;
+  Table4 table;
+  for (const auto& key : keys) {
+    AddToTable(&table, key, Stats(1, 1, 1));
+  }
+  size_t hashes[kWindow];
+  int64_t start = GetCurrentTimeNanos();
+  for (size_t i = 0; i < packets.size(); i += kWindow) {
+    const size_t n = std::min(kWindow, packets.size() - i);
+    for (size_t j = 0; j < n; j++) {
+      hashes[j] = table.hash(keys[packets[i + j]]);
+      table.Prefetch(hashes[j]);
+    }
+    for (size_t j = 0; j < n; j++) {
+      table.PrefetchSlot(hashes[j]);
+    }
+    for (size_t j = 0; j < n; j++) {
+      auto emplaced =
+          table.emplace(keys[packets[i + j]], Stats(100, 1, i), hashes[j]);
+      if (!emplaced.second) emplaced.first->second += Stats(100, 1, i);
+    }
+  }
+  Report("flow::Table4 batched", keys.size(), packets.size(),
+         GetCurrentTimeNanos() - start);
+}
+
+}  // namespace
+
+void BenchmarkTables() {
+  std::mt19937_64 rng(1);
+  for (size_t flows = 1 << 10; flows <= size_t(FLAGS_benchmark_max_flows);
+       flows *= 4) {
+    auto keys = RandomKeys(flows, &rng);
+    auto packets = Packets(flows, &rng);
+    BenchmarkAdd<UnorderedTable>("unordered_map", keys, packets,
+                                 AddToUnorderedTable);
+    BenchmarkAdd<Table4>("flow::Table4", keys, packets,
+                         AddToTable<Key4, Table4::hasher>);
+    BenchmarkBatched(keys, packets);
+    BenchmarkHinted(keys, packets);
+    BenchmarkAdd<CityTable>("flow::Table4/City", keys, packets,
+                            AddToTable<Key4, CityTable::hasher>);
+    BenchmarkAdd<CRCTable>("flow::Table4/CRC32C", keys, packets,
+                           AddToTable<Key4, CRCTable::hasher>);
+  }
+}
+
+// BenchmarkMerge merges per-thread tables into partitions as clerk's main
+// loop does, with varying numbers of threads, to show how merging scales.
+void BenchmarkMerge() {
+  const size_t kTables = 16;
+  const size_t kFlows = FLAGS_benchmark_max_flows / 4;
+  std::mt19937_64 rng(3);
+  auto keys = RandomKeys(kFlows, &rng);
+  std::vector<Table> tables(kTables);
+  for (size_t i = 0; i < kTables; i++) {
+    // Each table gets a different half of the flows, so many overlap.
+    for (size_t j = 0; j < keys.size(); j++) {
+      if ((rng() & 1)) AddToTable(&tables[i].v4.table, keys[j], Stats(1, 1, 1));
+    }
+  }
+  for (size_t threads = 1; threads <= 2 * std::thread::hardware_concurrency();
+       threads *= 2) {
+    ThreadPool pool(threads);
+    std::vector<std::vector<Shard>> shards(kTables,
+                                           std::vector<Shard>(threads));
+    std::vector<Table> partitions(threads);
+    int64_t start = GetCurrentTimeNanos();
+    pool.Run(kTables, [&](size_t i) { SplitTable(tables[i], &shards[i]); });
+    pool.Run(threads, [&](size_t p) {
+      std::vector<const Shard*> mine;
+      for (const auto& s : shards) mine.push_back(&s[p]);
+      MergeShards(mine, &partitions[p]);
+    });
+    int64_t nanos = GetCurrentTimeNanos() - start;
+    printf("merge %2zu tables, %2zu threads %10zu flows %8.1f ms\n", kTables,
+           threads, kFlows, nanos / 1e6);
+  }
+}
+
+// BenchmarkEncode exports partitions as clerk's main thread does, encoding
+// them with more and more threads.  Packets go to a UDP socket connected to
+// itself, which drops what it can't buffer.
+void BenchmarkEncode() {
+  const size_t kFlows = FLAGS_benchmark_max_flows;
+  const size_t kPartitions = 16;
+  std::mt19937_64 rng(3);
+  std::vector<Table> partitions(kPartitions);
+  auto keys = RandomKeys(kFlows, &rng);
+  for (size_t i = 0; i < keys.size(); i++) {
+    AddToTable(&partitions[i % kPartitions].v4.table, keys[i],
+               Stats(1, 1, 1));
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  PCHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0);
+  PCHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0);
+  IPFIXFactory factory;
+  ASNMap asns;
+  for (size_t threads = 1; threads <= 2 * std::thread::hardware_concurrency();
+       threads *= 2) {
+    ThreadPool pool(threads);
+    PacketSender sender({fd}, &factory, &asns, 1, &pool);
+    int64_t start = GetCurrentTimeNanos();
+    sender.Send(partitions);
+    int64_t nanos = GetCurrentTimeNanos() - start;
+    printf("encode %2zu partitions, %2zu threads %10zu flows %8.1f ms\n",
+           kPartitions, threads, kFlows, nanos / 1e6);
+  }
+  close(fd);
+}
+
+void BenchmarkHashes() {
+  std::mt19937_64 rng(2);
+  const size_t n = 1 << 14;
+  struct {
+    const char* name;
+    std::vector<Key4> keys;
+  } sets[] = {
+      {"random", RandomKeys(n, &rng)},
+      {"scan", ScanKeys(n)},
+      {"crc-collisions", CRCCollisionKeys(n)},
+  };
+  for (const auto& set : sets) {
+    BenchmarkHash<hash::City>("City", set.name, set.keys);
+    BenchmarkHash<hash::SipHash13>("SipHash13", set.name, set.keys);
+    BenchmarkHash<hash::CRC32C>("CRC32C", set.name, set.keys);
+  }
+}
+
+}  // namespace flow
+}  // namespace clerk
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  clerk::flow::BenchmarkTables();
+  clerk::flow::BenchmarkHashes();
+  clerk::flow::BenchmarkMerge();
+  clerk::flow::BenchmarkEncode();
+  return 0;
+}
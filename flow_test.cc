@@ -25,15 +25,15 @@ const char data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
                      1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
 
 TEST_F(KeyTest, TestCombine) {
-  Key a;
-  a.set_src_ip4(1);
-  a.set_dst_ip4(2);
+  Key4 a;
+  a.src_ip = 1;
+  a.dst_ip = 2;
   a.src_port = 3;
   a.dst_port = 4;
   a.protocol = 5;
-  Key b;
-  b.set_src_ip4(1);
-  b.set_dst_ip4(2);
+  Key4 b;
+  b.src_ip = 1;
+  b.dst_ip = 2;
   b.src_port = 3;
   b.dst_port = 4;
   b.protocol = 5;
@@ -48,25 +48,41 @@ TEST_F(KeyTest, TestCombine) {
     EXPECT_EQ(a, b);               \
     EXPECT_EQ(a.hash(), b.hash()); \
   } while (0)
+  EQMOD(src_ip, 9);
+  EQMOD(dst_ip, 9);
   EQMOD(src_port, 9);
   EQMOD(dst_port, 9);
   EQMOD(protocol, 9);
-  EQMOD(network, 9);
   EQMOD(tos, 9);
-  EQMOD(icmp_type, 9);
-  EQMOD(icmp_code, 9);
+  EQMOD(vlan, 9);
 #undef EQMOD
 
-  a.set_src_ip4(0);
-  a.set_dst_ip4(0);
-  a.set_src_ip6(&data[0]);
-  a.set_dst_ip6(&data[0]);
-  EXPECT_NE(a, b);
-  b.set_src_ip4(0);
-  b.set_dst_ip4(0);
-  b.set_src_ip6(&data[16]);
-  b.set_dst_ip6(&data[16]);
-  EXPECT_EQ(a, b);
+  Key6 c;
+  memcpy(c.src_ip.addr, &data[0], 16);
+  memcpy(c.dst_ip.addr, &data[0], 16);
+  Key6 d;
+  memcpy(d.src_ip.addr, &data[16], 16);
+  memcpy(d.dst_ip.addr, &data[16], 16);
+  EXPECT_EQ(c, d);
+  EXPECT_EQ(c.hash(), d.hash());
+  d.dst_ip.addr[15] = 0;
+  EXPECT_NE(c, d);
+}
+
+TEST_F(KeyTest, TestICMP) {
+  Key4 a;
+  a.protocol = IPPROTO_ICMP;
+  a.set_icmp(3, 4);
+  EXPECT_EQ(a.icmp_type(), 3);
+  EXPECT_EQ(a.icmp_code(), 4);
+  Key6 b;
+  b.protocol = IPPROTO_TCP;
+  b.dst_port = 0x0304;
+  EXPECT_EQ(b.icmp_type(), 0);
+  EXPECT_EQ(b.icmp_code(), 0);
+  b.protocol = IPPROTO_ICMPV6;
+  EXPECT_EQ(b.icmp_type(), 3);
+  EXPECT_EQ(b.icmp_code(), 4);
 }
 
 class StatsTest : public ::testing::Test {};
@@ -95,14 +111,305 @@ TEST_F(TableTest, TestAdd) {
   Table t;
   for (int i = 0; i < 100; i++) {
     for (int ip = 0; ip < 16; ip++) {
-      Key a;
-      a.set_src_ip6(&data[ip]);
-      a.set_dst_ip6(&data[ip]);
-      auto s = AddToTable(&t, a, Stats(i, i * 2, 1000));
+      Key6 a;
+      memcpy(a.src_ip.addr, &data[ip], 16);
+      memcpy(a.dst_ip.addr, &data[ip], 16);
+      auto s = AddToTable(&t.v6.table, a, Stats(i, i * 2, 1000));
       EXPECT_EQ(s.bytes, i * (i + 1) / 2);
       EXPECT_EQ(s.packets, i * (i + 1));
     }
   }
+  EXPECT_EQ(t.size(), 16);
+}
+
+TEST_F(TableTest, TestCombine) {
+  Table a, b;
+  Key4 k4;
+  k4.src_ip = 1;
+  Key6 k6;
+  k6.src_ip.addr[0] = 1;
+  AddToTable(&a.v4.table, k4, Stats(1, 1, 1000));
+  AddToTable(&b.v4.table, k4, Stats(2, 1, 2000));
+  AddToTable(&b.v6.table, k6, Stats(4, 1, 3000));
+  CombineTable(&a, b);
+  EXPECT_EQ(a.size(), 2);
+  EXPECT_EQ(a.v4.table.find(k4)->second.bytes, 3);
+  EXPECT_EQ(a.v4.table.find(k4)->second.first_ns, 1000);
+  EXPECT_EQ(a.v4.table.find(k4)->second.last_ns, 2000);
+  EXPECT_EQ(a.v6.table.find(k6)->second.bytes, 4);
+
+  b.v4.ended.push_back(std::make_pair(k4, Stats(8, 1, 4000)));
+  CombineTable(&a, b);
+  EXPECT_EQ(a.v4.ended.size(), 1);
+  EXPECT_EQ(a.v4.ended[0].second.bytes, 8);
+}
+
+TEST_F(TableTest, TestEvict) {
+  Flows<Key4> f(nullptr);
+  // Flow i was last seen at time i, so the lower i is, the better a candidate
+  // for eviction it is.
+  for (int i = 1; i <= 1000; i++) {
+    Key4 k;
+    k.src_ip = i;
+    AddToTable(&f.table, k, Stats(1, 1, i));
+  }
+  for (uint64_t r = 0; r < 100; r++) {
+    EXPECT_TRUE(Evict(&f, 100, r * 7919));
+  }
+  EXPECT_EQ(f.table.size(), 900);
+  ASSERT_EQ(f.ended.size(), 100);
+  uint64_t sum = 0;
+  for (const auto& iter : f.ended) {
+    EXPECT_EQ(iter.second.Finished(0), Stats::LACK_OF_RESOURCES);
+    EXPECT_TRUE(f.table.find(iter.first) == f.table.end());
+    sum += iter.second.last_ns;
+  }
+  // Sampling should do much better than picking flows at random.
+  EXPECT_LT(sum / f.ended.size(), 300);
+  // Once our queue of ended flows is full, evicted flows are dropped, and
+  // only their counters are kept.
+  Stats dropped(0, 0, 0);
+  EXPECT_FALSE(Evict(&f, 100, 0, &dropped));
+  EXPECT_EQ(dropped.packets, 1);
+  EXPECT_EQ(dropped.bytes, 1);
+  EXPECT_EQ(f.table.size(), 899);
+  EXPECT_EQ(f.ended.size(), 100);
+  EXPECT_EQ(f.size(), 999);
+}
+
+TEST_F(TableTest, TestRetain) {
+  Table retained;
+  Key4 a, b, c;
+  a.src_ip = 1;
+  b.src_ip = 2;
+  c.src_ip = 3;
+  c.protocol = IPPROTO_TCP;
+
+  Table first;
+  AddToTable(&first.v4.table, a, Stats(1, 1, 1000));
+  AddToTable(&first.v4.table, b, Stats(1, 1, 1000));
+  AddToTable(&first.v4.table, c, Stats(1, 1, 1000));
+  Retain(&retained, &first, 0, 0);
+  EXPECT_EQ(retained.tracked(), 3);
+  EXPECT_EQ(first.size(), 3);
+
+  // a carries on, and keeps its original start time.  b sees no packets, but
+  // hasn't timed out yet.  c ends with a FIN.
+  Table second;
+  AddToTable(&second.v4.table, a, Stats(2, 1, 2000));
+  Stats fin(3, 1, 2000);
+  fin.tcp_flags = 0x01;
+  AddToTable(&second.v4.table, c, fin);
+  Retain(&retained, &second, 500, 0);
+  EXPECT_EQ(second.v4.table.find(a)->second.first_ns, 1000);
+  EXPECT_EQ(second.v4.table.find(a)->second.bytes, 2);
+  EXPECT_EQ(second.v4.table.find(c)->second.first_ns, 1000);
+  EXPECT_EQ(second.v4.ended.size(), 0);
+  // Idle flows aren't exported until they time out.
+  EXPECT_EQ(second.size(), 2);
+  EXPECT_TRUE(second.v4.table.find(b) == second.v4.table.end());
+  EXPECT_EQ(retained.tracked(), 2);
+  EXPECT_TRUE(retained.v4.table.find(c) == retained.v4.table.end());
+
+  // Now b times out, and is exported as ended with no packets.
+  Table third;
+  AddToTable(&third.v4.table, a, Stats(4, 1, 3000));
+  Retain(&retained, &third, 1500, 0);
+  ASSERT_EQ(third.v4.ended.size(), 1);
+  EXPECT_EQ(third.v4.ended[0].first, b);
+  EXPECT_EQ(third.v4.ended[0].second.packets, 0);
+  EXPECT_EQ(third.v4.ended[0].second.first_ns, 1000);
+  EXPECT_EQ(third.v4.ended[0].second.Finished(1500), Stats::IDLE_TIMEOUT);
+  EXPECT_EQ(retained.tracked(), 1);
+
+  // Going over our limit evicts flows.
+  Table fourth;
+  AddToTable(&fourth.v4.table, b, Stats(1, 1, 4000));
+  AddToTable(&fourth.v4.table, c, Stats(1, 1, 4000));
+  Retain(&retained, &fourth, 1500, 2);
+  EXPECT_EQ(retained.tracked(), 2);
+  ASSERT_EQ(fourth.v4.ended.size(), 1);
+  EXPECT_EQ(fourth.v4.ended[0].second.Finished(1500),
+            Stats::LACK_OF_RESOURCES);
+
+  // An evicted flow seen this interval is exported just once, as evicted,
+  // with this interval's counters.
+  Table fifth;
+  AddToTable(&fifth.v4.table, b, Stats(5, 1, 5000));
+  AddToTable(&fifth.v4.table, c, Stats(5, 1, 5000));
+  Retain(&retained, &fifth, 1500, 1);
+  EXPECT_EQ(retained.tracked(), 1);
+  EXPECT_EQ(fifth.v4.table.size(), 1);
+  ASSERT_EQ(fifth.v4.ended.size(), 1);
+  EXPECT_TRUE(fifth.v4.table.find(fifth.v4.ended[0].first) ==
+              fifth.v4.table.end());
+  EXPECT_EQ(fifth.v4.ended[0].second.bytes, 5);
+  EXPECT_EQ(fifth.v4.ended[0].second.first_ns, 4000);
+  EXPECT_EQ(fifth.v4.ended[0].second.Finished(1500),
+            Stats::LACK_OF_RESOURCES);
+}
+
+TEST_F(TableTest, TestRetainTimers) {
+  // Flows which end or are evicted leave their timers behind.  However many
+  // churn through, we mustn't hold many more timers than retained flows.
+  const uint64_t kSec = 1000000000;
+  Table retained;
+  for (uint32_t i = 0; i < 10000; i++) {
+    Key4 ends, evicted;
+    ends.src_ip = i;
+    ends.protocol = IPPROTO_TCP;
+    evicted.src_ip = 100000 + i;
+    Table first;
+    AddToTable(&first.v4.table, ends, Stats(1, 1, (1000 + i) * kSec));
+    AddToTable(&first.v4.table, evicted, Stats(1, 1, (1000 + i) * kSec));
+    Retain(&retained, &first, 0, 10);
+    Table second;
+    Stats fin(1, 1, (1000 + i) * kSec);
+    fin.tcp_flags = 0x01;
+    AddToTable(&second.v4.table, ends, fin);
+    Retain(&retained, &second, 0, 10);
+  }
+  const size_t tracked = retained.tracked();
+  EXPECT_LE(tracked, 10);
+  EXPECT_LE(retained.v4.timers->size(), 2 * tracked + 1024);
+
+  // Flows whose keys come back carry on with a single timer, and time out
+  // just once.
+  Table last;
+  for (uint32_t i = 0; i < 10; i++) {
+    Key4 k;
+    k.src_ip = i;
+    k.protocol = IPPROTO_TCP;
+    AddToTable(&last.v4.table, k, Stats(1, 1, 20000 * kSec));
+  }
+  Retain(&retained, &last, 0, 0);
+  Table idle;
+  Retain(&retained, &idle, 30000 * kSec, 0);
+  EXPECT_EQ(retained.tracked(), 0);
+  EXPECT_EQ(idle.v4.ended.size(), tracked + 10);
+}
+
+TEST_F(TableTest, TestForget) {
+  Table retained;
+  Key4 a, b;
+  a.src_ip = 1;
+  b.src_ip = 2;
+  Table first;
+  AddToTable(&first.v4.table, a, Stats(1, 1, 1000));
+  AddToTable(&first.v4.table, b, Stats(1, 1, 1000));
+  Retain(&retained, &first, 0, 0);
+
+  // a ends partway through the next interval, and is exported right away,
+  // with its real start time.
+  Table ended;
+  Stats fin(2, 1, 2000);
+  fin.end_reason = Stats::END_DETECTED;
+  ended.v4.ended.push_back(std::make_pair(a, fin));
+  Forget(&retained, &ended);
+  EXPECT_EQ(ended.v4.ended[0].second.first_ns, 1000);
+  EXPECT_EQ(retained.tracked(), 1);
+  EXPECT_TRUE(retained.v4.table.find(a) == retained.v4.table.end());
+}
+
+TEST_F(TableTest, TestPartition) {
+  // Two tables with overlapping flows, split 4 ways and merged back.
+  Table a, b;
+  for (int i = 0; i < 1000; i++) {
+    Key4 k;
+    k.src_ip = i;
+    AddToTable(&a.v4.table, k, Stats(1, 1, 1000));
+    if (i % 2) AddToTable(&b.v4.table, k, Stats(2, 1, 2000));
+  }
+  Key6 k6;
+  AddToTable(&b.v6.table, k6, Stats(4, 1, 3000));
+  b.v4.ended.push_back(std::make_pair(Key4(), Stats(8, 1, 4000)));
+  std::vector<Shard> sa(4), sb(4);
+  SplitTable(a, &sa);
+  SplitTable(b, &sb);
+  std::vector<Table> parts(4);
+  size_t flows = 0;
+  for (size_t p = 0; p < parts.size(); p++) {
+    MergeShards({&sa[p], &sb[p]}, &parts[p]);
+    flows += parts[p].size();
+    for (const auto& iter : parts[p].v4.table) {
+      // Each flow lands in its own partition, and in no other.
+      EXPECT_EQ(PartitionOf(parts[p].v4.table.hash(iter.first), 4), p);
+      EXPECT_EQ(iter.second.bytes, iter.first.src_ip % 2 ? 3 : 1);
+    }
+    // Partitions should be roughly even.
+    EXPECT_GT(parts[p].v4.table.size(), 150);
+  }
+  EXPECT_EQ(flows, 1000 + 1 + 1);
+}
+
+class HintsTest : public ::testing::Test {};
+
+TEST_F(HintsTest, TestFind) {
+  Table4 t;
+  Hints<Key4> hints(t.bucket_count());
+  Key4 a, b;
+  a.src_ip = 1;
+  b.src_ip = 2;
+  EXPECT_TRUE(hints.Find(&t, a, 7) == t.end());
+  auto emplaced = t.emplace(a, Stats(1, 1, 1));
+  hints.Remember(7, t.index(emplaced.first));
+  EXPECT_TRUE(hints.Find(&t, a, 7) == emplaced.first);
+  // A hint pointing at another flow's entry isn't used.
+  EXPECT_TRUE(hints.Find(&t, b, 7) == t.end());
+  // Nor is one pointing at an erased entry.
+  t.erase(a);
+  EXPECT_TRUE(hints.Find(&t, a, 7) == t.end());
+  // After rehashing, a hint either still finds its flow, or misses.
+  emplaced = t.emplace(a, Stats(1, 1, 1));
+  hints.Remember(7, t.index(emplaced.first));
+  for (int i = 10; i < 1000; i++) {
+    Key4 k;
+    k.src_ip = i;
+    t.emplace(k, Stats(1, 1, 1));
+  }
+  auto found = hints.Find(&t, a, 7);
+  EXPECT_TRUE(found == t.end() || found == t.find(a));
+}
+
+TEST_F(HintsTest, TestDisable) {
+  Table4 t;
+  Hints<Key4> hints(t.bucket_count());
+  Key4 k;
+  t.emplace(k, Stats(1, 1, 1));
+  // Every packet shares the same hash, but most are for another flow.
+  hints.Remember(7, t.index(t.find(k)));
+  Key4 other;
+  other.src_ip = 1;
+  t.emplace(other, Stats(1, 1, 1));
+  for (size_t i = 0; i < Hints<Key4>::kCheckEvery; i++) {
+    const Key4& key = (i % 4) ? other : k;
+    if (hints.Find(&t, key, 7) == t.end() && t.find(key) != t.end()) {
+      hints.Missed();
+    }
+  }
+  EXPECT_FALSE(hints.enabled());
+}
+
+// New flows' first packets always miss, but that's no reason to stop using
+// hints.
+TEST_F(HintsTest, TestFirstPacketsDontCount) {
+  Table4 t;
+  t.reserve(2 * Hints<Key4>::kCheckEvery);
+  Hints<Key4> hints(t.bucket_count());
+  EXPECT_GE(hints.size(), 2 * t.bucket_count());
+  for (uint32_t i = 0; i < 2 * Hints<Key4>::kCheckEvery; i++) {
+    Key4 k;
+    k.src_ip = i;
+    const uint32_t rxhash = i * 2654435761U;
+    auto iter = hints.Find(&t, k, rxhash);
+    EXPECT_TRUE(iter == t.end());
+    iter = t.emplace(k, Stats(1, 1, 1)).first;
+    hints.Remember(rxhash, t.index(iter));
+    // Its second packet finds it through its hint.
+    EXPECT_TRUE(hints.Find(&t, k, rxhash) == iter);
+  }
+  EXPECT_TRUE(hints.enabled());
+  EXPECT_EQ(size_t(Hints<Key4>::kMinSize), Hints<Key4>(0).size());
 }
 
 }  // namespace flow
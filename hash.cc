@@ -0,0 +1,104 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include <random>
+
+#include <city.h>
+
+namespace clerk {
+namespace hash {
+
+namespace {
+
+Seed RandomSeed() {
+  std::random_device dev;
+  Seed s;
+  s.k0 = (uint64_t(dev()) << 32) | dev();
+  s.k1 = (uint64_t(dev()) << 32) | dev();
+  return s;
+}
+
+// Table for the software CRC32C fallback, for the reflected Castagnoli
+// polynomial.
+struct CRCTable {
+  CRCTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+      }
+      t[i] = crc;
+    }
+  }
+  uint32_t t[256];
+};
+
+uint32_t SoftwareCRC32C(uint32_t crc, const uint8_t* p, size_t len) {
+  static const CRCTable table;
+  for (size_t i = 0; i < len; i++) {
+    crc = table.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t HardwareCRC32C(uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t c = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    c = _mm_crc32_u64(c, internal::Load64(p));
+  }
+  crc = c;
+  for (; len > 0; p++, len--) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+
+const bool kHaveSSE42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+}  // namespace
+
+const Seed kSeed = RandomSeed();
+
+uint64_t City::Hash(const void* data, size_t len) {
+  return CityHash64WithSeed(reinterpret_cast<const char*>(data), len,
+                            kSeed.k0);
+}
+
+uint32_t CRC32CUpdate(uint32_t crc, const void* data, size_t len) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+  if (kHaveSSE42) return HardwareCRC32C(crc, p, len);
+#endif
+  return SoftwareCRC32C(crc, p, len);
+}
+
+uint64_t CRC32C::Hash(const void* data, size_t len) {
+  uint32_t crc = CRC32CUpdate(static_cast<uint32_t>(kSeed.k0), data, len);
+  // Multiplying by an odd constant moves the CRC's bits up into the high bits
+  // of the result, which pick where in a table we start probing.
+  return (uint64_t(crc) ^ (kSeed.k1 & 0xffffffff00000000ULL)) *
+         0x9E3779B97F4A7C15ULL;
+}
+
+}  // namespace hash
+}  // namespace clerk
@@ -0,0 +1,134 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_HASH_H_
+#define CLERK_HASH_H_
+
+// Hash policies for flow keys.  Flow keys are chosen by whoever sends us
+// packets, so an unkeyed hash lets an attacker craft keys that all land in
+// the same part of a flow table, turning lookups into linear scans.  All
+// policies here are keyed with a secret chosen randomly at process start.
+//
+// Each policy is a class with a static method
+//   uint64_t Hash(const void* data, size_t len)
+// which is used to hash a key's raw bytes.
+
+#include <stdint.h>
+#include <string.h>
+
+namespace clerk {
+namespace hash {
+
+// Seed is a 128-bit secret key, chosen randomly when the process starts.
+struct Seed {
+  uint64_t k0, k1;
+};
+extern const Seed kSeed;
+
+// City is CityHash64, seeded.  Fast, but CityHash has known seed-independent
+// collisions, so it only raises the bar for attackers a bit.
+struct City {
+  static uint64_t Hash(const void* data, size_t len);
+};
+
+// SipHash13 is SipHash-1-3, a keyed hash designed to resist hash flooding,
+// which is fast on short inputs like our keys.  It's inlined so it can be
+// specialized for each key size.
+struct SipHash13 {
+  static inline uint64_t Hash(const void* data, size_t len);
+};
+
+// CRC32C uses the SSE4.2 crc32 instruction when available (falling back to a
+// table-driven implementation otherwise), then spreads its 32 bits out to 64.
+// It's the fastest of our policies, but CRCs are linear, so collisions can be
+// found independently of the seed:  don't use it where keys are untrusted.
+struct CRC32C {
+  static uint64_t Hash(const void* data, size_t len);
+};
+
+// Raw CRC32C of data, starting from crc, without pre- or post-inversion.
+// Exposed for testing and benchmarking.
+uint32_t CRC32CUpdate(uint32_t crc, const void* data, size_t len);
+
+// The policy used for flow tables.
+typedef SipHash13 Default;
+
+namespace internal {
+
+inline uint64_t Rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+inline uint64_t Load64(const uint8_t* p) {
+  uint64_t out;
+  memcpy(&out, p, sizeof(out));  // little-endian, as SipHash expects
+  return out;
+}
+
+#define SIPROUND           \
+  do {                     \
+    v0 += v1;              \
+    v1 = Rotl(v1, 13);     \
+    v1 ^= v0;              \
+    v0 = Rotl(v0, 32);     \
+    v2 += v3;              \
+    v3 = Rotl(v3, 16);     \
+    v3 ^= v2;              \
+    v0 += v3;              \
+    v3 = Rotl(v3, 21);     \
+    v3 ^= v0;              \
+    v2 += v1;              \
+    v1 = Rotl(v1, 17);     \
+    v1 ^= v2;              \
+    v2 = Rotl(v2, 32);     \
+  } while (0)
+
+// SipHash-c-d, with c rounds per word and d finalization rounds.
+template <int c, int d>
+inline uint64_t SipHash(uint64_t k0, uint64_t k1, const uint8_t* in,
+                        size_t len) {
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  const uint8_t* end = in + (len & ~size_t(7));
+  for (; in != end; in += 8) {
+    uint64_t m = Load64(in);
+    v3 ^= m;
+    for (int i = 0; i < c; i++) SIPROUND;
+    v0 ^= m;
+  }
+  uint64_t b = uint64_t(len) << 56;
+  for (size_t i = 0; i < (len & 7); i++) {
+    b |= uint64_t(in[i]) << (8 * i);
+  }
+  v3 ^= b;
+  for (int i = 0; i < c; i++) SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  for (int i = 0; i < d; i++) SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+}  // namespace internal
+
+inline uint64_t SipHash13::Hash(const void* data, size_t len) {
+  return internal::SipHash<1, 3>(kSeed.k0, kSeed.k1,
+                                 reinterpret_cast<const uint8_t*>(data), len);
+}
+
+}  // namespace hash
+}  // namespace clerk
+
+#endif  // CLERK_HASH_H_
@@ -0,0 +1,77 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <set>
+
+#include <gtest/gtest.h>
+
+#include "flow.h"
+#include "hash.h"
+
+namespace clerk {
+namespace hash {
+
+class HashTest : public ::testing::Test {};
+
+TEST_F(HashTest, TestSipHashVector) {
+  // Test vector from the SipHash paper, for SipHash-2-4.
+  uint8_t in[15];
+  for (int i = 0; i < 15; i++) {
+    in[i] = i;
+  }
+  EXPECT_EQ(0xa129ca6149be45e5ULL,
+            (internal::SipHash<2, 4>(0x0706050403020100ULL,
+                                     0x0f0e0d0c0b0a0908ULL, in, sizeof(in))));
+  // Different keys give different hashes.
+  EXPECT_NE((internal::SipHash<1, 3>(1, 2, in, sizeof(in))),
+            (internal::SipHash<1, 3>(1, 3, in, sizeof(in))));
+}
+
+TEST_F(HashTest, TestCRC32C) {
+  // Standard check value for CRC-32C, which pre- and post-inverts.
+  const char* check = "123456789";
+  EXPECT_EQ(0xe3069283, ~CRC32CUpdate(~0U, check, 9));
+  // Hardware and software implementations must agree on inputs of all sizes,
+  // including those that aren't a multiple of 8 bytes.
+  uint8_t buf[41];
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    buf[i] = i * 37;
+  }
+  uint32_t want = 0x12345678;
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    want = CRC32CUpdate(want, buf + i, 1);
+  }
+  EXPECT_EQ(want, CRC32CUpdate(0x12345678, buf, sizeof(buf)));
+}
+
+template <class H>
+void ExpectDistinct() {
+  std::set<size_t> hashes;
+  flow::Key4 k;
+  for (int i = 0; i < 1000; i++) {
+    k.src_port = i;
+    hashes.insert(k.hash<H>());
+    EXPECT_EQ(k.hash<H>(), k.hash<H>());
+  }
+  EXPECT_EQ(1000, hashes.size());
+}
+
+TEST_F(HashTest, TestPolicies) {
+  ExpectDistinct<City>();
+  ExpectDistinct<SipHash13>();
+  ExpectDistinct<CRC32C>();
+}
+
+}  // namespace hash
+}  // namespace clerk
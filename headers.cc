@@ -35,7 +35,46 @@ Headers::Headers() { Reset(); }
 
 void Headers::Reset() { memset(this, 0, sizeof(*this)); }
 
-void Headers::Parse(StringPiece p) {
+uint8_t Headers::CommonCase(StringPiece p) {
+  if (p.size() < kCommonL4Offset + sizeof(struct udphdr)) {
+    return 0;
+  }
+  const char* start = p.data();
+  auto e = reinterpret_cast<const struct ethhdr*>(start);
+  auto ip = reinterpret_cast<const struct iphdr*>(start + kCommonIPOffset);
+  // 0x45 is version 4 with a 20-byte header.  ParseGeneral doesn't check the
+  // version, but packets that aren't v4 are rare enough to leave to it.
+  if (e->h_proto != htons(ETH_P_IP) || start[kCommonIPOffset] != 0x45) {
+    return 0;
+  }
+  if (ip->protocol == IPPROTO_TCP) {
+    return p.size() < kCommonL4Offset + sizeof(struct tcphdr) ? 0
+                                                              : IPPROTO_TCP;
+  }
+  return ip->protocol == IPPROTO_UDP ? IPPROTO_UDP : 0;
+}
+
+bool Headers::ParseFast(StringPiece p) {
+  const uint8_t protocol = CommonCase(p);
+  if (!protocol) {
+    return false;
+  }
+  const char* start = p.data();
+  const char* l4 = start + kCommonL4Offset;
+  eth = reinterpret_cast<const struct ethhdr*>(start);
+  ip4 = reinterpret_cast<const struct iphdr*>(start + kCommonIPOffset);
+  ip6 = nullptr;
+  tcp = protocol == IPPROTO_TCP ? reinterpret_cast<const struct tcphdr*>(l4)
+                                : nullptr;
+  udp = protocol == IPPROTO_UDP ? reinterpret_cast<const struct udphdr*>(l4)
+                                : nullptr;
+  icmp4 = nullptr;
+  icmp6 = nullptr;
+  ip6frag = nullptr;
+  return true;
+}
+
+void Headers::ParseGeneral(StringPiece p) {
   Reset();
   const char* start = p.data();
   const char* limit = start + p.size();
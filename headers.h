@@ -38,7 +38,24 @@ struct Headers {
   // Parse the given packet data, setting the found header pointers in this
   // struct.  Note that initially we expect to find an ethernet header first,
   // other link types are not yet supported (though they could be later on).
-  void Parse(StringPiece p);
+  void Parse(StringPiece p) {
+    if (!ParseFast(p)) ParseGeneral(p);
+  }
+
+  // ParseFast handles only the packets we see most, untagged ethernet carrying
+  // IPv4 without options and then TCP or UDP, with a few loads at fixed
+  // offsets.  It returns false, changing nothing, for any other packet.  When
+  // it returns true, this struct is as ParseGeneral would have left it.
+  bool ParseFast(StringPiece p);
+  // CommonCase returns IPPROTO_TCP or IPPROTO_UDP if p is one of the packets
+  // ParseFast handles, else 0.  Those packets have their IPv4 header at
+  // kCommonIPOffset, and their TCP or UDP header at kCommonL4Offset.
+  static uint8_t CommonCase(StringPiece p);
+  static const size_t kCommonIPOffset = sizeof(struct ethhdr);
+  static const size_t kCommonL4Offset = kCommonIPOffset + sizeof(struct iphdr);
+  // ParseGeneral handles every encapsulation we know of (VLANs, MPLS, IPv6
+  // extension headers, and so on), walking the packet layer by layer.
+  void ParseGeneral(StringPiece p);
 
   // These pointers are reset to NULL on every call to Parse, then those
   // associated with the packet are set.
@@ -0,0 +1,169 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for packet header parsing and flow key building.  Run with
+// 'make benchmark'.
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "flow.h"
+#include "headers.h"
+#include "ipfix.h"
+#include "stringpiece.h"
+#include "util.h"
+
+DEFINE_int64(benchmark_packets, 1 << 16,
+             "Number of distinct packets to parse per round");
+DEFINE_int64(benchmark_rounds, 256, "Number of times to parse each packet");
+
+namespace clerk {
+namespace {
+
+// Cycles returns the CPU's timestamp counter, or 0 where we can't read one.
+inline uint64_t Cycles() {
+#ifdef __x86_64__
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Frame builds an ethernet frame with 'vlans' 802.1Q tags, carrying IPv4 or
+// IPv6 and then TCP or UDP, from the given random value.
+std::string Frame(bool v4, bool tcp, int vlans, uint64_t r) {
+  std::string pkt(12, '\0');
+  memcpy(&pkt[0], &r, 8);
+  for (int i = 0; i < vlans; i++) {
+    pkt += std::string("\x81\x00\x00\x2a", 4);
+  }
+  const uint8_t protocol = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+  if (v4) {
+    pkt += std::string("\x08\x00", 2);
+    std::string ip(20, '\0');
+    ip[0] = 0x45;
+    ip[9] = protocol;
+    memcpy(&ip[12], &r, 8);
+    pkt += ip;
+  } else {
+    pkt += std::string("\x86\xdd", 2);
+    std::string ip(40, '\0');
+    ip[0] = 0x60;
+    ip[6] = protocol;
+    memcpy(&ip[8], &r, 8);
+    memcpy(&ip[24], &r, 8);
+    pkt += ip;
+  }
+  std::string l4(tcp ? 20 : 8, '\0');
+  memcpy(&l4[0], &r, 4);
+  pkt += l4;
+  pkt.resize(pkt.size() + 16);  // payload
+  return pkt;
+}
+
+// Results are summed into sink, so parsing isn't optimized away.
+volatile uintptr_t sink;
+
+// Benchmark reports the cost of calling parse on each of pkts, which returns
+// something derived from what it parsed.
+template <class F>
+void Benchmark(const char* name, const std::vector<std::string>& pkts,
+               F parse) {
+  std::vector<StringPiece> pieces;
+  for (const auto& pkt : pkts) {
+    pieces.emplace_back(pkt.data(), pkt.size());
+  }
+  uintptr_t sum = 0;
+  int64_t start = GetCurrentTimeNanos();
+  uint64_t cycles = Cycles();
+  for (int64_t round = 0; round < FLAGS_benchmark_rounds; round++) {
+    for (const auto& p : pieces) {
+      sum += parse(p);
+    }
+  }
+  cycles = Cycles() - cycles;
+  int64_t nanos = GetCurrentTimeNanos() - start;
+  sink = sum;
+  const double n = double(pieces.size()) * FLAGS_benchmark_rounds;
+  printf("  %-16s %6.1f cycles/packet %6.2f ns/packet\n", name, cycles / n,
+         nanos / n);
+}
+
+}  // namespace
+
+void BenchmarkHeaders() {
+  std::mt19937_64 rng(1);
+  struct {
+    const char* name;
+    int common_percent;  // of untagged IPv4 TCP/UDP, the rest mixed
+  } mixes[] = {
+      {"all common", 100}, {"95% common", 95}, {"none common", 0},
+  };
+  for (const auto& mix : mixes) {
+    std::vector<std::string> pkts;
+    for (int64_t i = 0; i < FLAGS_benchmark_packets; i++) {
+      const uint64_t r = rng();
+      const bool tcp = r & 1;
+      if (int(r % 100) < mix.common_percent) {
+        pkts.push_back(Frame(true, tcp, 0, r));
+      } else {
+        // Tagged IPv4, or IPv6 with up to two tags.
+        pkts.push_back(Frame(r & 2, tcp, (r & 2) ? 1 : (r >> 2) % 3, r));
+      }
+    }
+    printf("%s:\n", mix.name);
+    Headers h;
+    Benchmark("general", pkts, [&](StringPiece p) {
+      h.ParseGeneral(p);
+      return reinterpret_cast<uintptr_t>(h.tcp) +
+             reinterpret_cast<uintptr_t>(h.udp);
+    });
+    Benchmark("fast+fallback", pkts, [&](StringPiece p) {
+      h.Parse(p);
+      return reinterpret_cast<uintptr_t>(h.tcp) +
+             reinterpret_cast<uintptr_t>(h.udp);
+    });
+    // Building flow keys, as IPFIX does, from parsed headers or straight from
+    // packet data.
+    struct tpacket3_hdr hdr = {};
+    flow::Key4 key4;
+    flow::Key6 key6;
+    flow::Stats stats;
+    Benchmark("parse, then key", pkts, [&](StringPiece p) {
+      h.Parse(p);
+      return BuildKey(h, &hdr, &key4, &key6, &stats) + key4.src_port;
+    });
+    Benchmark("ParseKey", pkts, [&](StringPiece p) {
+      return ParseKey(p, &hdr, &key4, &key6, &stats) + key4.src_port;
+    });
+  }
+}
+
+}  // namespace clerk
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  clerk::BenchmarkHeaders();
+  return 0;
+}
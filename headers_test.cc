@@ -12,6 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "headers.h"
@@ -127,4 +133,56 @@ TEST_F(HeadersTest, ICMP6) {
   POINTERS_EQUAL(h.ip6frag, nullptr);
 }
 
+void ExpectFastMatchesGeneral(const std::string& pkt, size_t* fast) {
+  StringPiece p(pkt.data(), pkt.size());
+  Headers general, parsed, quick;
+  general.ParseGeneral(p);
+  parsed.Parse(p);
+  EXPECT_EQ(memcmp(&general, &parsed, sizeof(Headers)), 0);
+  if (quick.ParseFast(p)) {
+    ++*fast;
+    EXPECT_EQ(memcmp(&general, &quick, sizeof(Headers)), 0);
+  }
+}
+
+// ParseFast must agree with ParseGeneral on every packet it accepts.  We try
+// them on our samples, on every truncation of them, and on copies with random
+// values for the bytes which pick each layer.
+TEST_F(HeadersTest, FastMatchesGeneral) {
+  std::string ip4tcp(ip4udp, sizeof(ip4udp));
+  ip4tcp[23] = IPPROTO_TCP;
+  std::string vlan(ip4udp, 12);
+  vlan += std::string("\x81\x00\x00\x2a", 4);
+  vlan += std::string(ip4udp + 12, sizeof(ip4udp) - 12);
+  const std::vector<std::string> samples = {
+      std::string(ip4udp, sizeof(ip4udp)), ip4tcp,
+      std::string(ip6tcp, sizeof(ip6tcp)), vlan,
+  };
+  size_t fast = 0;
+  for (const auto& sample : samples) {
+    for (size_t n = 0; n <= sample.size(); n++) {
+      ExpectFastMatchesGeneral(sample.substr(0, n), &fast);
+    }
+  }
+  // The fast path takes IPv4 UDP from 42 bytes on, and TCP from 54.
+  EXPECT_EQ(fast, (sizeof(ip4udp) - 41) + (sizeof(ip4udp) - 53));
+
+  // Ethertype, IP version and header length, and IP protocol, with values
+  // which are likely to mean something.
+  const size_t kOffsets[] = {12, 13, 14, 23};
+  const uint8_t kValues[] = {0x00, 0x01, 0x06, 0x08, 0x11, 0x3a, 0x44, 0x45,
+                             0x46, 0x4f, 0x55, 0x65, 0x81, 0x86, 0xdd};
+  std::mt19937 rng(1);
+  fast = 0;
+  for (int i = 0; i < 10000; i++) {
+    std::string pkt = samples[rng() % samples.size()];
+    for (int j = rng() % 4; j >= 0; j--) {
+      pkt[kOffsets[rng() % 4]] = kValues[rng() % sizeof(kValues)];
+    }
+    pkt.resize(rng() % (pkt.size() + 1));
+    ExpectFastMatchesGeneral(pkt, &fast);
+  }
+  EXPECT_GT(fast, 0);
+}
+
 }  // namespace clerk
@@ -14,182 +14,604 @@
 
 #include <arpa/inet.h>   // inet_ntop
 #include <netinet/in.h>  // INET6_ADDRSTRLEN
+#include <stdio.h>       // flockfile
+
+#include <algorithm>
+#include <deque>
 
 #include "ipfix.h"
+#include "asn_map.h"
 #include "flow.h"
 #include "send.h"
+#include "thread_pool.h"
 #include "util.h"
 
 #include <glog/logging.h>
 
 namespace clerk {
 
-IPFIX::IPFIX(const IPFIX* other, const IPFIXFactory* f) : factory_(f) {
+namespace {
+
+// TCP flags which end a flow.
+const uint8_t kEndFlags = 0x01 /* FIN */ | 0x04 /* RST */;
+
+// FillPacket fills in the parts of a flow key and stats shared by IPv4 and
+// IPv6.
+template <class K>
+inline void FillPacket(const Headers& h, const struct tpacket3_hdr* hdr,
+                       K* key, flow::Stats* stats) {
+  // Layer 2-ish
+  if (hdr->tp_status & TP_STATUS_VLAN_VALID) {
+    key->vlan = hdr->hv1.tp_vlan_tci;
+  }
+
+  // Layer 4
+  if (h.tcp) {
+    key->src_port = ntohs(h.tcp->th_sport);
+    key->dst_port = ntohs(h.tcp->th_dport);
+    stats->tcp_flags = h.tcp->th_flags;
+  } else if (h.udp) {
+    key->src_port = ntohs(h.udp->source);
+    key->dst_port = ntohs(h.udp->dest);
+  } else if (h.icmp4) {
+    key->set_icmp(h.icmp4->type, h.icmp4->code);
+  } else if (h.icmp6) {
+    key->set_icmp(h.icmp6->icmp6_type, h.icmp6->icmp6_code);
+  }
+}
+
+inline uint32_t LookupASN(const ASNMap& asns, uint32_t ip4) {
+  return asns.ASN4(ip4);
+}
+inline uint32_t LookupASN(const ASNMap& asns, const flow::IP6& ip6) {
+  return asns.ASN(ip6.addr);
+}
+
+}  // namespace
+
+int BuildKey(const Headers& h, const struct tpacket3_hdr* hdr,
+             flow::Key4* key4, flow::Key6* key6, flow::Stats* stats) {
+  // Layer 3.  Each address family gets its own key type and table, and the
+  // rest of the work is specialized for it at compile time.
+  if (h.ip4) {
+    *key4 = flow::Key4();
+    key4->src_ip = ntohl(h.ip4->saddr);
+    key4->dst_ip = ntohl(h.ip4->daddr);
+    key4->protocol = h.ip4->protocol;
+    key4->tos = h.ip4->tos >> 2;
+    FillPacket(h, hdr, key4, stats);
+    return 4;
+  } else if (h.ip6) {
+    *key6 = flow::Key6();
+    memcpy(key6->src_ip.addr, &h.ip6->ip6_src, sizeof(key6->src_ip.addr));
+    memcpy(key6->dst_ip.addr, &h.ip6->ip6_dst, sizeof(key6->dst_ip.addr));
+    key6->protocol = h.ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    key6->tos = (h.ip6->ip6_flow & 0x0FC00000) >> 22;
+    FillPacket(h, hdr, key6, stats);
+    return 6;
+  }
+  return 0;
+}
+
+int ParseKey(StringPiece data, const struct tpacket3_hdr* hdr,
+             flow::Key4* key4, flow::Key6* key6, flow::Stats* stats) {
+  const uint8_t protocol = Headers::CommonCase(data);
+  if (__builtin_expect(!protocol, false)) {
+    Headers h;
+    h.ParseGeneral(data);
+    return BuildKey(h, hdr, key4, key6, stats);
+  }
+  const char* d = data.data();
+  auto ip = reinterpret_cast<const struct iphdr*>(d + Headers::kCommonIPOffset);
+  // TCP and UDP headers both start with the source and destination ports.
+  auto ports =
+      reinterpret_cast<const uint16_t*>(d + Headers::kCommonL4Offset);
+  // Key4 has no padding, so setting every field sets the whole key.
+  key4->src_ip = ntohl(ip->saddr);
+  key4->dst_ip = ntohl(ip->daddr);
+  key4->src_port = ntohs(ports[0]);
+  key4->dst_port = ntohs(ports[1]);
+  key4->vlan = (hdr->tp_status & TP_STATUS_VLAN_VALID) ? hdr->hv1.tp_vlan_tci
+                                                        : 0;
+  key4->protocol = protocol;
+  key4->tos = ip->tos >> 2;
+  if (protocol == IPPROTO_TCP) {
+    stats->tcp_flags = reinterpret_cast<const struct tcphdr*>(
+                           d + Headers::kCommonL4Offset)->th_flags;
+  }
+  return 4;
+}
+
+// Returns a new admission filter for a packet thread, if f wants one.
+static std::shared_ptr<AdmissionFilter> NewAdmissionFilter(
+    const IPFIXFactory* f) {
+  if (f->AdmissionBits() == 0) return nullptr;
+  return std::make_shared<AdmissionFilter>(f->AdmissionBits());
+}
+
+IPFIX::IPFIX(const IPFIX* other, const IPFIXFactory* f)
+    : alloc_(other ? other->alloc_ : std::make_shared<SlabAllocator>()),
+      flows_(alloc_.get()),
+      factory_(f),
+      filter_(f->Filter()),
+      admission_(other ? other->admission_ : NewAdmissionFilter(f)),
+      stream_(other ? other->stream_
+                    : f->Streams() ? f->Streams()->Add() : nullptr),
+      ending4_(Ending<flow::Key4>::allocator_type(alloc_.get())),
+      ending6_(Ending<flow::Key6>::allocator_type(alloc_.get())),
+      evicted_(0),
+      dropped_(0),
+      dropped_stats_(0, 0, 0),
+      packets_(0),
+      packets_seen_(0),
+      filtered_(0),
+      unadmitted_(0, 0, 0),
+      rng_(other ? other->rng_ : reinterpret_cast<uintptr_t>(this)) {
   CHECK(f != nullptr);
   if (other) {
-    flows_ = other->flows_;
-    for (auto iter = flows_.begin(); iter != flows_.end(); ) {
-      if (iter->second.Finished(factory_->CutoffNanos()) ==
-          flow::Stats::ACTIVE_TIMEOUT) {
-        iter->second.packets = 0;
-        iter->second.bytes = 0;
-        iter->second.tcp_flags = 0;
-        ++iter;
+    // We start each interval empty:  flows that carry on across intervals are
+    // tracked by the main thread (see flow::Retain), so nothing here is
+    // proportional to the number of flows.  We size our tables for as many
+    // flows as we saw last interval, and since the tables we get from our
+    // slab allocator come with their control bytes already zeroed (by
+    // whoever freed them), this costs nothing per slot either.
+    flows_.v4.table.reserve(other->flows_.v4.table.size());
+    flows_.v6.table.reserve(other->flows_.v6.table.size());
+    if (admission_) admission_->Age();
+    VLOG(1) << "New state with " << flows_.v4.table.bucket_count() << "+"
+            << flows_.v6.table.bucket_count() << " buckets, "
+            << alloc_->system_allocations() << " slab allocations so far";
+  }
+  if (factory_->RxHashHints()) {
+    // Our table is new, so hints from the previous state are all stale.  We
+    // size ours for the table we've just reserved.
+    hints4_.reset(new flow::Hints<flow::Key4>(
+        flows_.v4.table.bucket_count(), alloc_.get()));
+    hints6_.reset(new flow::Hints<flow::Key6>(
+        flows_.v6.table.bucket_count(), alloc_.get()));
+  }
+}
+
+template <class K>
+inline void IPFIX::Prefetch(const flow::Flows<K>& flows,
+                            const flow::Hints<K>* hints, const K& key,
+                            Pending* pending) {
+  // A zero rxhash means the packet source didn't provide one.
+  if (!hints || !hints->enabled()) {
+    pending->rxhash = 0;
+  }
+  if (pending->rxhash) {
+    hints->Prefetch(flows.table, pending->rxhash);
+  } else {
+    pending->hash = flows.table.hash(key);
+    flows.table.Prefetch(pending->hash);
+  }
+}
+
+// Adds a packet's stats to its flow's, returning whether the packet gave the
+// flow its first FIN or RST.
+static inline bool Update(flow::Stats* flow, const flow::Stats& stats) {
+  const bool ending = !(flow->tcp_flags & kEndFlags) &&
+                      (stats.tcp_flags & kEndFlags);
+  *flow += stats;
+  return ending;
+}
+
+template <class K>
+inline bool IPFIX::Add(flow::Flows<K>* flows, flow::Hints<K>* hints,
+                       const K& key, const flow::Stats& stats,
+                       uint32_t rxhash, size_t hash) {
+  if (rxhash) {
+    auto iter = hints->Find(&flows->table, key, rxhash);
+    if (iter != flows->table.end()) {
+      return Update(&iter->second, stats);
+    }
+    hash = flows->table.hash(key);
+  }
+  auto iter = flows->table.find(key, hash);
+  bool ending;
+  if (iter != flows->table.end()) {
+    if (rxhash) hints->Missed();
+    ending = Update(&iter->second, stats);
+  } else {
+    if (admission_ && !admission_->Admit(hash)) {
+      // A flow's first packet is only counted, so it takes no memory and
+      // never counts against MaxFlowsPerThread.
+      unadmitted_.packets += stats.packets;
+      unadmitted_.bytes += stats.bytes;
+      return false;
+    }
+    size_t max = factory_->MaxFlowsPerThread();
+    if (__builtin_expect(max && flows_.tracked() >= max, false)) {
+      if (flows->table.empty()) {
+        // All our flows are of the other address family, so we've nothing
+        // to evict to make room for this one.  Just don't track it.
+        dropped_++;
+        dropped_stats_.packets += stats.packets;
+        dropped_stats_.bytes += stats.bytes;
+        return false;
+      }
+      // xorshift64, to pick eviction candidates.
+      rng_ ^= rng_ << 13;
+      rng_ ^= rng_ >> 7;
+      rng_ ^= rng_ << 17;
+      evicted_++;
+      // We hold on to at most max/4 evicted flows until the next export.
+      if (!flow::Evict(flows, max / 4, rng_, &dropped_stats_)) {
+        dropped_++;
+      }
+    }
+    iter = flows->table.emplace(key, stats, hash).first;
+    ending = stats.tcp_flags & kEndFlags;
+  }
+  if (rxhash) {
+    hints->Remember(rxhash, flows->table.index(iter));
+  }
+  return ending;
+}
+
+template <class K>
+void IPFIX::EndLingering(flow::Flows<K>* flows, Ending<K>* ending,
+                         uint64_t now_ns) {
+  const uint64_t linger = factory_->LingerNanos();
+  while (!ending->empty() && ending->front().second + linger <= now_ns) {
+    const K& key = ending->front().first;
+    auto iter = flows->table.find(key);
+    // The flow may have been evicted, or even replaced by a new one.
+    if (iter != flows->table.end() &&
+        (iter->second.tcp_flags & kEndFlags)) {
+      if (iter->second.last_ns + linger > now_ns) {
+        // It's seen packets since, so give it longer.
+        ending->emplace_back(key, iter->second.last_ns);
       } else {
-        iter = flows_.erase(iter);
+        flows->ended.push_back(*iter);
+        flows->ended.back().second.end_reason = flow::Stats::END_DETECTED;
+        flows->table.erase(iter);
       }
     }
-    // Should the number of flows we maintain shrink a lot, we'd like our memory
-    // usage to decrease.  However, we don't want to have to
-    // shrink/grow/shrink/grow our maps constantly.  So, we call 'reserve' on
-    // our new map to shrink it to the size of our old map.  If the flows we
-    // need in memory decrease, this will decrease the map's bucket size (which
-    // otherwise was copied over via the copy constructor and will _not_
-    // decrease ever).  However, since it does it based on the old size, we have
-    // a bit of a buffer for size decreases.
-    flows_.reserve(other->flows_.size());
-    LOG(INFO) << "Retained " << flows_.size() << " from previous in "
-              << flows_.bucket_count() << " buckets";
+    ending->pop_front();
   }
 }
 
-void IPFIX::Process(const Packet& p) {
-  flow::Key key;
-  flow::Stats stats(p.hdr()->tp_len, 1, p.ts_nanos());
+template <class K>
+void IPFIX::Stream(flow::Flows<K>* flows,
+                   SPSCQueue<std::pair<K, flow::Stats>>* queue) {
+  // If the exporter falls behind, whatever it can't take is gathered as usual.
+  while (!flows->ended.empty() && queue->Push(flows->ended.back())) {
+    flows->ended.pop_back();
+  }
+}
 
-  // Layer 2-ish
-  if (p.hdr()->tp_status & TP_STATUS_VLAN_VALID) {
-    key.vlan = p.hdr()->hv1.tp_vlan_tci;
+void IPFIX::SwapFlows(flow::Table* f) {
+  f->swap(flows_);
+  // Our packet thread aged our admission filter when it swapped us out, so
+  // clear the generation it dropped here, off the packet thread.
+  if (admission_) admission_->ClearStale();
+}
+
+void IPFIX::Process(const Packet& p) { ProcessBatch(&p, 1); }
+
+void IPFIX::ProcessBatch(const Packet* packets, size_t n) {
+  packets_ += n;
+  for (size_t start = 0; start < n; start += kWindow) {
+    const size_t count = std::min(kWindow, n - start);
+    // First pass:  build each packet's key, hashing it while it's fresh, and
+    // start fetching the control bytes for its flow (or, if we have a hint
+    // for it, the flow's slot).
+    for (size_t i = 0; i < count; i++) {
+      const Packet& p = packets[start + i];
+      Pending* pending = &pending_[i];
+      // A sampled packet stands for all the packets it was sampled from.
+      const uint32_t sampled = p.sampling_interval();
+      packets_seen_ += sampled;
+      pending->stats = flow::Stats(uint64_t(p.hdr()->tp_len) * sampled,
+                                   sampled, p.ts_nanos());
+      pending->version = ParseKey(p.data(), p.hdr(), &pending->key4,
+                                  &pending->key6, &pending->stats);
+      // Packets the filter turns away are skipped like non-IP packets.
+      if (filter_ &&
+          ((pending->version == 4 && !filter_->Matches(pending->key4)) ||
+           (pending->version == 6 && !filter_->Matches(pending->key6)))) {
+        pending->version = 0;
+        filtered_++;
+      }
+      pending->rxhash = p.hdr()->hv1.tp_rxhash;
+      if (pending->version == 4) {
+        Prefetch(flows_.v4, hints4_.get(), pending->key4, pending);
+      } else if (pending->version == 6) {
+        Prefetch(flows_.v6, hints6_.get(), pending->key6, pending);
+      }
+    }
+    // By now, the first control bytes we asked for should have arrived, so
+    // we can find and start fetching the slots they point to.
+    for (size_t i = 0; i < count; i++) {
+      const Pending& pending = pending_[i];
+      if (pending.rxhash) continue;
+      if (pending.version == 4) {
+        flows_.v4.table.PrefetchSlot(pending.hash);
+      } else if (pending.version == 6) {
+        flows_.v6.table.PrefetchSlot(pending.hash);
+      }
+    }
+    // Second pass:  update each packet's flow, in order.
+    for (size_t i = 0; i < count; i++) {
+      const Pending& pending = pending_[i];
+      // When streaming, a flow's first FIN or RST starts it lingering.  Later
+      // ones (retransmissions, the other side's FIN) find it lingering
+      // already.
+      if (pending.version == 4) {
+        if (Add(&flows_.v4, hints4_.get(), pending.key4, pending.stats,
+                pending.rxhash, pending.hash) &&
+            stream_) {
+          ending4_.emplace_back(pending.key4, pending.stats.last_ns);
+        }
+      } else if (pending.version == 6) {
+        if (Add(&flows_.v6, hints6_.get(), pending.key6, pending.stats,
+                pending.rxhash, pending.hash) &&
+            stream_) {
+          ending6_.emplace_back(pending.key6, pending.stats.last_ns);
+        }
+      }
+      // Non-IP packets are never exported, so we don't bother tracking them.
+    }
+    if (stream_) {
+      const uint64_t now_ns = pending_[count - 1].stats.last_ns;
+      EndLingering(&flows_.v4, &ending4_, now_ns);
+      EndLingering(&flows_.v6, &ending6_, now_ns);
+      Stream(&flows_.v4, &stream_->v4);
+      Stream(&flows_.v6, &stream_->v6);
+    }
   }
+}
 
-  // Layer 3
-  auto h = p.headers();
-  if (h.ip4) {
-    key.set_src_ip4(ntohl(h.ip4->saddr));
-    key.set_dst_ip4(ntohl(h.ip4->daddr));
-    key.protocol = h.ip4->protocol;
-    key.network = 4;
-    key.tos = h.ip4->tos >> 2;
-  } else if (h.ip6) {
-    key.protocol = h.ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-    key.set_src_ip6(reinterpret_cast<const char*>(&h.ip6->ip6_src));
-    key.set_dst_ip6(reinterpret_cast<const char*>(&h.ip6->ip6_dst));
-    key.network = 6;
-    key.tos = (h.ip6->ip6_flow & 0x0FC00000) >> 22;
+static bool IsV4(const flow::Key4&) { return true; }
+static bool IsV4(const flow::Key6&) { return false; }
+
+// Encoded holds the packets encoded from one partition for each destination,
+// in the order they must be sent.  A deque never moves its packets, which
+// point into their own buffers.
+struct PacketSender::Encoded {
+  explicit Encoded(size_t dests) : packets(dests) {}
+  std::vector<std::deque<ipfix::IPFIXPacket>> packets;
+  int count4 = 0;
+  int count6 = 0;
+};
+
+PacketSender::PacketSender(const std::vector<int>& sock_fds,
+                           const IPFIXFactory* fact, const ASNMap* asns,
+                           uint32_t observation_domain, ThreadPool* pool)
+    : factory_(fact),
+      asns_(asns),
+      pool_(pool),
+      domain_(observation_domain),
+      reported_interval_(1) {
+  CHECK(!sock_fds.empty());
+  for (int fd : sock_fds) {
+    dests_.push_back(Destination{fd, 0});
   }
+}
 
-  // Layer 4
-  if (h.tcp) {
-    key.src_port = ntohs(h.tcp->th_sport);
-    key.dst_port = ntohs(h.tcp->th_dport);
-    stats.tcp_flags = h.tcp->th_flags;
-  } else if (h.udp) {
-    key.src_port = ntohs(h.udp->source);
-    key.dst_port = ntohs(h.udp->dest);
-  } else if (h.icmp4) {
-    key.icmp_type = h.icmp4->type;
-    key.icmp_code = h.icmp4->code;
-  } else if (h.icmp6) {
-    key.icmp_type = h.icmp6->icmp6_type;
-    key.icmp_code = h.icmp6->icmp6_code;
+void PacketSender::Queue(Destination* dest, ipfix::PacketRing* ring,
+                         ipfix::IPFIXPacket* pkt, bool data) {
+  // IPFIX sequence numbers count the data records sent before each packet, so
+  // a packet's number is only known once it's queued, which is the order
+  // packets are sent in.
+  pkt->SetSequence(dest->seq);
+  if (data) {
+    dest->seq += pkt->count();
   }
+  ring->Queue(pkt);
+}
 
-  flow::AddToTable(&flows_, key, stats);
-  return;
+template <class K>
+void PacketSender::AddFlow(const K& key, const flow::Stats& stats,
+                           uint32_t unix_secs, Encoded* out,
+                           std::vector<ipfix::IPFIXPacket*>* pkts) const {
+  auto end_reason = stats.Finished(factory_->CutoffNanos());
+  size_t d = 0;
+  if (dests_.size() > 1) {
+    d = flow::PartitionOf(key.hash(), dests_.size());
+  }
+  // Flows with small counters go in packets of their own, using the narrow
+  // template, so each packet holds records of a single size.
+  const bool narrow = ipfix::NarrowCounters(stats);
+  const ipfix::Format* format = factory_->Format();
+  ipfix::IPFIXPacket*& pkt = (*pkts)[2 * d + narrow];
+  if (pkt == nullptr) {
+    out->packets[d].emplace_back(unix_secs, domain_, format,
+                                 factory_->MaxPacketSize());
+    pkt = &out->packets[d].back();
+    pkt->Reset(ipfix::DataPacketType(IsV4(key), narrow), 0);
+  }
+  uint32_t src_asn = 0, dst_asn = 0;
+  if (format->uses_asns) {
+    src_asn = LookupASN(*asns_, key.src_ip);
+    dst_asn = LookupASN(*asns_, key.dst_ip);
+  }
+  if (pkt->AddToBuffer(key, stats, end_reason, src_asn, dst_asn)) {
+    pkt = nullptr;
+  }
+}
+
+void PacketSender::Encode(const flow::Table& partition, uint32_t unix_secs,
+                          Encoded* out) const {
+  // A single pass over the partition, filling v4 and v6 packets together.
+  std::vector<ipfix::IPFIXPacket*> pkts4(2 * dests_.size(), nullptr);
+  std::vector<ipfix::IPFIXPacket*> pkts6(2 * dests_.size(), nullptr);
+  out->count4 += partition.v4.size();
+  out->count6 += partition.v6.size();
+  partition.v4.ForEach([&](const flow::Key4& key, const flow::Stats& stats) {
+    AddFlow(key, stats, unix_secs, out, &pkts4);
+  });
+  partition.v6.ForEach([&](const flow::Key6& key, const flow::Stats& stats) {
+    AddFlow(key, stats, unix_secs, out, &pkts6);
+  });
 }
 
-void PacketSender::Send(const flow::Table& flows) {
+void PacketSender::Send(const std::vector<flow::Table>& partitions) {
   uint32_t unix_secs = GetCurrentTimeNanos() / kNumNanosPerSecond;
-  LOG(INFO) << "FLUSHING " << flows.size() << " to " << fd_;
-  ipfix::IPFIXPacket pkt(unix_secs);
-
-  // Write IPv4 template and packets.
-  LOG(INFO) << "Writing IPv4 template";
-  pkt.Reset(ipfix::PT_TEMPLATE, seq_);
-  pkt.WriteFlowSet(true);
-  pkt.SendTo(fd_);
-
-  pkt.Reset(ipfix::PT_V4, seq_);
-  int ip4count = 0;
-  for (auto iter : flows) {
-    auto end_reason = iter.second.Finished(factory_->CutoffNanos());
-    if (iter.first.network == 4 &&
-        (iter.second.packets > 0 ||
-         end_reason != flow::Stats::ACTIVE_TIMEOUT)) {
-      ip4count++;
-      seq_++;
-      if (pkt.AddToBuffer(iter.first, iter.second, end_reason)) {
-        pkt.SendTo(fd_);
-        pkt.Reset(ipfix::PT_V4, seq_);
+  LOG(INFO) << "FLUSHING " << partitions.size() << " partitions to "
+            << dests_.size() << " sockets";
+  // Each partition is encoded separately, in parallel if we have a pool.
+  // Packets never span partitions, so what's sent doesn't depend on how many
+  // threads did the encoding.
+  std::vector<Encoded> encoded(partitions.size(), Encoded(dests_.size()));
+  auto encode = [&](size_t i) {
+    Encode(partitions[i], unix_secs, &encoded[i]);
+  };
+  if (pool_) {
+    pool_->Run(partitions.size(), encode);
+  } else {
+    for (size_t i = 0; i < partitions.size(); i++) {
+      encode(i);
+    }
+  }
+  // Then packets are numbered and sent in order from this thread, one
+  // destination at a time, as fast as our pacing allows.
+  // Our sampling rate follows the templates, whenever we're sampling, and
+  // once more when we stop.
+  const uint32_t interval = SamplingInterval();
+  const bool report_sampling = interval > 1 || reported_interval_ > 1;
+  reported_interval_ = interval;
+  // As are the totals of packets we didn't admit to flows, once there are
+  // any.  Loaded once, so every destination gets the same.
+  const uint64_t unadmitted_packets = UnadmittedPackets();
+  const uint64_t unadmitted_bytes = UnadmittedBytes();
+  const bool report_unadmitted = unadmitted_packets > 0;
+  const ipfix::Pacing& pacing = pacing_ ? *pacing_ : factory_->Pacing();
+  std::unique_ptr<ipfix::Pacer> pacer;
+  if (pacing.enabled()) {
+    // Starting with templates, and options.
+    size_t packets = (2 + (report_sampling ? 2 : 0) +
+                      (report_unadmitted ? 2 : 0)) * dests_.size(),
+           bytes = 0;
+    for (auto& e : encoded) {
+      for (auto& pkts : e.packets) {
+        packets += pkts.size();
+        for (auto& pkt : pkts) {
+          bytes += pkt.size();
+        }
       }
     }
+    pacer.reset(new ipfix::Pacer(ipfix::Pacer::For(pacing, packets, bytes)));
+    VLOG(1) << "Pacing " << packets << " packets at "
+            << pacer->packets_per_sec() << " packets/sec, "
+            << pacer->bytes_per_sec() << " bytes/sec";
   }
-  if (pkt.count()) {
-    pkt.SendTo(fd_);
-  }
-  LOG(INFO) << "Wrote IPv4: " << ip4count;
-
-  // Write IPv6 template and packets.
-  LOG(INFO) << "Writing IPv6 template";
-  pkt.Reset(ipfix::PT_TEMPLATE, seq_);
-  pkt.WriteFlowSet(false);
-  pkt.SendTo(fd_);
-
-  pkt.Reset(ipfix::PT_V6, seq_);
-  int ip6count = 0;
-  for (auto iter : flows) {
-    auto end_reason = iter.second.Finished(factory_->CutoffNanos());
-    if (iter.first.network == 6 &&
-        (iter.second.packets > 0 ||
-         end_reason != flow::Stats::ACTIVE_TIMEOUT)) {
-      ip6count++;
-      seq_++;
-      if (pkt.AddToBuffer(iter.first, iter.second, end_reason)) {
-        pkt.SendTo(fd_);
-        pkt.Reset(ipfix::PT_V6, seq_);
+  const int64_t start_ns = GetCurrentTimeNanos();
+  size_t syscalls = 0;
+  for (size_t d = 0; d < dests_.size(); d++) {
+    Destination* dest = &dests_[d];
+    ipfix::PacketRing ring(dest->fd, unix_secs, domain_, factory_->Format(),
+                           factory_->MaxPacketSize(), pacer.get());
+    for (bool v4 : {true, false}) {
+      ipfix::IPFIXPacket* pkt = ring.Next();
+      pkt->Reset(ipfix::PT_TEMPLATE, 0);
+      pkt->WriteFlowSet(v4);
+      Queue(dest, &ring, pkt, false);
+    }
+    if (report_sampling) {
+      ipfix::IPFIXPacket* pkt = ring.Next();
+      pkt->Reset(ipfix::PT_OPTIONS_TEMPLATE, 0);
+      pkt->WriteSamplingTemplate();
+      Queue(dest, &ring, pkt, false);
+      pkt = ring.Next();
+      pkt->Reset(ipfix::PT_SAMPLING, 0);
+      pkt->AddSampling(interval);
+      Queue(dest, &ring, pkt, true);
+    }
+    if (report_unadmitted) {
+      ipfix::IPFIXPacket* pkt = ring.Next();
+      pkt->Reset(ipfix::PT_OPTIONS_TEMPLATE, 0);
+      pkt->WriteUnadmittedTemplate();
+      Queue(dest, &ring, pkt, false);
+      pkt = ring.Next();
+      pkt->Reset(ipfix::PT_UNADMITTED, 0);
+      pkt->AddUnadmitted(unadmitted_packets, unadmitted_bytes);
+      Queue(dest, &ring, pkt, true);
+    }
+    for (auto& e : encoded) {
+      for (auto& pkt : e.packets[d]) {
+        Queue(dest, &ring, &pkt, true);
       }
     }
+    ring.Flush();
+    syscalls += ring.syscalls();
+  }
+  int count4 = 0, count6 = 0;
+  for (const auto& e : encoded) {
+    count4 += e.count4;
+    count6 += e.count6;
   }
-  if (pkt.count()) {
-    pkt.SendTo(fd_);
+  const double secs = (GetCurrentTimeNanos() - start_ns) * 1.0 /
+                      kNumNanosPerSecond;
+  LOG(INFO) << "Wrote IPv4: " << count4 << ", IPv6: " << count6 << " in "
+            << syscalls << " sendmmsg calls over " << secs << " secs, "
+            << (pacer ? pacer->waited_ns() : 0) * 1.0 / kNumNanosPerSecond
+            << " of them waiting to pace";
+}
+
+void EndedStreams::Drain(std::vector<flow::Table>* ended) {
+  std::unique_lock<std::mutex> ml(mu_);
+  ended->clear();
+  ended->resize(queues_.size());
+  for (size_t i = 0; i < queues_.size(); i++) {
+    std::pair<flow::Key4, flow::Stats> f4;
+    while (queues_[i].v4.Pop(&f4)) {
+      (*ended)[i].v4.ended.push_back(f4);
+    }
+    std::pair<flow::Key6, flow::Stats> f6;
+    while (queues_[i].v6.Pop(&f6)) {
+      (*ended)[i].v6.ended.push_back(f6);
+    }
   }
-  LOG(INFO) << "Wrote IPv6: " << ip6count;
 }
 
-static void WriteIPToBuffer(char* buf, int n, const uint8_t* ip, bool v4) {
-  inet_ntop(v4 ? AF_INET : AF_INET6, ip + (v4 ? 12 : 0), buf, n);
+static void WriteIPToBuffer(char* buf, int n, uint32_t ip4) {
+  uint32_t net = htonl(ip4);
+  inet_ntop(AF_INET, &net, buf, n);
+}
+static void WriteIPToBuffer(char* buf, int n, const flow::IP6& ip6) {
+  inet_ntop(AF_INET6, ip6.addr, buf, n);
 }
 
-void FileSender::Send(const flow::Table& flows) {
+template <class K>
+void FileSender::WriteFlows(const flow::Flows<K>& flows,
+                            uint32_t sampling_interval) {
   char src_ip_buf[INET6_ADDRSTRLEN];
   char dst_ip_buf[INET6_ADDRSTRLEN];
+  flows.ForEach([&](const K& key, const flow::Stats& stats) {
+    auto end_reason = stats.Finished(factory_->CutoffNanos());
+    WriteIPToBuffer(src_ip_buf, sizeof(src_ip_buf), key.src_ip);
+    WriteIPToBuffer(dst_ip_buf, sizeof(dst_ip_buf), key.dst_ip);
+    fprintf(f_, "%.9Lf,%.9Lf,%s,%s,%d,%d,%d,%d,%d,%d,%d,%lu,%lu,%d,%u\n",
+            stats.first_ns * 1.0L / kNumNanosPerSecond,
+            stats.last_ns * 1.0L / kNumNanosPerSecond, src_ip_buf, dst_ip_buf,
+            key.src_port, key.is_icmp() ? 0 : key.dst_port, key.vlan, key.tos,
+            key.protocol, key.icmp_type(), key.icmp_code(), stats.bytes,
+            stats.packets, end_reason, sampling_interval);
+  });
+}
+
+void FileSender::Send(const std::vector<flow::Table>& partitions) {
+  flockfile(f_);
   fprintf(f_,
           "FlowStart,FlowEnd,SrcIP,DstIP,SrcPort,DstPort,VLAN,TOS,Protocol,"
-          "ICMPType,ICMPCode,Bytes,Packets\n");
-  for (const auto& iter : flows) {
-    auto end_reason = iter.second.Finished(factory_->CutoffNanos());
-    auto key = iter.first;
-    auto stats = iter.second;
-    if (stats.packets > 0 || end_reason != flow::Stats::ACTIVE_TIMEOUT) {
-      WriteIPToBuffer(src_ip_buf, sizeof(src_ip_buf), key.src_ip,
-                      key.network == 4);
-      WriteIPToBuffer(dst_ip_buf, sizeof(src_ip_buf), key.dst_ip,
-                      key.network == 4);
-      fprintf(f_, "%.9Lf,%.9Lf,%s,%s,%d,%d,%d,%d,%d,%d,%d,%lu,%lu,%d\n",
-              stats.first_ns * 1.0L / kNumNanosPerSecond,
-              stats.last_ns * 1.0L / kNumNanosPerSecond, src_ip_buf, dst_ip_buf,
-              key.src_port, key.dst_port, key.vlan, key.tos, key.protocol,
-              key.icmp_type, key.icmp_code, stats.bytes, stats.packets,
-              end_reason);
-    }
+          "ICMPType,ICMPCode,Bytes,Packets,EndReason,SamplingInterval\n");
+  const uint32_t interval = SamplingInterval();
+  for (const auto& partition : partitions) {
+    WriteFlows(partition.v4, interval);
+  }
+  for (const auto& partition : partitions) {
+    WriteFlows(partition.v6, interval);
+  }
+  const uint64_t unadmitted_packets = UnadmittedPackets();
+  if (unadmitted_packets > 0) {
+    fprintf(f_, "UnadmittedPackets,UnadmittedBytes\n%lu,%lu\n",
+            unadmitted_packets, UnadmittedBytes());
   }
   fflush(f_);
-}
-
-void IPFIX::operator+=(const IPFIX& other) {
-  LOG(INFO) << "Adding " << other.flows_.size() << " flows into "
-            << flows_.size();
-  flow::CombineTable(&flows_, other.flows_);
+  funlockfile(f_);
 }
 
 }  // namespace clerk
@@ -15,32 +15,170 @@
 #ifndef CLERK_IPFIX_H_
 #define CLERK_IPFIX_H_
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "admission.h"
+#include "asn_map.h"
+#include "filter.h"
 #include "flow.h"
+#include "headers.h"
+#include "send.h"
+#include "slab.h"
+#include "spsc_queue.h"
+#include "stringpiece.h"
 #include "testimony.h"
 
 namespace clerk {
 
 class IPFIXFactory;
+class ThreadPool;
+
+// BuildKey fills in the flow key for a packet from its parsed headers and its
+// testimony header, and sets stats' tcp_flags.  It returns the packet's IP
+// version (4 or 6), having filled in key4 or key6 to match, or 0 if the packet
+// isn't IP.
+int BuildKey(const Headers& h, const struct tpacket3_hdr* hdr,
+             flow::Key4* key4, flow::Key6* key6, flow::Stats* stats);
+// ParseKey is BuildKey straight from a packet's data, without parsing its
+// headers first.  For the common case (see Headers::CommonCase), it reads each
+// key field from its fixed offset and writes it once, so the key needn't be
+// zeroed first.  Other packets are parsed in full, then given to BuildKey.
+int ParseKey(StringPiece data, const struct tpacket3_hdr* hdr,
+             flow::Key4* key4, flow::Key6* key6, flow::Stats* stats);
+
+// EndedFlows carries flows a packet thread has stopped tracking (because they
+// ended, or were evicted) to the exporter as they end, rather than at the next
+// gather.  Each packet thread is its only producer, for its whole life.
+struct EndedFlows {
+  static const size_t kCapacity = 1 << 14;
+
+  EndedFlows() : v4(kCapacity), v6(kCapacity) {}
+  SPSCQueue<std::pair<flow::Key4, flow::Stats>> v4;
+  SPSCQueue<std::pair<flow::Key6, flow::Stats>> v6;
+};
+
+// EndedStreams holds every packet thread's EndedFlows, in the order packet
+// threads' first states were created, which is the order of their threads.
+class EndedStreams {
+ public:
+  EndedStreams() {}
+
+  // Returns a new queue for a packet thread.
+  EndedFlows* Add() {
+    std::unique_lock<std::mutex> ml(mu_);
+    queues_.emplace_back();
+    return &queues_.back();
+  }
+  // Replaces 'ended' with everything currently queued, one table per packet
+  // thread, with popped flows in each table's ended lists.  Called only by the
+  // exporter, which is the queues' only consumer.
+  void Drain(std::vector<flow::Table>* ended);
+
+ private:
+  std::mutex mu_;  // guards queues_, not the queues themselves
+  std::deque<EndedFlows> queues_;
+
+  DISALLOW_COPY_AND_ASSIGN(EndedStreams);
+};
 
 class Sender {
  public:
-  Sender() {}
+  Sender()
+      : sampling_interval_(1), unadmitted_packets_(0), unadmitted_bytes_(0) {}
   virtual ~Sender() {}
-  virtual void Send(const flow::Table& flows) = 0;
+  // Sets the sampling interval reported with the flows sent from now on:  on
+  // average, their counters were scaled up from one in every 'interval'
+  // packets (see Sampler).  Safe to call while another thread is sending.
+  void SetSamplingInterval(uint32_t interval) {
+    sampling_interval_.store(interval, std::memory_order_relaxed);
+  }
+  uint32_t SamplingInterval() const {
+    return sampling_interval_.load(std::memory_order_relaxed);
+  }
+  // Adds to the totals of packets and bytes which weren't admitted to a
+  // flow (see IPFIXFactory::SetAdmissionBits), reported with the flows sent
+  // from now on, once there are any.  They're totals since we started, not
+  // per interval, since they're only ever sent as totals.  Safe to call while
+  // another thread is sending.
+  void AddUnadmitted(uint64_t packets, uint64_t bytes) {
+    unadmitted_packets_.fetch_add(packets, std::memory_order_relaxed);
+    unadmitted_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  uint64_t UnadmittedPackets() const {
+    return unadmitted_packets_.load(std::memory_order_relaxed);
+  }
+  uint64_t UnadmittedBytes() const {
+    return unadmitted_bytes_.load(std::memory_order_relaxed);
+  }
+  // Sends the flows in all partitions.  Partitions hold only flows which saw
+  // packets this interval, and flows which have ended (see flow::Retain), so
+  // every flow in them is exported, and the work of sending is proportional
+  // to active flows rather than to all the flows we're tracking.
+  virtual void Send(const std::vector<flow::Table>& partitions) = 0;
+
+ private:
+  std::atomic<uint32_t> sampling_interval_;
+  std::atomic<uint64_t> unadmitted_packets_;
+  std::atomic<uint64_t> unadmitted_bytes_;
 };
 
 class PacketSender : public Sender {
  public:
-  PacketSender(int sock_fd, const IPFIXFactory* fact)
-      : factory_(fact), fd_(sock_fd), seq_(0) {}
+  // Flows are spread over the sockets in 'sock_fds' by the hash of their
+  // keys, so each socket always gets the same subset of flows.  Each socket
+  // gets its own templates and sequence numbers.  ASNs for exported flows are
+  // looked up in 'asns' as they're sent.  Senders sharing a socket must use
+  // different observation domains.  If 'pool' is non-null, partitions are
+  // encoded in parallel on it, so Send must not itself be called from one of
+  // its tasks.
+  PacketSender(const std::vector<int>& sock_fds, const IPFIXFactory* fact,
+               const ASNMap* asns, uint32_t observation_domain,
+               ThreadPool* pool);
   ~PacketSender() override {}
 
-  void Send(const flow::Table& flows) override;
+  void Send(const std::vector<flow::Table>& partitions) override;
+  // Overrides the factory's pacing for this sender.
+  void SetPacing(const ipfix::Pacing& pacing) {
+    pacing_.reset(new ipfix::Pacing(pacing));
+  }
 
  private:
+  struct Encoded;
+  // Destination is a socket we export to, each a separate IPFIX session.
+  struct Destination {
+    int fd;
+    uint32_t seq;  // data records sent so far, as IPFIX sequence numbers count
+  };
+
+  // Encodes the flows in 'partition' into IPFIX data packets, which are
+  // complete but for their sequence numbers.  Safe to call concurrently.
+  void Encode(const flow::Table& partition, uint32_t unix_secs,
+              Encoded* out) const;
+  // Adds a flow to the packet being filled for its destination and counter
+  // width, as indexed in 'pkts' by 2 * destination + narrow, first
+  // starting a new packet in 'out' if there isn't one, and forgetting the
+  // packet once it's full.
+  template <class K>
+  void AddFlow(const K& key, const flow::Stats& stats, uint32_t unix_secs,
+               Encoded* out, std::vector<ipfix::IPFIXPacket*>* pkts) const;
+  // Numbers a filled packet and queues it to be sent to 'dest'.
+  void Queue(Destination* dest, ipfix::PacketRing* ring,
+             ipfix::IPFIXPacket* pkt, bool data);
+
   const IPFIXFactory* factory_;
-  int fd_;
-  uint32_t seq_;
+  const ASNMap* asns_;
+  ThreadPool* pool_;
+  uint32_t domain_;
+  // The sampling interval we last reported, so we report going back to
+  // taking every packet, but otherwise only report sampling while it's on.
+  uint32_t reported_interval_;
+  std::vector<Destination> dests_;
+  std::unique_ptr<ipfix::Pacing> pacing_;  // if null, use the factory's
 };
 
 class FileSender : public Sender {
@@ -49,10 +187,18 @@ class FileSender : public Sender {
       : factory_(fact), f_(f) {}
   ~FileSender() override {}
 
-  void Send(const flow::Table& flows) override;
+  // Writes the flows as CSV, with a header line.  Once there are unadmitted
+  // packets, their totals follow as a table of their own, with its own
+  // header, so they're never mistaken for flows.
+  void Send(const std::vector<flow::Table>& partitions) override;
 
  private:
+  template <class K>
+  void WriteFlows(const flow::Flows<K>& flows, uint32_t sampling_interval);
+
   const IPFIXFactory* factory_;
+  // Senders (say, one per packet thread, and a streamer) may share f, so we
+  // hold f's own stdio lock while writing, which they all share.
   FILE* f_;
 };
 
@@ -61,38 +207,233 @@ class FileSender : public Sender {
 class IPFIX : public State {
  public:
   // Create a new IPFIX.  If 'old' is non-null, it contains the previous state
-  // for this thread, which we aggregate into the new state.
+  // for this thread.  Each state only holds the flows seen during its own
+  // interval; 'old' is used to share our allocator and to size our tables.
   IPFIX(const IPFIX* old, const IPFIXFactory* f);
   ~IPFIX() override {}
 
   // Process implements clerk::State by updating our flow table.
   void Process(const Packet& p) override;
-  // += aggregates multiple IPFIX states together.
-  void operator+=(const IPFIX& other);
+  void ProcessBatch(const Packet* packets, size_t n) override;
+  // We build flow keys straight from packet data, with ParseKey.
+  bool WantsHeaders() const override { return false; }
 
-  void SwapFlows(flow::Table* f) { f->swap(flows_); }
+  // Swaps our flows into f.  Call once we're no longer processing packets,
+  // and before our packet thread's next swap, since this also does the
+  // admission filter's deferred clearing (see AdmissionFilter::ClearStale).
+  void SwapFlows(flow::Table* f);
+
+  // Number of flows evicted from our table because it was full, and how many
+  // of those (or of new flows we couldn't make room for) were dropped rather
+  // than exported, with their packets and bytes.
+  uint64_t evicted() const { return evicted_; }
+  uint64_t dropped() const { return dropped_; }
+  uint64_t dropped_packets() const { return dropped_stats_.packets; }
+  uint64_t dropped_bytes() const { return dropped_stats_.bytes; }
+  // Number of packets we've processed, and how many packets they stand for,
+  // which is more if our packet thread's been sampling.
+  uint64_t packets() const { return packets_; }
+  uint64_t packets_seen() const { return packets_seen_; }
+  // Number of packets the factory's filter kept out of our table.
+  uint64_t filtered() const { return filtered_; }
+  // Number of packets which were their flow's first, and so weren't admitted
+  // to our table (see IPFIXFactory::SetAdmissionBits), and their bytes.
+  uint64_t unadmitted() const { return unadmitted_.packets; }
+  uint64_t unadmitted_bytes() const { return unadmitted_.bytes; }
+  // The allocator for our flow storage, shared by all states created for our
+  // packet thread.
+  const SlabAllocator* allocator() const { return alloc_.get(); }
 
  private:
+  // ProcessBatch works on windows of up to kWindow packets at a time, in two
+  // passes.  The first builds each packet's key and prefetches its flow's
+  // table entry; the second updates the flows, by which time their entries
+  // should be in cache, so lookups in big tables don't wait on memory one
+  // packet at a time.  Pending holds a packet's state between passes.
+  static const size_t kWindow = 16;
+  struct Pending {
+    int version;  // IP version, which says which key is valid, or 0 if not IP
+    // If nonzero, find the flow using hints rather than hash.
+    uint32_t rxhash;
+    size_t hash;
+    flow::Stats stats;
+    flow::Key4 key4;
+    flow::Key6 key6;
+  };
+
+  // Prepares to add a packet to flows, filling in pending's rxhash and hash
+  // and prefetching.  If hints is non-null and the packet came with a nonzero
+  // rxhash, we'll use it to try to find the packet's flow without hashing its
+  // key.
+  template <class K>
+  void Prefetch(const flow::Flows<K>& flows, const flow::Hints<K>* hints,
+                const K& key, Pending* pending);
+  // Adds a packet to flows, evicting another flow first if we're full, or
+  // just counts it if its flow isn't admitted yet.  Returns whether the
+  // packet gave a tracked flow its first FIN or RST.
+  template <class K>
+  bool Add(flow::Flows<K>* flows, flow::Hints<K>* hints, const K& key,
+           const flow::Stats& stats, uint32_t rxhash, size_t hash);
+
+  // When streaming, flows which see a FIN or RST are ended, and handed to
+  // the exporter, once they've lingered long enough to catch the packets that
+  // usually follow (say, the ACK of the other side's FIN).  Ending holds the
+  // flows waiting to end, in the order they saw their first FIN or RST, and
+  // when.  Each tracked flow is added once, so it grows with flows, not with
+  // packets, and its memory comes from our allocator.
+  template <class K>
+  using Ending = std::deque<std::pair<K, uint64_t>,
+                            SlabStlAllocator<std::pair<K, uint64_t>>>;
+  // Ends flows whose linger ran out by now_ns.
+  template <class K>
+  void EndLingering(flow::Flows<K>* flows, Ending<K>* ending, uint64_t now_ns);
+  // Hands as many of flows' ended flows to the exporter as it'll take.
+  template <class K>
+  void Stream(flow::Flows<K>* flows,
+              SPSCQueue<std::pair<K, flow::Stats>>* queue);
+
+  // All our flow storage comes from alloc_, which is shared by all states
+  // created for a single packet thread, so memory freed by one interval's
+  // state is reused by the next.
+  std::shared_ptr<SlabAllocator> alloc_;
   flow::Table flows_;
+  // Null unless the factory says to use rxhash hints.
+  std::unique_ptr<flow::Hints<flow::Key4>> hints4_;
+  std::unique_ptr<flow::Hints<flow::Key6>> hints6_;
   const IPFIXFactory* factory_;
+  const clerk::Filter* filter_;  // null if we track everything
+  // Null unless the factory says to admit flows on their second packet.
+  // Shared by all states created for a single packet thread.
+  std::shared_ptr<AdmissionFilter> admission_;
+  // Null unless the factory says to stream ended flows.  Shared by all states
+  // created for a single packet thread.
+  EndedFlows* stream_;
+  Ending<flow::Key4> ending4_;
+  Ending<flow::Key6> ending6_;
+  uint64_t evicted_;
+  uint64_t dropped_;
+  flow::Stats dropped_stats_;  // only packets and bytes are used
+  uint64_t packets_;
+  uint64_t packets_seen_;
+  uint64_t filtered_;
+  flow::Stats unadmitted_;  // only packets and bytes are used
+  uint64_t rng_;  // for sampling eviction candidates
+  Pending pending_[kWindow];
 
   DISALLOW_COPY_AND_ASSIGN(IPFIX);
 };
 
 class IPFIXFactory : public StateFactory {
  public:
-  IPFIXFactory() : flow_timeout_cutoff_ns_(0) {}
+  // Memory used per flow is bounded by kMaxBytesPerFlow (not counting the
+  // admission filter, which has its own budget).  We budget for the peak,
+  // while the main thread splits and merges one interval's flows and packet
+  // threads fill the next interval's tables.  For each flow the limit allows,
+  // there may then be:
+  //  - an entry in a packet thread's table, with its hints, a quarter of an
+  //    entry in its ended flows (evictions beyond that are dropped), and an
+  //    entry in its flows waiting to end;
+  //  - a copy in a shard, with its hash, and either an entry in the previous
+  //    interval's table and ended flows, or, once that table's been split
+  //    and freed, an entry in a partition's merge table;
+  //  - an entry in the retained table, with timers.  Flows which end or are
+  //    evicted leave their timers behind for a while, but there are never
+  //    many more of those than retained flows (see Retain), so we allow for
+  //    two timers per flow.
+  // Tables may be as little as 25/64 full after growing (see FlatMap), so we
+  // allow three slots per entry, and vectors may be half full.
+  static const size_t kTableBytesPerFlow =
+      3 * (sizeof(flow::Table6::value_type) + 1);
+  static const size_t kHintBytesPerFlow = 3 * 2 * sizeof(uint32_t);
+  static const size_t kEndedBytesPerFlow =
+      2 * sizeof(std::pair<flow::Key6, flow::Stats>) / 4;
+  static const size_t kMaxBytesPerFlow =
+      kTableBytesPerFlow + kHintBytesPerFlow + kEndedBytesPerFlow +
+      sizeof(std::pair<flow::Key6, uint64_t>) +
+      2 * (sizeof(std::pair<flow::Key6, flow::Stats>) + sizeof(size_t)) +
+      kTableBytesPerFlow + kEndedBytesPerFlow +
+      kTableBytesPerFlow + 4 * sizeof(TimerWheel<flow::Key6>::Entry);
+
+  IPFIXFactory()
+      : flow_timeout_cutoff_ns_(0),
+        max_flows_per_thread_(0),
+        rxhash_hints_(false),
+        format_(&ipfix::kFullFormat),
+        max_packet_size_(ipfix::kDefaultPacketSize),
+        streams_(nullptr),
+        linger_ns_(0),
+        filter_(nullptr),
+        admission_bits_(0) {}
   ~IPFIXFactory() override {}
 
   std::unique_ptr<State> New(const State* old) const override {
     return std::unique_ptr<State>(
         new IPFIX(reinterpret_cast<const IPFIX*>(old), this));
   }
-  void SetCutoffNanos(uint64_t ms) { flow_timeout_cutoff_ns_ = ms; }
-  uint64_t CutoffNanos() const { return flow_timeout_cutoff_ns_; }
+  // Sets the time before which flows which have seen no packets have timed
+  // out.  May be called while senders are exporting.
+  void SetCutoffNanos(uint64_t ns) {
+    flow_timeout_cutoff_ns_.store(ns, std::memory_order_relaxed);
+  }
+  uint64_t CutoffNanos() const {
+    return flow_timeout_cutoff_ns_.load(std::memory_order_relaxed);
+  }
+  // Sets the maximum number of flows each packet thread tracks at once, or 0
+  // for no limit.  May be called while packet threads are running.
+  void SetMaxFlowsPerThread(size_t n) {
+    max_flows_per_thread_.store(n, std::memory_order_relaxed);
+  }
+  size_t MaxFlowsPerThread() const {
+    return max_flows_per_thread_.load(std::memory_order_relaxed);
+  }
+  // If set, packet threads use the flow hash the kernel provides with each
+  // packet (tp_rxhash) to find flows without hashing their keys.  Only
+  // useful if the packet source was set up to fill tp_rxhash in.
+  void SetRxHashHints(bool hints) { rxhash_hints_ = hints; }
+  bool RxHashHints() const { return rxhash_hints_; }
+  // Sets the layout of exported records, and the largest packet to export
+  // them in.
+  void SetFormat(const ipfix::Format* format) { format_ = format; }
+  const ipfix::Format* Format() const { return format_; }
+  void SetMaxPacketSize(size_t size) { max_packet_size_ = size; }
+  size_t MaxPacketSize() const { return max_packet_size_; }
+  // Sets how fast each sender may export.
+  void SetPacing(const ipfix::Pacing& pacing) { pacing_ = pacing; }
+  const ipfix::Pacing& Pacing() const { return pacing_; }
+  // If set, packet threads hand flows to 'streams' as they end, rather than
+  // holding them until they're gathered.  Flows seeing a FIN or RST end once
+  // they've seen no packets for 'linger_ns'.  Must be set before packet
+  // threads start.
+  void SetStreams(EndedStreams* streams, uint64_t linger_ns) {
+    streams_ = streams;
+    linger_ns_ = linger_ns;
+  }
+  EndedStreams* Streams() const { return streams_; }
+  uint64_t LingerNanos() const { return linger_ns_; }
+  // If set, packet threads only track packets whose flow keys 'filter'
+  // matches.  Must be set before packet threads start.
+  void SetFilter(const clerk::Filter* filter) { filter_ = filter; }
+  const clerk::Filter* Filter() const { return filter_; }
+  // If nonzero, packet threads only give a flow a table entry once it's seen
+  // its second packet, remembering flows they've seen in an AdmissionFilter
+  // with this many bits per generation.  First packets are only counted
+  // instead, and their totals reported in options records of their own (see
+  // Sender::AddUnadmitted), never as flows.  Must be set before packet
+  // threads start.
+  void SetAdmissionBits(size_t bits) { admission_bits_ = bits; }
+  size_t AdmissionBits() const { return admission_bits_; }
 
  private:
-  uint64_t flow_timeout_cutoff_ns_;
+  std::atomic<uint64_t> flow_timeout_cutoff_ns_;
+  std::atomic<size_t> max_flows_per_thread_;
+  bool rxhash_hints_;
+  const ipfix::Format* format_;
+  size_t max_packet_size_;
+  ipfix::Pacing pacing_;
+  EndedStreams* streams_;
+  uint64_t linger_ns_;
+  const clerk::Filter* filter_;
+  size_t admission_bits_;
 };
 
 }  // namespace clerk
@@ -0,0 +1,549 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ipfix.h"
+#include "send.h"
+#include "thread_pool.h"
+
+namespace clerk {
+
+class IPFIXTest : public ::testing::Test {
+ protected:
+  // Returns unparsed packets pointing at each of 'bufs', each holding a
+  // tpacket3_hdr and then its frame, as a packet thread hands them to IPFIX.
+  static std::unique_ptr<Packet[]> Packets(
+      const std::vector<std::string>& bufs) {
+    std::unique_ptr<Packet[]> packets(new Packet[bufs.size()]);
+    for (size_t i = 0; i < bufs.size(); i++) {
+      packets[i].Reset(
+          reinterpret_cast<const struct tpacket3_hdr*>(bufs[i].data()), false,
+          1);
+    }
+    return packets;
+  }
+  // Returns a buffer holding a tpacket3_hdr for 'frame', then frame.
+  static std::string Buffer(const std::string& frame, uint32_t rxhash = 0) {
+    std::string buf(sizeof(struct tpacket3_hdr), '\0');
+    auto hdr = reinterpret_cast<struct tpacket3_hdr*>(&buf[0]);
+    hdr->tp_mac = buf.size();
+    hdr->tp_snaplen = hdr->tp_len = frame.size();
+    hdr->tp_sec = 1;
+    hdr->hv1.tp_rxhash = rxhash;
+    return buf + frame;
+  }
+};
+
+// Sends 'partitions' with a new PacketSender to 'sockets' sockets, returning
+// the packets sent to each, with their export times cleared.
+std::vector<std::vector<std::string>> SendAll(
+    const std::vector<flow::Table>& partitions, ThreadPool* pool,
+    size_t sockets) {
+  std::vector<int> send_fds, recv_fds;
+  for (size_t i = 0; i < sockets; i++) {
+    int fds[2];
+    CHECK_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+    send_fds.push_back(fds[0]);
+    recv_fds.push_back(fds[1]);
+  }
+  IPFIXFactory factory;
+  ASNMap asns;
+  PacketSender sender(send_fds, &factory, &asns, 7, pool);
+  sender.Send(partitions);
+  std::vector<std::vector<std::string>> packets(sockets);
+  for (size_t i = 0; i < sockets; i++) {
+    char buf[ipfix::kMaxPacketSize];
+    ssize_t n;
+    while ((n = recv(recv_fds[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      memset(buf + 4, 0, 4);
+      packets[i].emplace_back(buf, n);
+    }
+    close(send_fds[i]);
+    close(recv_fds[i]);
+  }
+  return packets;
+}
+
+uint32_t ReadBE32(const std::string& s, size_t offset) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data()) + offset;
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Returns the source IPs of the v4 flows in 'packets'.
+std::set<uint32_t> SourceIPs(const std::vector<std::string>& packets) {
+  std::set<uint32_t> ips;
+  for (const auto& p : packets) {
+    // kHeaderSize covers both the message and set headers.
+    const uint32_t type = ReadBE32(p, ipfix::kHeaderSize - 4) >> 16;
+    if (type != ipfix::PT_V4 && type != ipfix::PT_V4_NARROW) continue;
+    const size_t record_size =
+        ipfix::kFullFormat.encoding(type == ipfix::PT_V4_NARROW).record_size4;
+    for (size_t off = ipfix::kHeaderSize; off < p.size();
+         off += record_size) {
+      ips.insert(ReadBE32(p, off));
+    }
+  }
+  return ips;
+}
+
+TEST_F(IPFIXTest, TestParallelEncode) {
+  std::vector<flow::Table> partitions(3);
+  for (int i = 0; i < 300; i++) {
+    flow::Key4 k4;
+    k4.src_ip = i;
+    k4.protocol = IPPROTO_UDP;
+    flow::AddToTable(&partitions[i % 3].v4.table, k4, flow::Stats(1, 1, i));
+    flow::Key6 k6;
+    k6.src_port = i;
+    k6.protocol = IPPROTO_TCP;
+    flow::AddToTable(&partitions[i % 2].v6.table, k6, flow::Stats(1, 1, i));
+  }
+  auto serial = SendAll(partitions, nullptr, 1)[0];
+  ThreadPool pool(3);
+  auto parallel = SendAll(partitions, &pool, 1)[0];
+  // Two templates, then at least one v4 and one v6 packet per partition.
+  ASSERT_GT(serial.size(), 2 + 2 * partitions.size());
+  EXPECT_EQ(serial, parallel);
+}
+
+TEST_F(IPFIXTest, TestSockets) {
+  std::vector<flow::Table> partitions(2);
+  for (int i = 0; i < 1000; i++) {
+    flow::Key4 k4;
+    k4.src_ip = i;
+    k4.protocol = IPPROTO_UDP;
+    flow::AddToTable(&partitions[i % 2].v4.table, k4, flow::Stats(1, 1, i));
+  }
+  auto first = SendAll(partitions, nullptr, 3);
+  auto second = SendAll(partitions, nullptr, 3);
+  std::set<uint32_t> all;
+  for (size_t i = 0; i < first.size(); i++) {
+    // Each socket gets both templates, numbered from zero, and some flows.
+    ASSERT_GT(first[i].size(), 2);
+    EXPECT_EQ(0, ReadBE32(first[i][0], 8));
+    EXPECT_EQ(0, ReadBE32(first[i][1], 8));
+    auto ips = SourceIPs(first[i]);
+    EXPECT_GT(ips.size(), 0);
+    // Each flow always goes to the same socket, and only to that one.
+    EXPECT_EQ(ips, SourceIPs(second[i]));
+    for (uint32_t ip : ips) {
+      EXPECT_TRUE(all.insert(ip).second) << ip;
+    }
+  }
+  EXPECT_EQ(1000, all.size());
+}
+
+TEST_F(IPFIXTest, TestDrain) {
+  EndedStreams streams;
+  EndedFlows* first = streams.Add();
+  EndedFlows* second = streams.Add();
+  flow::Key4 k4;
+  flow::Key6 k6;
+  EXPECT_TRUE(first->v4.Push(std::make_pair(k4, flow::Stats(1, 1, 1))));
+  EXPECT_TRUE(second->v6.Push(std::make_pair(k6, flow::Stats(2, 1, 1))));
+  EXPECT_TRUE(second->v6.Push(std::make_pair(k6, flow::Stats(3, 1, 1))));
+  // Each thread's flows are drained into its own table, in order.
+  std::vector<flow::Table> ended;
+  streams.Drain(&ended);
+  ASSERT_EQ(2, ended.size());
+  ASSERT_EQ(1, ended[0].v4.ended.size());
+  EXPECT_EQ(0, ended[0].v6.size());
+  EXPECT_EQ(0, ended[1].v4.size());
+  ASSERT_EQ(2, ended[1].v6.ended.size());
+  EXPECT_EQ(2, ended[1].v6.ended[0].second.bytes);
+  EXPECT_EQ(3, ended[1].v6.ended[1].second.bytes);
+  streams.Drain(&ended);
+  ASSERT_EQ(2, ended.size());
+  EXPECT_EQ(0, ended[0].size() + ended[1].size());
+}
+
+// Senders report their sampling interval after their templates, while it's
+// above 1, and once more when it's back to 1.
+TEST_F(IPFIXTest, TestSampling) {
+  std::vector<flow::Table> partitions(1);
+  flow::Key4 k;
+  AddToTable(&partitions[0].v4.table, k, flow::Stats(1, 1, 1));
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+  IPFIXFactory factory;
+  ASNMap asns;
+  PacketSender sender({fds[0]}, &factory, &asns, 7, nullptr);
+  // Returns the set IDs of the packets sent.
+  auto sets = [&]() {
+    sender.Send(partitions);
+    std::vector<int> ids;
+    char buf[ipfix::kMaxPacketSize];
+    while (recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+      ids.push_back((uint8_t(buf[16]) << 8) | uint8_t(buf[17]));
+    }
+    return ids;
+  };
+  const std::vector<int> unsampled = {ipfix::PT_TEMPLATE, ipfix::PT_TEMPLATE,
+                                      ipfix::PT_V4_NARROW};
+  const std::vector<int> sampled = {
+      ipfix::PT_TEMPLATE, ipfix::PT_TEMPLATE, ipfix::PT_OPTIONS_TEMPLATE,
+      ipfix::PT_SAMPLING, ipfix::PT_V4_NARROW};
+  EXPECT_EQ(sets(), unsampled);
+  sender.SetSamplingInterval(8);
+  EXPECT_EQ(sets(), sampled);
+  sender.SetSamplingInterval(1);
+  EXPECT_EQ(sets(), sampled);
+  EXPECT_EQ(sets(), unsampled);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// FileSenders sharing a stream, as per-thread senders and the streamer share
+// stdout, must each write a whole export at a time.
+TEST_F(IPFIXTest, TestFileSendersShareStream) {
+  const int kFlows = 100, kSends = 50;
+  FILE* f = tmpfile();
+  ASSERT_TRUE(f != nullptr);
+  IPFIXFactory factory;
+  FileSender first(f, &factory), second(f, &factory);
+  FileSender* senders[2] = {&first, &second};
+  std::vector<flow::Table> partitions[2];
+  for (int s = 0; s < 2; s++) {
+    partitions[s].resize(1);
+    for (int i = 0; i < kFlows; i++) {
+      flow::Key4 key;
+      key.src_ip = i;
+      key.src_port = s + 1;  // so we can tell the senders' rows apart
+      partitions[s][0].v4.table.emplace(key, flow::Stats(1, 1, 1));
+    }
+  }
+  std::thread threads[2];
+  for (int s = 0; s < 2; s++) {
+    threads[s] = std::thread([&senders, &partitions, s]() {
+      for (int i = 0; i < kSends; i++) {
+        senders[s]->Send(partitions[s]);
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  rewind(f);
+  char line[256];
+  int exports = 0, rows = 0, port = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "FlowStart,", 10) == 0) {
+      EXPECT_EQ(exports ? kFlows : 0, rows);
+      exports++;
+      rows = 0;
+      port = 0;
+      continue;
+    }
+    // SrcPort is the fifth column.
+    const char* p = line;
+    for (int i = 0; i < 4; i++) p = strchr(p, ',') + 1;
+    if (rows++ == 0) port = atoi(p);
+    EXPECT_EQ(port, atoi(p)) << "row " << rows << " of export " << exports;
+  }
+  EXPECT_EQ(kFlows, rows);
+  EXPECT_EQ(2 * kSends, exports);
+  fclose(f);
+}
+
+// RandomFrame returns an ethernet frame with random addresses and ports,
+// carrying IPv4 or IPv6, maybe behind a VLAN tag, and then TCP, UDP, or ICMP.
+std::string RandomFrame(std::mt19937_64* rng) {
+  const uint64_t r = (*rng)();
+  const uint64_t bits = (*rng)();
+  std::string pkt(12, '\0');
+  if (r & 1) pkt += std::string("\x81\x00\x00\x2a", 4);
+  const bool v4 = r & 2;
+  const uint8_t icmp = v4 ? uint8_t(IPPROTO_ICMP) : uint8_t(IPPROTO_ICMPV6);
+  const uint8_t protocols[] = {IPPROTO_TCP, IPPROTO_UDP, icmp};
+  const uint8_t protocol = protocols[(r >> 2) % 3];
+  if (v4) {
+    pkt += std::string("\x08\x00", 2);
+    std::string ip(20, '\0');
+    ip[0] = 0x45;
+    ip[1] = r >> 8;  // TOS
+    ip[9] = protocol;
+    memcpy(&ip[12], &bits, 8);
+    pkt += ip;
+  } else {
+    pkt += std::string("\x86\xdd", 2);
+    std::string ip(40, '\0');
+    ip[0] = 0x60 | ((r >> 8) & 0x0F);  // traffic class
+    ip[1] = r >> 16;
+    ip[6] = protocol;
+    memcpy(&ip[8], &bits, 8);
+    memcpy(&ip[28], &bits, 8);
+    pkt += ip;
+  }
+  std::string l4(protocol == IPPROTO_TCP ? 20 : 8, '\0');
+  memcpy(&l4[0], &bits, 4);
+  if (protocol == IPPROTO_TCP) l4[13] = r >> 24;  // flags
+  return pkt + l4;
+}
+
+// ParseKey must build the same key as BuildKey on fully parsed headers, for
+// every packet, including truncated and corrupted ones.
+TEST_F(IPFIXTest, TestParseKey) {
+  std::mt19937_64 rng(1);
+  size_t common = 0;
+  for (int i = 0; i < 20000; i++) {
+    std::string pkt = RandomFrame(&rng);
+    const uint64_t r = rng();
+    if (r & 1) {
+      // Corrupt a byte which picks a layer or a header length.
+      const size_t kOffsets[] = {12, 13, 14, 23};
+      pkt[kOffsets[(r >> 1) % 4]] = r >> 8;
+    }
+    if (r & 2) pkt.resize((r >> 16) % (pkt.size() + 1));
+    struct tpacket3_hdr hdr = {};
+    if (r & 4) {
+      hdr.tp_status = TP_STATUS_VLAN_VALID;
+      hdr.hv1.tp_vlan_tci = r >> 32;
+    }
+    StringPiece data(pkt.data(), pkt.size());
+    common += Headers::CommonCase(data) != 0;
+
+    Headers h;
+    h.ParseGeneral(data);
+    flow::Key4 want4, got4;
+    flow::Key6 want6, got6;
+    flow::Stats want, got;
+    const int version = BuildKey(h, &hdr, &want4, &want6, &want);
+    // Garbage, so we know ParseKey sets every byte of the key it returns.
+    memset(static_cast<void*>(&got4), 0xAB, sizeof(got4));
+    memset(static_cast<void*>(&got6), 0xAB, sizeof(got6));
+    ASSERT_EQ(ParseKey(data, &hdr, &got4, &got6, &got), version) << i;
+    if (version == 4) {
+      EXPECT_TRUE(got4 == want4) << i;
+    } else if (version == 6) {
+      EXPECT_TRUE(got6 == want6) << i;
+    }
+    EXPECT_EQ(got.tcp_flags, want.tcp_flags) << i;
+  }
+  EXPECT_GT(common, 500);
+}
+
+// Once a packet thread's state is warmed up, with tables sized for the
+// traffic it sees, swapping states and processing packets must not allocate
+// anything new:  everything on the packet path comes from the thread's slab
+// allocator, which reuses what the previous intervals freed.  That holds with
+// every feature that keeps memory on the packet path turned on.
+TEST_F(IPFIXTest, TestSteadyStateDoesNotAllocate) {
+  struct Mode {
+    const char* name;
+    bool hints;
+    bool stream;
+    size_t max_flows;
+    size_t admission_bits;
+  };
+  const Mode kModes[] = {
+      {"plain", false, false, 0, 0},
+      {"hints", true, false, 0, 0},
+      {"streaming", false, true, 0, 0},
+      {"eviction", false, false, 64, 0},
+      {"admission", false, false, 0, 1 << 16},
+      {"everything", true, true, 64, 1 << 16},
+  };
+  // Evictions only make room in the table of the new flow's address family,
+  // so with both families, either table may keep growing towards the limit
+  // for a few intervals.  So we also have IPv4-only traffic, which fills the
+  // IPv4 table to the limit in the first interval.
+  std::mt19937_64 rng(1);
+  std::vector<std::string> both, v4;
+  for (int i = 0; i < 1000; i++) {
+    // Repeat each frame, so some flows are admitted.
+    const std::string frame = RandomFrame(&rng);
+    const size_t ethertype = frame[12] == '\x81' ? 16 : 12;
+    for (int copy = 0; copy < 2; copy++) {
+      both.push_back(Buffer(frame, i + 1));
+      if (frame[ethertype] == '\x08') v4.push_back(both.back());
+    }
+  }
+  auto both_packets = Packets(both);
+  auto v4_packets = Packets(v4);
+  for (const Mode& mode : kModes) {
+    SCOPED_TRACE(mode.name);
+    const auto& bufs = mode.max_flows ? v4 : both;
+    const Packet* packets =
+        mode.max_flows ? v4_packets.get() : both_packets.get();
+    IPFIXFactory factory;
+    factory.SetRxHashHints(mode.hints);
+    // With no linger, flows end on their first FIN or RST.  No one drains
+    // the streams, so once they fill up, ended flows pile up as usual.
+    EndedStreams streams;
+    if (mode.stream) factory.SetStreams(&streams, 0);
+    factory.SetMaxFlowsPerThread(mode.max_flows);
+    factory.SetAdmissionBits(mode.admission_bits);
+    std::unique_ptr<State> state = factory.New(nullptr);
+    const SlabAllocator* alloc =
+        static_cast<IPFIX*>(state.get())->allocator();
+    uint64_t before = alloc->system_allocations();
+    for (int interval = 0; interval < 5; interval++) {
+      auto ipfix = static_cast<IPFIX*>(state.get());
+      for (size_t i = 0; i < bufs.size(); i += 16) {
+        ipfix->ProcessBatch(&packets[i],
+                            std::min<size_t>(16, bufs.size() - i));
+      }
+      EXPECT_EQ(ipfix->packets(), bufs.size());
+      // Swap, as a packet thread does, then export and free the old flows.
+      std::unique_ptr<State> next = factory.New(state.get());
+      // The first two intervals' memory is all new, as each interval's is
+      // freed only once the next has started.
+      if (interval >= 2) {
+        EXPECT_EQ(before, alloc->system_allocations()) << interval;
+      }
+      before = alloc->system_allocations();
+      flow::Table exported;
+      ipfix->SwapFlows(&exported);
+      EXPECT_GT(exported.size(), 0);
+      state.swap(next);
+    }
+  }
+}
+
+// When streaming, a flow starts lingering on its first FIN or RST.  Every
+// later one, like a retransmitted FIN, must not queue it again.
+TEST_F(IPFIXTest, TestRepeatedFINs) {
+  std::string frame(12, '\0');
+  frame += std::string("\x08\x00", 2);
+  std::string ip(20, '\0');
+  ip[0] = 0x45;
+  ip[9] = IPPROTO_TCP;
+  std::string tcp(20, '\0');
+  tcp[13] = 0x11;  // FIN, ACK
+  const std::vector<std::string> bufs(1000, Buffer(frame + ip + tcp));
+  auto packets = Packets(bufs);
+  IPFIXFactory factory;
+  EndedStreams streams;
+  factory.SetStreams(&streams, 1000000000);
+  std::unique_ptr<State> state = factory.New(nullptr);
+  const SlabAllocator* alloc = static_cast<IPFIX*>(state.get())->allocator();
+  const uint64_t before = alloc->system_allocations();
+  for (size_t i = 0; i < bufs.size(); i += 16) {
+    state->ProcessBatch(&packets[i], std::min<size_t>(16, bufs.size() - i));
+  }
+  // Queueing every FIN would have grown the lingering queue by a block every
+  // few dozen packets.
+  EXPECT_LE(alloc->system_allocations() - before, 1);
+}
+
+// Packets whose flows aren't admitted are only counted, never exported as
+// flows.
+TEST_F(IPFIXTest, TestUnadmittedCounted) {
+  std::mt19937_64 rng(1);
+  std::vector<std::string> bufs;
+  uint64_t bytes = 0;
+  for (int i = 0; i < 1000; i++) {
+    bufs.push_back(Buffer(RandomFrame(&rng)));
+    bytes += bufs.back().size() - sizeof(struct tpacket3_hdr);
+  }
+  bufs.push_back(bufs[0]);  // Admits bufs[0]'s flow.
+  auto packets = Packets(bufs);
+  IPFIXFactory factory;
+  factory.SetAdmissionBits(1 << 20);
+  factory.SetMaxFlowsPerThread(1);
+  std::unique_ptr<State> state = factory.New(nullptr);
+  state->ProcessBatch(&packets[0], bufs.size());
+  auto ipfix = static_cast<IPFIX*>(state.get());
+  EXPECT_EQ(1000, ipfix->unadmitted());
+  EXPECT_EQ(bytes, ipfix->unadmitted_bytes());
+  EXPECT_EQ(0, ipfix->evicted());
+  std::unique_ptr<State> next = factory.New(state.get());
+  flow::Table exported;
+  ipfix->SwapFlows(&exported);
+  // Just the admitted flow, with only its second packet.
+  EXPECT_EQ(1, exported.size());
+  EXPECT_EQ(1, exported.tracked());
+  exported.v4.ForEach([](const flow::Key4& key, const flow::Stats& stats) {
+    EXPECT_NE(0, key.src_ip);
+    EXPECT_EQ(1, stats.packets);
+  });
+  exported.v6.ForEach([](const flow::Key6&, const flow::Stats& stats) {
+    EXPECT_EQ(1, stats.packets);
+  });
+}
+
+// Senders report unadmitted totals in options records of their own, after
+// their templates, once there are any, and keep adding to them.
+TEST_F(IPFIXTest, TestUnadmittedReported) {
+  std::vector<flow::Table> partitions(1);
+  flow::Key4 k;
+  AddToTable(&partitions[0].v4.table, k, flow::Stats(1, 1, 1));
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+  IPFIXFactory factory;
+  ASNMap asns;
+  PacketSender sender({fds[0]}, &factory, &asns, 7, nullptr);
+  // Returns the packets sent.
+  auto send = [&]() {
+    sender.Send(partitions);
+    std::vector<std::string> pkts;
+    char buf[ipfix::kMaxPacketSize];
+    ssize_t n;
+    while ((n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      pkts.emplace_back(buf, n);
+    }
+    return pkts;
+  };
+  auto type = [](const std::string& pkt) {
+    return ReadBE32(pkt, ipfix::kHeaderSize - 4) >> 16;
+  };
+  EXPECT_EQ(3, send().size());  // Just templates and the flow.
+  sender.AddUnadmitted(10, 1000);
+  sender.AddUnadmitted(5, 500);
+  for (int i = 0; i < 2; i++) {
+    auto pkts = send();
+    ASSERT_EQ(5, pkts.size());
+    EXPECT_EQ(ipfix::PT_OPTIONS_TEMPLATE, type(pkts[2]));
+    ASSERT_EQ(ipfix::PT_UNADMITTED, type(pkts[3]));
+    // Scoped to our observation domain, then 64-bit packets and bytes.
+    const std::string& record = pkts[3];
+    ASSERT_EQ(ipfix::kHeaderSize + 20, record.size());
+    EXPECT_EQ(7, ReadBE32(record, ipfix::kHeaderSize));
+    EXPECT_EQ(0, ReadBE32(record, ipfix::kHeaderSize + 4));
+    EXPECT_EQ(15, ReadBE32(record, ipfix::kHeaderSize + 8));
+    EXPECT_EQ(0, ReadBE32(record, ipfix::kHeaderSize + 12));
+    EXPECT_EQ(1500, ReadBE32(record, ipfix::kHeaderSize + 16));
+    EXPECT_EQ(ipfix::PT_V4_NARROW, type(pkts[4]));
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // FileSenders write them as a table of their own, after the flows.
+  FILE* f = tmpfile();
+  ASSERT_TRUE(f != nullptr);
+  FileSender file(f, &factory);
+  file.AddUnadmitted(15, 1500);
+  file.Send(partitions);
+  rewind(f);
+  std::vector<std::string> lines;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    lines.push_back(line);
+  }
+  fclose(f);
+  ASSERT_EQ(4, lines.size());
+  EXPECT_EQ(0, lines[0].find("FlowStart,"));
+  EXPECT_EQ("UnadmittedPackets,UnadmittedBytes\n", lines[2]);
+  EXPECT_EQ("15,1500\n", lines[3]);
+}
+
+}  // namespace clerk
@@ -0,0 +1,79 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_SAMPLER_H_
+#define CLERK_SAMPLER_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace clerk {
+
+// Sampler sheds load for a packet thread which is falling behind.  Rather than
+// letting its backlog grow until the kernel drops packets at random, skewing
+// every counter by an unknown amount, the thread processes one in every
+// interval() packets, deterministically, and scales what it counts by
+// interval(), so counters are off by a bounded, known amount instead.
+//
+// How far behind the thread is is measured by how old packets are when it
+// gets to them.  Each time they're more than max_lag_ns old, the interval
+// doubles, up to max_interval; each time they're less than a quarter of that,
+// it halves, back down to 1 (every packet) once the thread has caught up.
+class Sampler {
+ public:
+  // With max_interval 1, every packet is always taken.
+  Sampler(int64_t max_lag_ns, uint32_t max_interval)
+      : max_lag_ns_(max_lag_ns),
+        max_interval_(std::max<uint32_t>(1, max_interval)),
+        interval_(1),
+        countdown_(1) {}
+
+  // Adjusts the interval given that the packet about to be offered to Take
+  // is lag_ns old.  Returns whether the interval changed.
+  bool Update(int64_t lag_ns) {
+    uint32_t interval = interval_;
+    if (lag_ns > max_lag_ns_) {
+      interval = std::min(max_interval_, interval * 2);
+    } else if (lag_ns < max_lag_ns_ / 4) {
+      interval = std::max<uint32_t>(1, interval / 2);
+    }
+    if (interval == interval_) return false;
+    interval_ = interval;
+    countdown_ = std::min(countdown_, interval_);
+    return true;
+  }
+  // Returns whether to process the next packet, which then stands for
+  // interval() packets.
+  bool Take() {
+    if (--countdown_) return false;
+    countdown_ = interval_;
+    return true;
+  }
+  uint32_t interval() const { return interval_; }
+
+ private:
+  int64_t max_lag_ns_;
+  uint32_t max_interval_;
+  uint32_t interval_;
+  uint32_t countdown_;  // packets until we take one
+
+  DISALLOW_COPY_AND_ASSIGN(Sampler);
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_SAMPLER_H_
@@ -0,0 +1,62 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include "sampler.h"
+
+namespace clerk {
+
+class SamplerTest : public ::testing::Test {};
+
+TEST_F(SamplerTest, TestTake) {
+  Sampler s(100, 8);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(s.Take());
+  }
+  // Falling behind doubles the interval each time, up to the max.
+  EXPECT_TRUE(s.Update(101));
+  EXPECT_EQ(s.interval(), 2);
+  EXPECT_TRUE(s.Update(1000));
+  EXPECT_TRUE(s.Update(1000));
+  EXPECT_FALSE(s.Update(1000));
+  EXPECT_EQ(s.interval(), 8);
+  int taken = 0;
+  for (int i = 0; i < 80; i++) {
+    taken += s.Take();
+  }
+  EXPECT_EQ(taken, 10);
+  // Between a quarter of the max lag and the max, we hold steady.
+  EXPECT_FALSE(s.Update(25));
+  EXPECT_FALSE(s.Update(100));
+  EXPECT_EQ(s.interval(), 8);
+  // Catching up halves it, back down to taking everything.
+  EXPECT_TRUE(s.Update(24));
+  EXPECT_EQ(s.interval(), 4);
+  EXPECT_TRUE(s.Update(0));
+  EXPECT_TRUE(s.Update(0));
+  EXPECT_FALSE(s.Update(0));
+  EXPECT_EQ(s.interval(), 1);
+  EXPECT_TRUE(s.Take());
+  EXPECT_TRUE(s.Take());
+}
+
+TEST_F(SamplerTest, TestDisabled) {
+  Sampler s(100, 1);
+  EXPECT_FALSE(s.Update(1000000));
+  EXPECT_EQ(s.interval(), 1);
+  EXPECT_TRUE(s.Take());
+}
+
+}  // namespace clerk
@@ -14,7 +14,13 @@
 
 #include "send.h"
 
+#include <endian.h>
+#include <string.h>
 #include <sys/socket.h>
+
+#include <algorithm>
+#include <type_traits>
+
 #include <glog/logging.h>
 #include "stringpiece.h"
 
@@ -23,55 +29,314 @@
 namespace clerk {
 namespace ipfix {
 
-static inline void WriteChars(char** buffer, uint8_t a, uint8_t b, uint8_t c,
-                              uint8_t d) {
-  char* buf = *buffer;
-  buf[0] = a;
-  buf[1] = b;
-  buf[2] = c;
-  buf[3] = d;
+// The multi-byte writers below store a whole word at a time, which compiles
+// to a byte swap and a single store rather than one store per byte.
+static inline void WriteBE32(char** buffer, uint32_t data) {
+  data = htobe32(data);
+  memcpy(*buffer, &data, 4);
   *buffer += 4;
 }
 
-static inline void WriteBE32(char** buffer, uint32_t data) {
-  WriteChars(buffer, data >> 24, data >> 16, data >> 8, data);
+static inline void WriteBE16(char** buffer, uint16_t data) {
+  data = htobe16(data);
+  memcpy(*buffer, &data, 2);
+  *buffer += 2;
 }
 
 static inline void WriteBE16s(char** buffer, uint16_t first, uint16_t second) {
-  WriteChars(buffer, first >> 8, first, second >> 8, second);
+  WriteBE32(buffer, (uint32_t(first) << 16) | second);
 }
 
 static inline void WriteBE64(char** buffer, uint64_t v) {
-  WriteBE32(buffer, v >> 32);
-  WriteBE32(buffer, v & 0xFFFFFFFF);
+  v = htobe64(v);
+  memcpy(*buffer, &v, 8);
+  *buffer += 8;
+}
+
+namespace {
+
+// Each field below describes one IPFIX information element: its type and
+// length in v4 and v6 records, and how to write it.  They're combined into
+// formats by Fields, below.
+
+template <uint16_t type, uint16_t length>
+struct FixedField {
+  static constexpr uint16_t Type(bool v4) { return type; }
+  static constexpr uint16_t Length(bool v4) { return length; }
+};
+
+struct SrcAddr {
+  static constexpr uint16_t Type(bool v4) {
+    return v4 ? IPV4_SRC_ADDR : IPV6_SRC_ADDR;
+  }
+  static constexpr uint16_t Length(bool v4) { return v4 ? 4 : 16; }
+  static void Write(char** b, const flow::Key4& k, const Record&) {
+    WriteBE32(b, k.src_ip);
+  }
+  static void Write(char** b, const flow::Key6& k, const Record&) {
+    memcpy(*b, k.src_ip.addr, 16);
+    *b += 16;
+  }
+};
+
+struct DstAddr {
+  static constexpr uint16_t Type(bool v4) {
+    return v4 ? IPV4_DST_ADDR : IPV6_DST_ADDR;
+  }
+  static constexpr uint16_t Length(bool v4) { return v4 ? 4 : 16; }
+  static void Write(char** b, const flow::Key4& k, const Record&) {
+    WriteBE32(b, k.dst_ip);
+  }
+  static void Write(char** b, const flow::Key6& k, const Record&) {
+    memcpy(*b, k.dst_ip.addr, 16);
+    *b += 16;
+  }
+};
+
+struct SrcPort : FixedField<L4_SRC_PORT, 2> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    WriteBE16(b, k.src_port);
+  }
+};
+
+// For ICMP, the destination port is zero, with type and code in ICMPType.
+struct DstPort : FixedField<L4_DST_PORT, 2> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    WriteBE16(b, k.is_icmp() ? 0 : k.dst_port);
+  }
+};
+
+// For ICMP, the destination port holds type and code, as in NetFlow v5.
+struct RawDstPort : FixedField<L4_DST_PORT, 2> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    WriteBE16(b, k.dst_port);
+  }
+};
+
+struct Protocol : FixedField<PROTOCOL, 1> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    *(*b)++ = k.protocol;
+  }
+};
+
+struct TCPFlags : FixedField<TCP_FLAGS, 1> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    *(*b)++ = r.stats->tcp_flags;
+  }
+};
+
+struct ICMPType : FixedField<ICMP_TYPE, 2> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    WriteBE16(b, (uint16_t(k.icmp_type()) << 8) | k.icmp_code());
+  }
+};
+
+struct SrcAS : FixedField<BGP_SOURCE_AS_NUMBER, 4> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteBE32(b, r.src_asn);
+  }
+};
+
+struct DstAS : FixedField<BGP_DESTINATION_AS_NUMBER, 4> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteBE32(b, r.dst_asn);
+  }
+};
+
+// Counters are written in 4 bytes rather than 8 in narrow templates.  Since
+// narrow is a compile-time constant, each encoder writes just one width.
+template <bool narrow>
+static inline void WriteCounter(char** b, uint64_t v) {
+  if (narrow) {
+    WriteBE32(b, v);
+  } else {
+    WriteBE64(b, v);
+  }
+}
+
+template <bool narrow>
+struct Bytes : FixedField<IN_BYTES, narrow ? 4 : 8> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteCounter<narrow>(b, r.stats->bytes);
+  }
+};
+
+template <bool narrow>
+struct Packets : FixedField<IN_PKTS, narrow ? 4 : 8> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteCounter<narrow>(b, r.stats->packets);
+  }
+};
+
+// Note that even though we have nanoseconds, we write out milliseconds.  This
+// is because IPFIX says that micros/nanos should be in stupid NTP format
+// (https://tools.ietf.org/html/rfc5905#section-6) and I'm too lazy to compute
+// it.
+struct StartMillis : FixedField<FLOW_START_MILLISECONDS, 8> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteBE64(b, r.stats->first_ns / kNumNanosPerMilli);
+  }
+};
+
+struct EndMillis : FixedField<FLOW_END_MILLISECONDS, 8> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    WriteBE64(b, r.stats->last_ns / kNumNanosPerMilli);
+  }
+};
+
+struct TOS : FixedField<IP_CLASS_OF_SERVICE, 1> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    *(*b)++ = k.tos;
+  }
+};
+
+struct EndReason : FixedField<FLOW_END_REASON, 1> {
+  template <class K>
+  static void Write(char** b, const K&, const Record& r) {
+    *(*b)++ = r.end_reason;
+  }
+};
+
+struct VLAN : FixedField<VLAN_ID, 2> {
+  template <class K>
+  static void Write(char** b, const K& k, const Record&) {
+    WriteBE16(b, k.vlan);
+  }
+};
+
+// Fields is a list of fields, which it writes in order with no branches or
+// loops, once the compiler's inlined each field's Write.
+template <class... Fs>
+struct Fields;
+
+template <>
+struct Fields<> {
+  static constexpr uint16_t Count() { return 0; }
+  static constexpr size_t Size(bool v4) { return 0; }
+  template <class G>
+  static constexpr bool Has() { return false; }
+  static void WriteTemplate(char**, bool) {}
+  template <class K>
+  static void Write(char**, const K&, const Record&) {}
+};
+
+template <class F, class... Fs>
+struct Fields<F, Fs...> {
+  static constexpr uint16_t Count() { return 1 + Fields<Fs...>::Count(); }
+  static constexpr size_t Size(bool v4) {
+    return F::Length(v4) + Fields<Fs...>::Size(v4);
+  }
+  // Returns whether field G is in the list.
+  template <class G>
+  static constexpr bool Has() {
+    return std::is_same<F, G>::value || Fields<Fs...>::template Has<G>();
+  }
+  static void WriteTemplate(char** b, bool v4) {
+    WriteBE16s(b, F::Type(v4), F::Length(v4));
+    Fields<Fs...>::WriteTemplate(b, v4);
+  }
+  template <class K>
+  static void Write(char** b, const K& k, const Record& r) {
+    F::Write(b, k, r);
+    Fields<Fs...>::Write(b, k, r);
+  }
+};
+
+template <class Fs>
+constexpr Encoding MakeEncoding() {
+  return Encoding{Fs::Size(true), Fs::Size(false), &Fs::WriteTemplate,
+                  &Fs::template Write<flow::Key4>,
+                  &Fs::template Write<flow::Key6>};
+}
+
+// Makes a format from a field list parameterized by counter width.
+template <template <bool> class Fs>
+constexpr Format MakeFormat(const char* name) {
+  return Format{name, Fs<false>::Count(),
+                Fs<false>::template Has<SrcAS>() ||
+                    Fs<false>::template Has<DstAS>(),
+                MakeEncoding<Fs<false>>(), MakeEncoding<Fs<true>>()};
+}
+
+template <bool narrow>
+using FullFields =
+    Fields<SrcAddr, DstAddr, SrcPort, DstPort, Protocol, TCPFlags, ICMPType,
+           SrcAS, DstAS, Bytes<narrow>, Packets<narrow>, StartMillis,
+           EndMillis, TOS, EndReason, VLAN>;
+
+template <bool narrow>
+using CompactFields =
+    Fields<SrcAddr, DstAddr, SrcPort, RawDstPort, Protocol, TCPFlags,
+           Bytes<narrow>, Packets<narrow>, StartMillis, EndMillis, TOS,
+           EndReason>;
+
+}  // namespace
+
+const Format kFullFormat = MakeFormat<FullFields>("full");
+const Format kCompactFormat = MakeFormat<CompactFields>("compact");
+
+const Format* FormatNamed(const std::string& name) {
+  for (const Format* f : {&kFullFormat, &kCompactFormat}) {
+    if (name == f->name) return f;
+  }
+  return nullptr;
 }
 
-IPFIXPacket::IPFIXPacket(uint32_t unix_secs) : unix_secs_(unix_secs) {}
+IPFIXPacket::IPFIXPacket(uint32_t unix_secs, uint32_t observation_domain,
+                         const Format* format, size_t max_size)
+    : format_(format),
+      buffer_(max_size),
+      record_buf_(nullptr),
+      unix_secs_(unix_secs),
+      domain_(observation_domain) {
+  CHECK_LE(max_size, kMaxPacketSize);
+  // Every packet must be able to hold at least a template or a record.
+  CHECK_GE(max_size, kHeaderSize + 2 * format->template_size());
+  CHECK_GE(max_size, kHeaderSize + format->wide.record_size6);
+}
 
 void IPFIXPacket::Reset(PacketType t, uint32_t seq) {
   count_ = 0;
   type_ = t;
-  memset(buffer_, 0, kMaxPacketSize);
-  start_ = &buffer_[0];
-  current_ = &buffer_[0];
-  limit_ = start_ + kMaxPacketSize;
+  start_ = buffer_.data();
+  current_ = buffer_.data();
+  limit_ = start_ + buffer_.size();
 
   CHECK_LE(current_ + kHeaderSize, limit_);
   char* want = current_ + kHeaderSize;
   WriteBE16s(&current_, 0xffff, 0xffff);  // Will rewrite in SendTo.
   WriteBE32(&current_, unix_secs_);
   WriteBE32(&current_, seq);
-  WriteBE32(&current_, 12345);  // Source ID
+  WriteBE32(&current_, domain_);
   record_buf_ = current_;
   WriteBE16s(&current_, 0xffff, 0xffff);  // Will rewrite in SendTo.
-  CHECK_EQ(current_, want) << "diff: " << current_ - buffer_;
+  CHECK_EQ(current_, want) << "diff: " << current_ - start_;
+}
+
+void IPFIXPacket::SetSequence(uint32_t seq) {
+  char* seq_buf = start_ + 8;
+  WriteBE32(&seq_buf, seq);
 }
+
 StringPiece IPFIXPacket::PacketData() {
   CHECK(record_buf_ != nullptr);
   WriteBE16s(&record_buf_, type_, current_ - record_buf_);
   char* first = start_;
   WriteBE16s(&first, 10, current_ - start_);
-  return StringPiece(buffer_, current_ - buffer_);
+  return StringPiece(start_, current_ - start_);
 }
 
 void IPFIXPacket::SendTo(int sock_fd) {
@@ -83,76 +348,223 @@ void IPFIXPacket::SendTo(int sock_fd) {
 
 int IPFIXPacket::count() const { return count_; }
 
-bool IPFIXPacket::AddToBuffer(const flow::Key& k, const flow::Stats& f,
-                              uint8_t end_reason) {
-  CHECK_LE(current_ + kSingleRecordSize, limit_);
-  char* want = current_ + kSingleRecordSize;
+bool IPFIXPacket::AddToBuffer(const flow::Key4& k, const flow::Stats& f,
+                              uint8_t end_reason, uint32_t src_asn,
+                              uint32_t dst_asn) {
+  CHECK_EQ(type_, DataPacketType(true, narrow()));
+  CHECK(!narrow() || NarrowCounters(f));
+  const Encoding& e = format_->encoding(narrow());
+  return Add(k, Record{&f, end_reason, src_asn, dst_asn}, e.record_size4,
+             e.write4);
+}
+
+bool IPFIXPacket::AddToBuffer(const flow::Key6& k, const flow::Stats& f,
+                              uint8_t end_reason, uint32_t src_asn,
+                              uint32_t dst_asn) {
+  CHECK_EQ(type_, DataPacketType(false, narrow()));
+  CHECK(!narrow() || NarrowCounters(f));
+  const Encoding& e = format_->encoding(narrow());
+  return Add(k, Record{&f, end_reason, src_asn, dst_asn}, e.record_size6,
+             e.write6);
+}
+
+template <class K>
+bool IPFIXPacket::Add(const K& k, const Record& r, size_t record_size,
+                      void (*write)(char**, const K&, const Record&)) {
+  CHECK_LE(current_ + record_size, limit_);
+  char* want = current_ + record_size;
   count_++;
-  switch (type_) {
-    case ipfix::PT_V4:
-      CHECK_EQ(k.network, 4);
-      WriteBE32(&current_, k.get_src_ip4());
-      WriteBE32(&current_, k.get_dst_ip4());
-      break;
-    case ipfix::PT_V6:
-      CHECK_EQ(k.network, 6);
-      memcpy(current_, k.src_ip, 16);
-      current_ += 16;
-      memcpy(current_, k.dst_ip, 16);
-      current_ += 16;
-      break;
-    case ipfix::PT_TEMPLATE:
-      LOG(FATAL) << "Adding to template";
-    default:
-      LOG(FATAL) << "Bad packet type " << type_;
-  }
-  WriteBE16s(&current_, k.src_port, k.dst_port);
-  WriteChars(&current_, k.protocol, f.tcp_flags, k.icmp_type, k.icmp_code);
-  WriteBE32(&current_, f.src_asn);
-  WriteBE32(&current_, f.dst_asn);
-  WriteBE64(&current_, f.bytes);
-  WriteBE64(&current_, f.packets);
-  // Note that even though we have nanoseconds, we write out milliseconds.  This
-  // is because IPFIX says that micros/nanos should be in stupid NTP format
-  // (https://tools.ietf.org/html/rfc5905#section-6) and I'm too lazy to compute
-  // it.
-  WriteBE64(&current_, f.first_ns / kNumNanosPerMilli);
-  WriteBE64(&current_, f.last_ns / kNumNanosPerMilli);
-  WriteChars(&current_, k.tos, end_reason, k.vlan >> 8, k.vlan);
-  CHECK_LE(current_, want);
-  return current_ + kSingleRecordSize >= limit_;
+  write(&current_, k, r);
+  CHECK_EQ(current_, want);
+  return current_ + record_size > limit_;
 }
 
 void IPFIXPacket::WriteFlowSet(bool v4) {
-  count_++;
   CHECK_EQ(type_, ipfix::PT_TEMPLATE);
-  CHECK_LE(current_ + kFlowSetSize, limit_);
-  char* want = current_ + kFlowSetSize;
-  WriteBE16s(&current_, v4 ? ipfix::PT_V4 : ipfix::PT_V6,
-             kFieldCount);  // template ID, field count
-  if (v4) {
-    WriteBE16s(&current_, IPV4_SRC_ADDR, 4);
-    WriteBE16s(&current_, IPV4_DST_ADDR, 4);
-  } else {
-    WriteBE16s(&current_, IPV6_SRC_ADDR, 16);
-    WriteBE16s(&current_, IPV6_DST_ADDR, 16);
-  }
-  WriteBE16s(&current_, L4_SRC_PORT, 2);
-  WriteBE16s(&current_, L4_DST_PORT, 2);
-  WriteBE16s(&current_, PROTOCOL, 1);
-  WriteBE16s(&current_, TCP_FLAGS, 1);
-  WriteBE16s(&current_, ICMP_TYPE, 2);
-  WriteBE16s(&current_, BGP_SOURCE_AS_NUMBER, 4);
-  WriteBE16s(&current_, BGP_DESTINATION_AS_NUMBER, 4);
-  WriteBE16s(&current_, IN_BYTES, 8);
-  WriteBE16s(&current_, IN_PKTS, 8);
-  WriteBE16s(&current_, FLOW_START_MILLISECONDS, 8);
-  WriteBE16s(&current_, FLOW_END_MILLISECONDS, 8);
-  WriteBE16s(&current_, IP_CLASS_OF_SERVICE, 1);
-  WriteBE16s(&current_, FLOW_END_REASON, 1);
-  WriteBE16s(&current_, VLAN_ID, 2);
+  CHECK_LE(current_ + 2 * format_->template_size(), limit_);
+  char* want = current_ + 2 * format_->template_size();
+  for (bool narrow : {false, true}) {
+    count_++;
+    WriteBE16s(&current_, DataPacketType(v4, narrow),
+               format_->field_count);  // template ID, field count
+    format_->encoding(narrow).write_template(&current_, v4);
+  }
+  CHECK_EQ(current_, want);
+}
+
+// The sampling options template, with its scope field first.
+static const uint16_t kSamplingFields[][2] = {
+    {OBSERVATION_DOMAIN_ID, 4},
+    {SAMPLING_PACKET_INTERVAL, 4},
+    {SAMPLING_PACKET_SPACE, 4},
+};
+static const uint16_t kSamplingFieldCount =
+    sizeof(kSamplingFields) / sizeof(kSamplingFields[0]);
+static const size_t kSamplingRecordSize = 12;
+
+void IPFIXPacket::WriteSamplingTemplate() {
+  CHECK_EQ(type_, ipfix::PT_OPTIONS_TEMPLATE);
+  const size_t size = 6 + 4 * kSamplingFieldCount;
+  CHECK_LE(current_ + size, limit_);
+  char* want = current_ + size;
+  count_++;
+  WriteBE16s(&current_, PT_SAMPLING, kSamplingFieldCount);
+  WriteBE16(&current_, 1);  // scope field count
+  for (const auto& field : kSamplingFields) {
+    WriteBE16s(&current_, field[0], field[1]);
+  }
+  CHECK_EQ(current_, want);
+}
+
+void IPFIXPacket::AddSampling(uint32_t interval) {
+  CHECK_EQ(type_, ipfix::PT_SAMPLING);
+  CHECK_GE(interval, 1);
+  CHECK_LE(current_ + kSamplingRecordSize, limit_);
+  count_++;
+  WriteBE32(&current_, domain_);
+  WriteBE32(&current_, 1);
+  WriteBE32(&current_, interval - 1);
+}
+
+// The unadmitted packets options template, with its scope field first.
+static const uint16_t kUnadmittedFields[][2] = {
+    {OBSERVATION_DOMAIN_ID, 4},
+    {IGNORED_PACKET_TOTAL_COUNT, 8},
+    {IGNORED_OCTET_TOTAL_COUNT, 8},
+};
+static const uint16_t kUnadmittedFieldCount =
+    sizeof(kUnadmittedFields) / sizeof(kUnadmittedFields[0]);
+static const size_t kUnadmittedRecordSize = 20;
+
+void IPFIXPacket::WriteUnadmittedTemplate() {
+  CHECK_EQ(type_, ipfix::PT_OPTIONS_TEMPLATE);
+  const size_t size = 6 + 4 * kUnadmittedFieldCount;
+  CHECK_LE(current_ + size, limit_);
+  char* want = current_ + size;
+  count_++;
+  WriteBE16s(&current_, PT_UNADMITTED, kUnadmittedFieldCount);
+  WriteBE16(&current_, 1);  // scope field count
+  for (const auto& field : kUnadmittedFields) {
+    WriteBE16s(&current_, field[0], field[1]);
+  }
   CHECK_EQ(current_, want);
 }
 
+void IPFIXPacket::AddUnadmitted(uint64_t packets, uint64_t bytes) {
+  CHECK_EQ(type_, ipfix::PT_UNADMITTED);
+  CHECK_LE(current_ + kUnadmittedRecordSize, limit_);
+  count_++;
+  WriteBE32(&current_, domain_);
+  WriteBE64(&current_, packets);
+  WriteBE64(&current_, bytes);
+}
+
+Pacer::Pacer(double packets_per_sec, double bytes_per_sec)
+    : pps_(packets_per_sec),
+      bps_(bytes_per_sec),
+      next_ns_(GetCurrentTimeNanos()),
+      waited_ns_(0) {}
+
+Pacer Pacer::For(const Pacing& pacing, size_t packets, size_t bytes) {
+  double pps = pacing.packets_per_sec;
+  if (pacing.spread_secs > 0) {
+    double spread = packets / pacing.spread_secs;
+    if (pps <= 0 || spread < pps) {
+      pps = spread;
+    }
+  }
+  return Pacer(pps, pacing.bytes_per_sec);
+}
+
+void Pacer::Wait(size_t packets, size_t bytes) {
+  int64_t now = GetCurrentTimeNanos();
+  if (next_ns_ > now) {
+    SleepForNanoseconds(next_ns_ - now);
+    waited_ns_ += next_ns_ - now;
+    now = next_ns_;
+  }
+  double secs = 0;
+  if (pps_ > 0) {
+    secs = std::max(secs, packets / pps_);
+  }
+  if (bps_ > 0) {
+    secs = std::max(secs, bytes / bps_);
+  }
+  next_ns_ = now + int64_t(secs * kNumNanosPerSecond);
+}
+
+PacketRing::PacketRing(int sock_fd, uint32_t unix_secs,
+                       uint32_t observation_domain, const Format* format,
+                       size_t max_packet_size, Pacer* pacer)
+    : fd_(sock_fd), pacer_(pacer), syscalls_(0) {
+  // Packets point into their own buffers once Reset, so they must never move.
+  packets_.reserve(kRingSize);
+  for (size_t i = 0; i < kRingSize; i++) {
+    packets_.emplace_back(unix_secs, observation_domain, format,
+                          max_packet_size);
+    free_.push_back(&packets_[i]);
+  }
+  queued_.reserve(kRingSize);
+  iovecs_.resize(kRingSize);
+  msgs_.resize(kRingSize);
+}
+
+PacketRing::~PacketRing() { Flush(); }
+
+IPFIXPacket* PacketRing::Next() {
+  if (free_.empty()) {
+    Flush();
+  }
+  CHECK(!free_.empty()) << "All " << kRingSize << " packets being filled";
+  IPFIXPacket* pkt = free_.back();
+  free_.pop_back();
+  return pkt;
+}
+
+void PacketRing::Queue(IPFIXPacket* pkt) {
+  if (queued_.size() == kRingSize) {
+    Flush();
+  }
+  queued_.push_back(pkt);
+}
+
+void PacketRing::Flush() {
+  size_t n = queued_.size();
+  memset(msgs_.data(), 0, n * sizeof(msgs_[0]));
+  for (size_t i = 0; i < n; i++) {
+    auto data = queued_[i]->PacketData();
+    iovecs_[i].iov_base = const_cast<char*>(data.data());
+    iovecs_[i].iov_len = data.size();
+    msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+  // sendmmsg may send fewer messages than asked, so keep going until they've
+  // all gone out.  On error, we drop the rest rather than retrying forever.
+  for (size_t sent = 0; sent < n;) {
+    size_t batch = n - sent;
+    if (pacer_) {
+      batch = std::min(batch, kPacedBatch);
+      size_t bytes = 0;
+      for (size_t i = sent; i < sent + batch; i++) {
+        bytes += iovecs_[i].iov_len;
+      }
+      pacer_->Wait(batch, bytes);
+    }
+    syscalls_++;
+    int r = sendmmsg(fd_, &msgs_[sent], batch, 0);
+    if (r <= 0) {
+      PLOG(ERROR) << "Sending " << n - sent << " packets to socket failed";
+      break;
+    }
+    sent += r;
+  }
+  for (IPFIXPacket* pkt : queued_) {
+    if (Owns(pkt)) {
+      free_.push_back(pkt);
+    }
+  }
+  queued_.clear();
+}
+
 }  // namespace ipfix
 }  // namespace clerk
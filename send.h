@@ -17,6 +17,11 @@
 
 #include <stdint.h>  // uint32_t, etc.
 #include <stdlib.h>  // size_t
+#include <sys/socket.h>  // mmsghdr
+#include <sys/uio.h>     // iovec
+
+#include <string>
+#include <vector>
 
 #include "flow.h"
 #include "util.h"
@@ -25,28 +30,12 @@
 namespace clerk {
 namespace ipfix {
 
-const size_t kMaxPacketSize = 1400;
-const size_t kSingleRecordSize =
-    16 + 16 +  // IPv6 addresses for ipv6.  IPv4 is 4+4, so this overestimates
-               // in that case.
-    2 + 2 +    // Ports
-    1 +        // Protocol
-    1 +        // TCP flags
-    2 +        // ICMP code
-    4 +        // Src AS
-    4 +        // Dst AS
-    8 +        // Bytes
-    8 +        // Packets
-    8 +        // First millis since epoch, uint64
-    8 +        // Last millis since epoch, uint64
-    1 +        // IP TOS
-    1 +        // Flow end reason
-    2 +        // VLAN ID
-    0;
-const uint16_t kFieldCount = 16;
-const size_t kHeaderSize = 20;
-const size_t kFlowSetSize = 2 * 2 +           // Template ID, field count
-                            kFieldCount * 4;  // fields' type/length
+// Packets are at most kDefaultPacketSize bytes unless configured otherwise,
+// which fits a 1500-byte MTU with room to spare.  Larger packets suit links
+// with jumbo frames, up to the largest UDP payload, kMaxPacketSize.
+const size_t kDefaultPacketSize = 1400;
+const size_t kMaxPacketSize = 65507;
+const size_t kHeaderSize = 20;  // message header plus set header
 
 // Pulled from http://www.ietf.org/rfc/rfc3954.txt
 enum IpfixTypes {
@@ -66,45 +55,151 @@ enum IpfixTypes {
   ICMP_TYPE = 32,
   VLAN_ID = 58,
   FLOW_END_REASON = 136,
+  OBSERVATION_DOMAIN_ID = 149,
   FLOW_START_MILLISECONDS = 152,
   FLOW_END_MILLISECONDS = 153,
+  IGNORED_PACKET_TOTAL_COUNT = 164,
+  IGNORED_OCTET_TOTAL_COUNT = 165,
+  SAMPLING_PACKET_INTERVAL = 305,
+  SAMPLING_PACKET_SPACE = 306,
 };
 
 enum PacketType {
   PT_V4 = 256,
   PT_V6 = 257,
+  // Records with reduced-size (RFC 7011 section 6.2) counters, used for
+  // flows whose byte and packet counts fit in 32 bits.
+  PT_V4_NARROW = 258,
+  PT_V6_NARROW = 259,
+  // Options records (RFC 7011 section 3.4.2) reporting our sampling rate.
+  PT_SAMPLING = 260,
+  // Options records counting the packets we didn't admit to flow tables.
+  PT_UNADMITTED = 261,
   PT_TEMPLATE = 2,
+  PT_OPTIONS_TEMPLATE = 3,
+};
+
+// Returns the type of data packets, and so the template, for v4 or v6 records
+// with narrow or wide counters.
+inline PacketType DataPacketType(bool v4, bool narrow) {
+  return PacketType(PT_V4 + (v4 ? 0 : 1) + (narrow ? 2 : 0));
+}
+// Returns whether a flow's counters fit in narrow records.
+inline bool NarrowCounters(const flow::Stats& s) {
+  return s.bytes <= UINT32_MAX && s.packets <= UINT32_MAX;
+}
+
+// Record holds the parts of a data record which aren't in its flow key.
+struct Record {
+  const flow::Stats* stats;
+  uint8_t end_reason;
+  uint32_t src_asn;
+  uint32_t dst_asn;
+};
+
+// Encoding is one of a format's two templates, with its record sizes and
+// encoders.
+struct Encoding {
+  size_t record_size4;  // bytes per IPv4 record
+  size_t record_size6;  // bytes per IPv6 record
+  void (*write_template)(char** buf, bool v4);
+  void (*write4)(char** buf, const flow::Key4& k, const Record& r);
+  void (*write6)(char** buf, const flow::Key6& k, const Record& r);
+};
+
+// Format is a layout of IPFIX data records: which fields they hold, in which
+// order.  Each format is generated from a single compile-time list of fields
+// (see send.cc), which gives both its templates and their encoders.  Every
+// format has two templates, which differ only in the width of their byte and
+// packet counters:  8 bytes when wide, 4 when narrow.
+struct Format {
+  const char* name;
+  uint16_t field_count;
+  bool uses_asns;  // if false, callers needn't look ASNs up
+  Encoding wide;
+  Encoding narrow;
+
+  const Encoding& encoding(bool is_narrow) const {
+    return is_narrow ? narrow : wide;
+  }
+  // Bytes in a single template record for this format.
+  size_t template_size() const { return 4 + 4 * field_count; }
 };
 
+// kFullFormat, the default, exports everything we track.  kCompactFormat
+// drops ASNs, VLANs, and the separate ICMP type/code field, leaving ICMP type
+// and code in the destination port, as NetFlow v5 does.
+extern const Format kFullFormat;
+extern const Format kCompactFormat;
+// Returns the format with the given name, or nullptr if there's none.
+const Format* FormatNamed(const std::string& name);
+
 // IPFIXPacket is a helper to build an IPFIX (netflow v10) packet to send over
 // the network.  It's a little tricky, so read all the fine print... or just use
 // IPFIX::Send instead  ;)
 class IPFIXPacket {
  public:
-  // Creates a new packet with the given uptime and current time.
-  explicit IPFIXPacket(uint32_t unix_secs);
+  // Creates a new packet with the given current time, for the given
+  // observation domain, holding records of the given format in at most
+  // 'max_size' bytes.
+  explicit IPFIXPacket(uint32_t unix_secs,
+                       uint32_t observation_domain = 12345,
+                       const Format* format = &kFullFormat,
+                       size_t max_size = kDefaultPacketSize);
 
   // Reset this pcket to a packet type.  If that packet type is PT_TEMPLATE, the
   // packet is immediately sendable, and AddToBuffer will CHECK-fail.
   // Otherwise, AddToBuffer must be called before SendTo.
   void Reset(PacketType t, uint32_t seq);
+  // Rewrites the sequence number given to Reset, for packets whose sequence
+  // number isn't known until they're full.
+  void SetSequence(uint32_t seq);
   // Get the packet data to send.
   StringPiece PacketData();
   // Send packet data to socket.
   void SendTo(int sock_fd);
   // Number of entries added to the buffer.
   int count() const;
-  // AddToBuffer adds the given key/flow to the packet.  If the packet is full
-  // and must be immediately sent, returns true.
-  bool AddToBuffer(const flow::Key& k, const flow::Stats& f,
-                   uint8_t end_reason);
+  // Bytes in the packet so far.
+  size_t size() const { return current_ - start_; }
+  // AddToBuffer adds the given key/flow to the packet, which must be a v4 or
+  // v6 data packet respectively.  Narrow packets only take flows whose
+  // counters fit, per NarrowCounters.  If the packet is full and must be
+  // immediately sent, returns true; packets are full once another record
+  // won't fit.
+  bool AddToBuffer(const flow::Key4& k, const flow::Stats& f,
+                   uint8_t end_reason, uint32_t src_asn, uint32_t dst_asn);
+  bool AddToBuffer(const flow::Key6& k, const flow::Stats& f,
+                   uint8_t end_reason, uint32_t src_asn, uint32_t dst_asn);
 
-  // Writes the template for v4 or v6 to the packet.  Should be called only once
-  // on a single packet, packet type must be PT_TEMPLATE.
+  // Writes the wide and narrow templates for v4 or v6 to the packet.  Should
+  // be called only once on a single packet, packet type must be PT_TEMPLATE.
   void WriteFlowSet(bool v4);
+  // Writes the options template for PT_SAMPLING records, scoped to our
+  // observation domain.  Packet type must be PT_OPTIONS_TEMPLATE.
+  void WriteSamplingTemplate();
+  // Adds a record saying packets are sampled one in every 'interval':  as RFC
+  // 5477 puts it, a samplingPacketInterval of 1 packet taken, then a
+  // samplingPacketSpace of interval - 1 packets skipped.  Packet type must be
+  // PT_SAMPLING.
+  void AddSampling(uint32_t interval);
+  // Writes the options template for PT_UNADMITTED records, scoped to our
+  // observation domain.  Packet type must be PT_OPTIONS_TEMPLATE.
+  void WriteUnadmittedTemplate();
+  // Adds a record with the total packets and bytes we've counted without
+  // giving them to a flow (see IPFIXFactory::SetAdmissionBits), as an
+  // ignoredPacketTotalCount and ignoredOctetTotalCount.  Packet type must be
+  // PT_UNADMITTED.
+  void AddUnadmitted(uint64_t packets, uint64_t bytes);
 
  private:
-  char buffer_[kMaxPacketSize];
+  template <class K>
+  bool Add(const K& k, const Record& r, size_t record_size,
+           void (*write)(char**, const K&, const Record&));
+  bool narrow() const { return type_ == PT_V4_NARROW || type_ == PT_V6_NARROW; }
+
+  const Format* format_;
+  std::vector<char> buffer_;
   char* start_;
   char* record_buf_;
   char* current_;
@@ -112,6 +207,95 @@ class IPFIXPacket {
   uint16_t count_;
   PacketType type_;
   uint32_t unix_secs_;
+  uint32_t domain_;
+};
+
+// Pacing says how fast to export: at most packets_per_sec and bytes_per_sec
+// (zero for no limit), and, if spread_secs is nonzero, slowly enough that each
+// export's packets are spread over about spread_secs, so collectors get a
+// steady stream rather than a burst at line rate.
+struct Pacing {
+  double packets_per_sec = 0;
+  double bytes_per_sec = 0;
+  double spread_secs = 0;
+
+  // Returns whether pacing limits anything at all.
+  bool enabled() const {
+    return packets_per_sec > 0 || bytes_per_sec > 0 || spread_secs > 0;
+  }
+};
+
+// Pacer limits the rate at which batches of packets are sent, in packets and
+// bytes per second, either of which may be zero for no limit.  It's a token
+// bucket which holds at most a single batch:  each batch may go once the
+// tokens spent by the previous one have been refilled.
+class Pacer {
+ public:
+  Pacer(double packets_per_sec, double bytes_per_sec);
+  // Makes a pacer for sending 'packets' packets of 'bytes' bytes in total,
+  // as fast as 'pacing' allows.
+  static Pacer For(const Pacing& pacing, size_t packets, size_t bytes);
+
+  // Blocks until a batch of 'packets' packets of 'bytes' bytes may be sent.
+  void Wait(size_t packets, size_t bytes);
+
+  double packets_per_sec() const { return pps_; }
+  double bytes_per_sec() const { return bps_; }
+  // Time spent blocked in Wait so far.
+  int64_t waited_ns() const { return waited_ns_; }
+
+ private:
+  double pps_;
+  double bps_;
+  int64_t next_ns_;  // when the bucket is full again
+  int64_t waited_ns_;
+};
+
+// PacketRing is a fixed set of reusable IPFIXPackets, which are filled then
+// queued, and sent together in as few sendmmsg calls as possible once the ring
+// runs out of free packets.  Several packets may be filled at once (say, one
+// for v4 and one for v6), as long as fewer than kRingSize are outstanding.
+// Packets encoded elsewhere may be queued too, and are sent in batches of at
+// most kRingSize.  If the ring has a pacer, batches are at most kPacedBatch
+// packets instead, each sent when the pacer allows.
+class PacketRing {
+ public:
+  static const size_t kRingSize = 64;
+  static const size_t kPacedBatch = 8;
+
+  PacketRing(int sock_fd, uint32_t unix_secs, uint32_t observation_domain,
+             const Format* format, size_t max_packet_size,
+             Pacer* pacer = nullptr);
+  // Sends any packets still queued.
+  ~PacketRing();
+
+  // Returns a free packet to Reset and fill, first sending all queued packets
+  // if none are free.
+  IPFIXPacket* Next();
+  // Queues a packet to be sent, either one returned by Next or one which
+  // outlives the next Flush.  Packets are sent in the order they're queued.
+  void Queue(IPFIXPacket* pkt);
+  // Sends all queued packets, freeing them for reuse.
+  void Flush();
+
+  // Number of sendmmsg calls made so far.
+  size_t syscalls() const { return syscalls_; }
+
+ private:
+  bool Owns(const IPFIXPacket* pkt) const {
+    return pkt >= packets_.data() && pkt < packets_.data() + packets_.size();
+  }
+
+  int fd_;
+  Pacer* pacer_;
+  std::vector<IPFIXPacket> packets_;
+  std::vector<IPFIXPacket*> free_;
+  std::vector<IPFIXPacket*> queued_;
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct mmsghdr> msgs_;
+  size_t syscalls_;
+
+  DISALLOW_COPY_AND_ASSIGN(PacketRing);
 };
 
 }  // namespace ipfix
@@ -17,6 +17,9 @@
 #include "util.h"
 #include "stringpiece.h"
 
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
@@ -40,14 +43,21 @@ void PrintPacket(StringPiece p) {
 
 TEST_F(SendTest, TemplateV4Packet) {
   const char want[] = {
-      0x00, 0x0A, 0x00, 0x58, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00,
-      0x03, 0x00, 0x00, 0x30, 0x39, 0x00, 0x02, 0x00, 0x48, 0x01, 0x00,
+      0x00, 0x0A, 0x00, 0x9C, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00,
+      0x03, 0x00, 0x00, 0x30, 0x39, 0x00, 0x02, 0x00, 0x8C, 0x01, 0x00,
       0x00, 0x10, 0x00, 0x08, 0x00, 0x04, 0x00, 0x0C, 0x00, 0x04, 0x00,
       0x07, 0x00, 0x02, 0x00, 0x0B, 0x00, 0x02, 0x00, 0x04, 0x00, 0x01,
       0x00, 0x06, 0x00, 0x01, 0x00, 0x20, 0x00, 0x02, 0x00, 0x10, 0x00,
       0x04, 0x00, 0x11, 0x00, 0x04, 0x00, 0x01, 0x00, 0x08, 0x00, 0x02,
       0x00, 0x08, 0x00, 0x98, 0x00, 0x08, 0x00, 0x99, 0x00, 0x08, 0x00,
       0x05, 0x00, 0x01, 0x00, 0x88, 0x00, 0x01, 0x00, 0x3A, 0x00, 0x02,
+      0x01, 0x02, 0x00, 0x10, 0x00, 0x08, 0x00, 0x04, 0x00, 0x0C, 0x00,
+      0x04, 0x00, 0x07, 0x00, 0x02, 0x00, 0x0B, 0x00, 0x02, 0x00, 0x04,
+      0x00, 0x01, 0x00, 0x06, 0x00, 0x01, 0x00, 0x20, 0x00, 0x02, 0x00,
+      0x10, 0x00, 0x04, 0x00, 0x11, 0x00, 0x04, 0x00, 0x01, 0x00, 0x04,
+      0x00, 0x02, 0x00, 0x04, 0x00, 0x98, 0x00, 0x08, 0x00, 0x99, 0x00,
+      0x08, 0x00, 0x05, 0x00, 0x01, 0x00, 0x88, 0x00, 0x01, 0x00, 0x3A,
+      0x00, 0x02,
   };
   IPFIXPacket p(222);
   p.Reset(PT_TEMPLATE, 3);
@@ -59,14 +69,21 @@ TEST_F(SendTest, TemplateV4Packet) {
 
 TEST_F(SendTest, TemplateV6Packet) {
   const char want[] = {
-      0x00, 0x0A, 0x00, 0x58, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00,
-      0x03, 0x00, 0x00, 0x30, 0x39, 0x00, 0x02, 0x00, 0x48, 0x01, 0x01,
+      0x00, 0x0A, 0x00, 0x9C, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00,
+      0x03, 0x00, 0x00, 0x30, 0x39, 0x00, 0x02, 0x00, 0x8C, 0x01, 0x01,
       0x00, 0x10, 0x00, 0x1B, 0x00, 0x10, 0x00, 0x1C, 0x00, 0x10, 0x00,
       0x07, 0x00, 0x02, 0x00, 0x0B, 0x00, 0x02, 0x00, 0x04, 0x00, 0x01,
       0x00, 0x06, 0x00, 0x01, 0x00, 0x20, 0x00, 0x02, 0x00, 0x10, 0x00,
       0x04, 0x00, 0x11, 0x00, 0x04, 0x00, 0x01, 0x00, 0x08, 0x00, 0x02,
       0x00, 0x08, 0x00, 0x98, 0x00, 0x08, 0x00, 0x99, 0x00, 0x08, 0x00,
       0x05, 0x00, 0x01, 0x00, 0x88, 0x00, 0x01, 0x00, 0x3A, 0x00, 0x02,
+      0x01, 0x03, 0x00, 0x10, 0x00, 0x1B, 0x00, 0x10, 0x00, 0x1C, 0x00,
+      0x10, 0x00, 0x07, 0x00, 0x02, 0x00, 0x0B, 0x00, 0x02, 0x00, 0x04,
+      0x00, 0x01, 0x00, 0x06, 0x00, 0x01, 0x00, 0x20, 0x00, 0x02, 0x00,
+      0x10, 0x00, 0x04, 0x00, 0x11, 0x00, 0x04, 0x00, 0x01, 0x00, 0x04,
+      0x00, 0x02, 0x00, 0x04, 0x00, 0x98, 0x00, 0x08, 0x00, 0x99, 0x00,
+      0x08, 0x00, 0x05, 0x00, 0x01, 0x00, 0x88, 0x00, 0x01, 0x00, 0x3A,
+      0x00, 0x02,
   };
   IPFIXPacket p(222);
   p.Reset(PT_TEMPLATE, 3);
@@ -76,6 +93,79 @@ TEST_F(SendTest, TemplateV6Packet) {
   ASSERT_EQ(data, StringPiece(want, sizeof(want)));
 }
 
+TEST_F(SendTest, SamplingPackets) {
+  const char want_template[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x26, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x03,
+      0x00, 0x00, 0x30, 0x39,
+      // options template set
+      0x00, 0x03, 0x00, 0x16,
+      // template 260, 3 fields, 1 of them scope
+      0x01, 0x04, 0x00, 0x03, 0x00, 0x01,
+      // observation domain, sampling packet interval and space
+      0x00, 0x95, 0x00, 0x04, 0x01, 0x31, 0x00, 0x04, 0x01, 0x32, 0x00, 0x04,
+  };
+  IPFIXPacket p(222);
+  p.Reset(PT_OPTIONS_TEMPLATE, 3);
+  p.WriteSamplingTemplate();
+  auto data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want_template, sizeof(want_template)));
+
+  const char want_record[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x20, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x04,
+      0x00, 0x00, 0x30, 0x39,
+      // record set
+      0x01, 0x04, 0x00, 0x10,
+      // 1 in 16:  take 1 packet, skip 15
+      0x00, 0x00, 0x30, 0x39, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x0F,
+  };
+  p.Reset(PT_SAMPLING, 4);
+  p.AddSampling(16);
+  EXPECT_EQ(p.count(), 1);
+  data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want_record, sizeof(want_record)));
+}
+
+TEST_F(SendTest, UnadmittedPackets) {
+  const char want_template[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x26, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x03,
+      0x00, 0x00, 0x30, 0x39,
+      // options template set
+      0x00, 0x03, 0x00, 0x16,
+      // template 261, 3 fields, 1 of them scope
+      0x01, 0x05, 0x00, 0x03, 0x00, 0x01,
+      // observation domain, ignored packet and octet totals
+      0x00, 0x95, 0x00, 0x04, 0x00, 0xA4, 0x00, 0x08, 0x00, 0xA5, 0x00, 0x08,
+  };
+  IPFIXPacket p(222);
+  p.Reset(PT_OPTIONS_TEMPLATE, 3);
+  p.WriteUnadmittedTemplate();
+  auto data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want_template, sizeof(want_template)));
+
+  const char want_record[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x28, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x04,
+      0x00, 0x00, 0x30, 0x39,
+      // record set
+      0x01, 0x05, 0x00, 0x18,
+      // observation domain, packets, bytes
+      0x00, 0x00, 0x30, 0x39, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02,
+      0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04,
+  };
+  p.Reset(PT_UNADMITTED, 4);
+  p.AddUnadmitted(0x100000002ULL, 0x300000004ULL);
+  EXPECT_EQ(p.count(), 1);
+  data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want_record, sizeof(want_record)));
+}
+
 TEST_F(SendTest, DataV4Packet) {
   const char want[] = {
       // header
@@ -85,37 +175,221 @@ TEST_F(SendTest, DataV4Packet) {
       0x01, 0x00, 0x00, 0x7C,
       // record 1
       0x11, 0x22, 0x33, 0x44, 0xAA, 0xBB, 0xCC, 0xDD, 0x99, 0x99, 0xAA, 0xAA,
-      0x00, 0x00, 0x55, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
       0x00, 0x00, 0x00, 0x77, 0x77, 0x77, 0x77, 0x77, 0x00, 0x00, 0x00, 0x88,
       0x88, 0x88, 0x88, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
       0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xEE, 0xAB, 0xFF, 0xFF,
       // record 2
-      0x11, 0x22, 0x33, 0x44, 0xAA, 0xBB, 0xCC, 0xDD, 0x99, 0x99, 0xAA, 0xAA,
-      0x00, 0x00, 0x55, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x11, 0x22, 0x33, 0x44, 0xAA, 0xBB, 0xCC, 0xDD, 0x00, 0x00, 0x00, 0x00,
+      0x01, 0x00, 0x55, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
       0x00, 0x00, 0x00, 0x77, 0x77, 0x77, 0x77, 0x77, 0x00, 0x00, 0x00, 0x88,
       0x88, 0x88, 0x88, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
       0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xEE, 0xCD, 0xFF, 0xFF,
   };
-  flow::Key k;
+  flow::Key4 k;
   flow::Stats s;
-  k.set_src_ip4(0x11223344);
-  k.set_dst_ip4(0xAABBCCDD);
+  k.src_ip = 0x11223344;
+  k.dst_ip = 0xAABBCCDD;
   k.src_port = 0x9999;
   k.dst_port = 0xAAAA;
+  k.protocol = IPPROTO_TCP;
   k.tos = 0xEE;
   k.vlan = 0xFFFF;
-  k.icmp_type = 0x55;
-  k.icmp_code = 0x66;
   s.bytes = 0x7777777777LL;
   s.packets = 0x8888888888LL;
   IPFIXPacket p(222);
   p.Reset(PT_V4, 3);
-  p.AddToBuffer(k, s, 0xAB);
-  p.AddToBuffer(k, s, 0xCD);
+  p.AddToBuffer(k, s, 0xAB, 0, 0);
+  // ICMP records carry type and code instead of ports.
+  k.src_port = 0;
+  k.protocol = IPPROTO_ICMP;
+  k.set_icmp(0x55, 0x66);
+  p.AddToBuffer(k, s, 0xCD, 0, 0);
   auto data = p.PacketData();
   PrintPacket(data);
   ASSERT_EQ(data, StringPiece(want, sizeof(want)));
 }
 
+TEST_F(SendTest, NarrowDataV4Packet) {
+  const char want[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x48, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x03,
+      0x00, 0x00, 0x30, 0x39,
+      // record set
+      0x01, 0x02, 0x00, 0x38,
+      // record, with 4-byte byte and packet counts
+      0x11, 0x22, 0x33, 0x44, 0xAA, 0xBB, 0xCC, 0xDD, 0x99, 0x99, 0xAA, 0xAA,
+      0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x77, 0x77, 0x77, 0x77, 0x00, 0x00, 0x88, 0x88, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0xEE, 0xAB, 0xFF, 0xFF,
+  };
+  flow::Key4 k;
+  flow::Stats s;
+  k.src_ip = 0x11223344;
+  k.dst_ip = 0xAABBCCDD;
+  k.src_port = 0x9999;
+  k.dst_port = 0xAAAA;
+  k.protocol = IPPROTO_TCP;
+  k.tos = 0xEE;
+  k.vlan = 0xFFFF;
+  s.bytes = 0x77777777;
+  s.packets = 0x8888;
+  ASSERT_TRUE(NarrowCounters(s));
+  IPFIXPacket p(222);
+  p.Reset(DataPacketType(true, true), 3);
+  p.AddToBuffer(k, s, 0xAB, 0, 0);
+  auto data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want, sizeof(want)));
+}
+
+TEST_F(SendTest, CompactDataV4Packet) {
+  const char want[] = {
+      // header
+      0x00, 0x0A, 0x00, 0x44, 0x00, 0x00, 0x00, 0xDE, 0x00, 0x00, 0x00, 0x03,
+      0x00, 0x00, 0x30, 0x39,
+      // record set
+      0x01, 0x00, 0x00, 0x34,
+      // record, with ICMP type and code in the destination port
+      0x11, 0x22, 0x33, 0x44, 0xAA, 0xBB, 0xCC, 0xDD, 0x00, 0x00, 0x55, 0x66,
+      0x01, 0x00, 0x00, 0x00, 0x00, 0x77, 0x77, 0x77, 0x77, 0x77, 0x00, 0x00,
+      0x00, 0x88, 0x88, 0x88, 0x88, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xEE, 0xCD,
+  };
+  flow::Key4 k;
+  flow::Stats s;
+  k.src_ip = 0x11223344;
+  k.dst_ip = 0xAABBCCDD;
+  k.protocol = IPPROTO_ICMP;
+  k.set_icmp(0x55, 0x66);
+  k.tos = 0xEE;
+  k.vlan = 0xFFFF;
+  s.bytes = 0x7777777777LL;
+  s.packets = 0x8888888888LL;
+  IPFIXPacket p(222, 12345, &kCompactFormat);
+  p.Reset(PT_V4, 3);
+  p.AddToBuffer(k, s, 0xCD, 1, 2);
+  auto data = p.PacketData();
+  PrintPacket(data);
+  ASSERT_EQ(data, StringPiece(want, sizeof(want)));
+}
+
+TEST_F(SendTest, PacksExactly) {
+  flow::Key4 k4;
+  flow::Key6 k6;
+  flow::Stats s;
+  for (const Format* f : {&kFullFormat, &kCompactFormat}) {
+    for (size_t size : {kDefaultPacketSize, size_t(9000)}) {
+      IPFIXPacket p(222, 12345, f, size);
+      p.Reset(PT_V4, 0);
+      size_t n = 1;
+      while (!p.AddToBuffer(k4, s, 0, 0, 0)) n++;
+      EXPECT_EQ((size - kHeaderSize) / f->wide.record_size4, n) << f->name;
+      EXPECT_EQ(kHeaderSize + n * f->wide.record_size4, p.PacketData().size());
+
+      p.Reset(PT_V6, 0);
+      n = 1;
+      while (!p.AddToBuffer(k6, s, 0, 0, 0)) n++;
+      EXPECT_EQ((size - kHeaderSize) / f->wide.record_size6, n) << f->name;
+
+      // Narrow records are 8 bytes shorter, so more of them fit.
+      EXPECT_EQ(f->wide.record_size4 - 8, f->narrow.record_size4);
+      p.Reset(PT_V4_NARROW, 0);
+      n = 1;
+      while (!p.AddToBuffer(k4, s, 0, 0, 0)) n++;
+      EXPECT_EQ((size - kHeaderSize) / f->narrow.record_size4, n) << f->name;
+    }
+  }
+}
+
+TEST_F(SendTest, FormatNamed) {
+  EXPECT_EQ(&kFullFormat, FormatNamed("full"));
+  EXPECT_EQ(&kCompactFormat, FormatNamed("compact"));
+  EXPECT_EQ(nullptr, FormatNamed("bogus"));
+}
+
+TEST_F(SendTest, ObservationDomain) {
+  IPFIXPacket p(222, 0x01020304);
+  p.Reset(PT_TEMPLATE, 3);
+  p.WriteFlowSet(true);
+  auto data = p.PacketData();
+  ASSERT_GE(data.size(), 16);
+  const char want[] = {0x01, 0x02, 0x03, 0x04};
+  EXPECT_EQ(StringPiece(data.data() + 12, 4), StringPiece(want, 4));
+}
+
+TEST_F(SendTest, PacketRing) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+  const size_t n = PacketRing::kRingSize + 3;
+  {
+    PacketRing ring(fds[0], 222, 12345, &kFullFormat, kDefaultPacketSize);
+    // Fill one more packet than the ring holds, forcing a flush partway.
+    for (size_t i = 0; i < n; i++) {
+      IPFIXPacket* p = ring.Next();
+      p->Reset(PT_TEMPLATE, 0);
+      p->WriteFlowSet(i % 2 == 0);
+      p->SetSequence(i);
+      ring.Queue(p);
+    }
+    ring.Flush();
+    EXPECT_EQ(ring.syscalls(), 2);
+  }
+  // Packets arrive whole, in order.
+  for (size_t i = 0; i < n; i++) {
+    char buf[kMaxPacketSize];
+    ASSERT_EQ(156, recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT)) << i;
+    EXPECT_EQ(i, (uint32_t(uint8_t(buf[10])) << 8) | uint8_t(buf[11]));
+  }
+  char buf[kMaxPacketSize];
+  EXPECT_LT(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(SendTest, PacedPacketRing) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+  const size_t n = 2 * PacketRing::kPacedBatch + 1;
+  Pacer pacer(1000, 0);
+  const int64_t start = GetCurrentTimeNanos();
+  {
+    PacketRing ring(fds[0], 222, 12345, &kFullFormat, kDefaultPacketSize,
+                    &pacer);
+    for (size_t i = 0; i < n; i++) {
+      IPFIXPacket* p = ring.Next();
+      p->Reset(PT_TEMPLATE, 0);
+      p->WriteFlowSet(true);
+      ring.Queue(p);
+    }
+    ring.Flush();
+    // Paced packets go out in small batches, each waiting for the last.
+    EXPECT_EQ(ring.syscalls(), 3);
+  }
+  const int64_t min_ns = 2 * PacketRing::kPacedBatch * kNumNanosPerMilli;
+  EXPECT_GE(GetCurrentTimeNanos() - start, min_ns);
+  EXPECT_GT(pacer.waited_ns(), 0);
+  for (size_t i = 0; i < n; i++) {
+    char buf[kMaxPacketSize];
+    ASSERT_GT(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), 0) << i;
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(SendTest, PacerFor) {
+  Pacing pacing;
+  pacing.spread_secs = 2;
+  // Spreading 100 packets over 2 seconds sends 50 a second...
+  EXPECT_EQ(50, Pacer::For(pacing, 100, 1000).packets_per_sec());
+  // ... unless that's faster than we're allowed.
+  pacing.packets_per_sec = 10;
+  pacing.bytes_per_sec = 100;
+  Pacer pacer = Pacer::For(pacing, 100, 1000);
+  EXPECT_EQ(10, pacer.packets_per_sec());
+  EXPECT_EQ(100, pacer.bytes_per_sec());
+}
+
 }  // namespace ipfix
 }  // namespace clerk
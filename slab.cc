@@ -0,0 +1,70 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "slab.h"
+
+#include <string.h>
+
+#include <glog/logging.h>
+
+namespace clerk {
+
+SlabAllocator::~SlabAllocator() {
+  for (auto& iter : free_) {
+    for (const FreeBlock& f : iter.second) {
+      free(f.block);
+    }
+  }
+}
+
+void* SlabAllocator::Allocate(size_t bytes, size_t zeroed) {
+  CHECK_LE(zeroed, bytes);
+  {
+    std::unique_lock<std::mutex> ml(mu_);
+    auto finder = free_.find(bytes);
+    if (finder != free_.end() && !finder->second.empty()) {
+      FreeBlock f = finder->second.back();
+      finder->second.pop_back();
+      ml.unlock();
+      if (f.zeroed < zeroed) {
+        memset(reinterpret_cast<char*>(f.block) + f.zeroed, 0,
+               zeroed - f.zeroed);
+      }
+      return f.block;
+    }
+  }
+  system_allocations_++;
+  // aligned_alloc requires a size which is a multiple of the alignment.
+  void* block = aligned_alloc(
+      kAlignment, (bytes + kAlignment - 1) & ~(kAlignment - 1));
+  CHECK(block != nullptr) << "Failed to allocate " << bytes << " bytes";
+  VLOG(1) << "Allocated new " << bytes << "-byte block";
+  memset(block, 0, zeroed);
+  return block;
+}
+
+void SlabAllocator::Free(void* block, size_t bytes, size_t zeroed) {
+  if (block == nullptr) return;
+  {
+    std::unique_lock<std::mutex> ml(mu_);
+    auto& blocks = free_[bytes];
+    if (blocks.size() < kMaxFreePerSize) {
+      blocks.push_back(FreeBlock{block, zeroed});
+      return;
+    }
+  }
+  free(block);
+}
+
+}  // namespace clerk
@@ -0,0 +1,128 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_SLAB_H_
+#define CLERK_SLAB_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "util.h"
+
+namespace clerk {
+
+// SlabAllocator hands out large blocks of memory, keeping freed blocks on
+// per-size free lists so they can be handed out again.  Each packet thread's
+// flow tables allocate from that thread's own SlabAllocator.  Since flow tables
+// only ever ask for a few distinct (power-of-two capacity) sizes, and table
+// sizes are stable from interval to interval, the blocks freed when one
+// interval's tables are exported are exactly the ones the next interval's
+// tables need:  in steady state, flow storage never touches malloc.
+//
+// Allocate and Free are thread-safe.  Tables are filled on packet threads, but
+// freed on the main thread once their flows have been exported.  Neither is
+// called per packet, only when a table or other container (see
+// SlabStlAllocator) is created, copied, or resized.
+class SlabAllocator {
+ public:
+  // Blocks are aligned to (at least) kAlignment bytes.
+  static const size_t kAlignment = 64;
+  // Number of free blocks of each size we hold on to for reuse.  Any more are
+  // returned to the system.
+  static const size_t kMaxFreePerSize = 4;
+
+  SlabAllocator() : system_allocations_(0) {}
+  ~SlabAllocator();
+
+  // Returns a block of 'bytes' bytes, the first 'zeroed' of which are zero.
+  void* Allocate(size_t bytes, size_t zeroed = 0);
+  // Returns a block previously returned by Allocate(bytes).  Callers that
+  // know the block's first 'zeroed' bytes are already zero should say so:  the
+  // next Allocate of this size then needn't zero them itself.  Flow tables use
+  // this to zero their control bytes as they're freed on the main thread,
+  // rather than as they're allocated on a packet thread.
+  void Free(void* block, size_t bytes, size_t zeroed = 0);
+
+  // Number of blocks this allocator has had to get from the system, as opposed
+  // to reusing a previously freed block.
+  uint64_t system_allocations() const { return system_allocations_; }
+
+ private:
+  std::mutex mu_;
+  struct FreeBlock {
+    void* block;
+    size_t zeroed;  // number of leading bytes known to be zero
+  };
+  std::map<size_t, std::vector<FreeBlock>> free_;  // by size in bytes
+  std::atomic<uint64_t> system_allocations_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
+};
+
+// SlabStlAllocator lets standard containers filled on packet threads, like
+// the lists of flows waiting to be exported, allocate from a SlabAllocator,
+// so they reuse the memory the previous interval's containers freed.  With a
+// null SlabAllocator, it allocates with operator new.  A container's memory
+// goes with it when it's swapped or moved.
+template <class T>
+class SlabStlAllocator {
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_swap;
+  typedef std::true_type propagate_on_container_move_assignment;
+
+  explicit SlabStlAllocator(SlabAllocator* slab = nullptr) : slab_(slab) {}
+  template <class U>
+  SlabStlAllocator(const SlabStlAllocator<U>& other)
+      : slab_(other.slab()) {}
+
+  T* allocate(size_t n) {
+    if (slab_ == nullptr) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(slab_->Allocate(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    if (slab_ == nullptr) {
+      ::operator delete(p);
+    } else {
+      slab_->Free(p, n * sizeof(T));
+    }
+  }
+
+  SlabAllocator* slab() const { return slab_; }
+
+ private:
+  SlabAllocator* slab_;
+};
+
+template <class T, class U>
+bool operator==(const SlabStlAllocator<T>& a, const SlabStlAllocator<U>& b) {
+  return a.slab() == b.slab();
+}
+template <class T, class U>
+bool operator!=(const SlabStlAllocator<T>& a, const SlabStlAllocator<U>& b) {
+  return a.slab() != b.slab();
+}
+
+}  // namespace clerk
+
+#endif  // CLERK_SLAB_H_
@@ -0,0 +1,121 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "flow.h"
+#include "slab.h"
+
+namespace clerk {
+
+class SlabTest : public ::testing::Test {};
+
+TEST_F(SlabTest, TestReuse) {
+  SlabAllocator alloc;
+  void* a = alloc.Allocate(1000);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % SlabAllocator::kAlignment, 0);
+  EXPECT_EQ(alloc.system_allocations(), 1);
+  alloc.Free(a, 1000);
+  EXPECT_EQ(alloc.Allocate(1000), a);
+  EXPECT_EQ(alloc.system_allocations(), 1);
+  void* b = alloc.Allocate(2000);
+  EXPECT_NE(b, a);
+  EXPECT_EQ(alloc.system_allocations(), 2);
+  alloc.Free(a, 1000);
+  alloc.Free(b, 2000);
+}
+
+TEST_F(SlabTest, TestSteadyStateFlowTables) {
+  std::vector<flow::Key4> keys(10000);
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys[i].src_ip = i;
+  }
+  SlabAllocator alloc;
+  std::unique_ptr<flow::Table4> current(new flow::Table4(&alloc));
+  uint64_t warm = 0;
+  for (int interval = 0; interval < 5; interval++) {
+    // Packet path:  after the first interval, our table is already big enough
+    // for all of its flows, so adding packets must not allocate.
+    uint64_t before = alloc.system_allocations();
+    for (const auto& key : keys) {
+      flow::AddToTable(current.get(), key, flow::Stats(1, 1, interval + 1));
+    }
+    if (interval > 0) {
+      EXPECT_EQ(alloc.system_allocations(), before) << interval;
+    }
+    // Gather:  as IPFIX's constructor does, start a new, empty table sized
+    // for the old one, then free the old one once it's been exported.  Once
+    // warmed up, this reuses the blocks freed by the previous interval.
+    if (interval == 2) {
+      warm = alloc.system_allocations();
+    }
+    std::unique_ptr<flow::Table4> next(new flow::Table4(&alloc));
+    next->reserve(current->size());
+    EXPECT_EQ(next->size(), 0);
+    current.swap(next);
+  }
+  EXPECT_EQ(alloc.system_allocations(), warm);
+  EXPECT_GE(current->bucket_count(), keys.size());
+}
+
+TEST_F(SlabTest, TestStlAllocator) {
+  SlabAllocator alloc;
+  typedef std::vector<int, SlabStlAllocator<int>> Vector;
+  for (int interval = 0; interval < 3; interval++) {
+    Vector v{SlabStlAllocator<int>(&alloc)};
+    for (int i = 0; i < 1000; i++) v.push_back(i);
+    // Swapping takes v's memory, and its allocator, along with it.
+    Vector exported;
+    exported.swap(v);
+    EXPECT_EQ(exported.get_allocator(), SlabStlAllocator<int>(&alloc));
+  }
+  // Every size the vector grew through was allocated once, then reused.
+  const uint64_t warm = alloc.system_allocations();
+  Vector v{SlabStlAllocator<int>(&alloc)};
+  for (int i = 0; i < 1000; i++) v.push_back(i);
+  EXPECT_EQ(alloc.system_allocations(), warm);
+}
+
+TEST_F(SlabTest, TestZeroed) {
+  SlabAllocator alloc;
+  char* a = reinterpret_cast<char*>(alloc.Allocate(1000, 100));
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(a[i], 0);
+  }
+  // Freed dirty, so it's zeroed again when reused.
+  memset(a, 1, 1000);
+  alloc.Free(a, 1000);
+  EXPECT_EQ(alloc.Allocate(1000, 100), a);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(a[i], 0) << i;
+  }
+  EXPECT_EQ(a[100], 1);
+  // Freed with 50 bytes zeroed, so only the next 50 need zeroing.  We leave
+  // some of the first 50 dirty, to check they're trusted and left alone.
+  memset(a, 1, 1000);
+  memset(a + 1, 0, 49);
+  alloc.Free(a, 1000, 50);
+  EXPECT_EQ(alloc.Allocate(1000, 100), a);
+  EXPECT_EQ(a[0], 1);
+  for (int i = 1; i < 100; i++) {
+    EXPECT_EQ(a[i], 0) << i;
+  }
+  alloc.Free(a, 1000);
+}
+
+}  // namespace clerk
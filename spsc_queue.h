@@ -0,0 +1,82 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_SPSC_QUEUE_H_
+#define CLERK_SPSC_QUEUE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "util.h"
+
+namespace clerk {
+
+// SPSCQueue is a bounded, lock-free queue between exactly one producer thread
+// and one consumer thread.  Packet threads use them to hand flows they've
+// finished with to the exporter as they go, without ever blocking:  if a queue
+// is full, Push fails and the producer keeps the item itself.
+//
+// Each side only writes its own index, and reads the other's with acquire
+// semantics, so an item is fully written before the consumer can see it.  The
+// indices live on separate cache lines, so the two threads don't contend for
+// them.
+template <class T>
+class SPSCQueue {
+ public:
+  // Holds up to 'capacity' items, which must be a power of two.
+  explicit SPSCQueue(size_t capacity)
+      : items_(capacity), mask_(capacity - 1), head_(0), tail_(0) {
+    CHECK(capacity > 0 && (capacity & mask_) == 0)
+        << "capacity " << capacity << " isn't a power of two";
+  }
+
+  // Called only by the producer.  Returns false if the queue is full.
+  bool Push(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == items_.size()) {
+      return false;
+    }
+    items_[tail & mask_] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  // Called only by the consumer.  Returns false if the queue is empty.
+  bool Pop(T* item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = items_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return items_.size(); }
+
+ private:
+  std::vector<T> items_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_;  // next item to pop
+  alignas(64) std::atomic<size_t> tail_;  // next slot to push to
+
+  DISALLOW_COPY_AND_ASSIGN(SPSCQueue);
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_SPSC_QUEUE_H_
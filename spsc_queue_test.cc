@@ -0,0 +1,74 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "spsc_queue.h"
+
+namespace clerk {
+
+class SPSCQueueTest : public ::testing::Test {};
+
+TEST_F(SPSCQueueTest, TestFull) {
+  SPSCQueue<int> q(4);
+  int got;
+  EXPECT_FALSE(q.Pop(&got));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(q.Push(i));
+  }
+  EXPECT_FALSE(q.Push(4));
+  // Freeing a slot makes room for exactly one more, after the rest.
+  ASSERT_TRUE(q.Pop(&got));
+  EXPECT_EQ(0, got);
+  EXPECT_TRUE(q.Push(4));
+  for (int i = 1; i <= 4; i++) {
+    ASSERT_TRUE(q.Pop(&got));
+    EXPECT_EQ(i, got);
+  }
+  EXPECT_FALSE(q.Pop(&got));
+}
+
+TEST_F(SPSCQueueTest, TestThreads) {
+  const int kItems = 100000;
+  SPSCQueue<int> q(64);
+  // Both sides yield when they can't make progress, so the test doesn't crawl
+  // when they share a CPU.
+  std::thread producer([&q]() {
+    for (int i = 0; i < kItems;) {
+      if (q.Push(i)) {
+        i++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  // Items arrive in order, each exactly once.  We take every item before
+  // checking, so the producer has always finished, and been joined, first.
+  int popped = 0, out_of_order = 0, got;
+  while (popped < kItems) {
+    if (q.Pop(&got)) {
+      out_of_order += got != popped;
+      popped++;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_EQ(0, out_of_order);
+  EXPECT_FALSE(q.Pop(&got));
+}
+
+}  // namespace clerk
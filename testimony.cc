@@ -20,8 +20,20 @@
 
 namespace clerk {
 
-Packet::Packet(const struct tpacket3_hdr* hdr) : hdr_(hdr) {
-  headers_.Parse(data());
+void Packet::Reset(const struct tpacket3_hdr* hdr, bool parse,
+                   uint32_t sampling_interval) {
+  hdr_ = hdr;
+  sampling_interval_ = sampling_interval;
+  parsed_ = parse;
+  if (parse) {
+    headers_.Parse(data());
+  }
+}
+
+void State::ProcessBatch(const Packet* packets, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    Process(packets[i]);
+  }
 }
 
 StringPiece Packet::data() const {
@@ -33,7 +45,7 @@ int64_t Packet::ts_nanos() const { return testimony_packet_nanos(hdr_); }
 
 TestimonyProcessor::TestimonyProcessor(const string& socket,
                                        const StateFactory* states)
-    : socket_(socket), states_(states) {}
+    : socket_(socket), states_(states), max_lag_ns_(0), max_interval_(1) {}
 
 void TestimonyProcessor::StartThreads() {
   CHECK_EQ(0, threads_.size());
@@ -47,7 +59,8 @@ void TestimonyProcessor::StartThreads() {
     testimony_conn(thread_t)->fanout_index = i;
     CHECK_EQ(0, testimony_init(thread_t)) << testimony_error(thread_t);
     threads_.emplace_back(std::unique_ptr<TestimonyThread>(
-        new TestimonyThread(thread_t, states_->New(nullptr), &last_)));
+        new TestimonyThread(thread_t, states_->New(nullptr), &last_,
+                            max_lag_ns_, max_interval_)));
   }
   testimony_close(t);
 }
@@ -77,15 +90,33 @@ TestimonyProcessor::~TestimonyProcessor() { CHECK(last_.HasBeenNotified()); }
 
 std::unique_ptr<State> TestimonyThread::SwapState(const StateFactory* states) {
   std::unique_lock<std::mutex> ml(mu_);
-  auto next = states->New(state_.get());
+  if (finished_) {
+    // No packet thread to hand off to, so we can swap directly.
+    auto next = states->New(state_.get());
+    state_.swap(next);
+    return next;
+  }
+  swap_factory_ = states;
+  swap_requested_.store(true, std::memory_order_release);
+  swapped_.wait(ml, [this] { return swapped_out_ != nullptr; });
+  return std::move(swapped_out_);
+}
+
+void TestimonyThread::DoSwap() {
+  std::unique_lock<std::mutex> ml(mu_);
+  auto next = swap_factory_->New(state_.get());
   state_.swap(next);
-  return next;
+  swapped_out_ = std::move(next);
+  swap_requested_.store(false, std::memory_order_relaxed);
+  swapped_.notify_all();
 }
 
 void TestimonyThread::Run() {
   testimony_iter iter;
   CHECK_EQ(0, testimony_iter_init(&iter));
+  Packet batch[kBatchSize];
   while (!last_->HasBeenNotified()) {
+    MaybeSwap();
     const struct tpacket_block_desc* block;
     CHECK_EQ(0, testimony_get_block(t_, 1000, &block)) << testimony_error(t_);
     if (!block) {
@@ -95,19 +126,50 @@ void TestimonyThread::Run() {
     VLOG(1) << "Got testimony block";
     CHECK_EQ(0, testimony_iter_reset(iter, block));
     const struct tpacket3_hdr* hdr;
-    while ((hdr = testimony_iter_next(iter)) != nullptr) {
-      Packet p(hdr);
-      std::unique_lock<std::mutex> ml(mu_);
-      state_->Process(p);
-    }
+    const bool parse = state_->WantsHeaders();
+    size_t n = 0;
+    bool first = true;
+    do {
+      hdr = testimony_iter_next(iter);
+      if (first && hdr != nullptr) {
+        // How far behind we are is how old the block's first packet is.
+        first = false;
+        if (sampler_.Update(GetCurrentTimeNanos() -
+                            testimony_packet_nanos(hdr))) {
+          LOG(INFO) << "Packet thread now taking 1 in "
+                    << sampler_.interval() << " packets";
+        }
+      }
+      if (hdr != nullptr && sampler_.Take()) {
+        batch[n++].Reset(hdr, parse, sampler_.interval());
+      }
+      if (n == kBatchSize || (hdr == nullptr && n > 0)) {
+        state_->ProcessBatch(batch, n);
+        n = 0;
+      }
+    } while (hdr != nullptr);
     CHECK_EQ(0, testimony_return_block(t_, block)) << testimony_error(t_);
   }
   CHECK_EQ(0, testimony_iter_close(iter));
+  // Once finished_ is set, SwapState stops posting requests, but we may still
+  // have one to answer.
+  {
+    std::unique_lock<std::mutex> ml(mu_);
+    finished_ = true;
+  }
+  MaybeSwap();
 }
 
 TestimonyThread::TestimonyThread(testimony t, std::unique_ptr<State> s,
-                                 Notification* last)
-    : state_(std::move(s)), t_(t), last_(last) {
+                                 Notification* last, int64_t max_lag_ns,
+                                 uint32_t max_interval)
+    : state_(std::move(s)),
+      swap_requested_(false),
+      swap_factory_(nullptr),
+      finished_(false),
+      t_(t),
+      last_(last),
+      sampler_(max_lag_ns, max_interval) {
   thread_.reset(new std::thread([this]() { Run(); }));
 }
 
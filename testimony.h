@@ -21,12 +21,18 @@
 #include <linux/if_packet.h>
 #include <testimony.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include <glog/logging.h>
 
 #include "headers.h"
+#include "sampler.h"
 #include "util.h"
 #include "stringpiece.h"
 
@@ -41,6 +47,13 @@ class State {
   State() {}
   virtual ~State() {}
   virtual void Process(const Packet& p) = 0;
+  // ProcessBatch processes packets[0..n) in order.  States can override it to
+  // overlap work across packets (say, prefetching); by default it just calls
+  // Process on each.
+  virtual void ProcessBatch(const Packet* packets, size_t n);
+  // States which parse packets' data themselves return false, so packets
+  // aren't parsed for them first.  Their packets' headers() must not be used.
+  virtual bool WantsHeaders() const { return true; }
 
  private:
   DISALLOW_COPY_AND_ASSIGN(State);
@@ -78,7 +91,17 @@ class TestimonyProcessor {
   TestimonyProcessor(const string& socket, const StateFactory* states);
   virtual ~TestimonyProcessor();
 
+  // Packet threads which fall more than max_lag_ns behind start sampling
+  // packets, taking one in up to max_interval (see Sampler).  Must be called
+  // before StartThreads, if at all; by default, threads take every packet.
+  void SetLoadShedding(int64_t max_lag_ns, uint32_t max_interval) {
+    max_lag_ns_ = max_lag_ns;
+    max_interval_ = max_interval;
+  }
+
   void StartThreads();
+  // Number of packet threads started by StartThreads.
+  size_t NumThreads() const { return threads_.size(); }
   // Gather all states currently in threads, replacing them with empty ones.
   // Note that Gather with last=true MUST be called before TestimonyProcessor is
   // destructed, to stop all threads and gather their final state.
@@ -89,6 +112,8 @@ class TestimonyProcessor {
  private:
   const string socket_;
   const StateFactory* states_;
+  int64_t max_lag_ns_;
+  uint32_t max_interval_;
   std::vector<std::unique_ptr<TestimonyThread>> threads_;
   Notification last_;
   DISALLOW_COPY_AND_ASSIGN(TestimonyProcessor);
@@ -96,37 +121,79 @@ class TestimonyProcessor {
 
 // TestimonyThread is internal to TestimonyProcessor.  It gathers state on a
 // single testimony stream.
+//
+// The packet thread owns its state outright, and never takes a lock while
+// processing packets.  To swap states, SwapState posts a request, which the
+// packet thread checks for with an atomic load between blocks; it then creates
+// the new state from the old, hands the old one back, and carries on.
 class TestimonyThread {
  public:
-  TestimonyThread(testimony t, std::unique_ptr<State> s, Notification* last);
+  TestimonyThread(testimony t, std::unique_ptr<State> s, Notification* last,
+                  int64_t max_lag_ns, uint32_t max_interval);
   ~TestimonyThread();
+  // Replaces our state with a new one from states, returning the old one.
+  // Blocks until the packet thread has finished with the old state, which may
+  // take up to the block timeout if no packets are arriving.
   std::unique_ptr<State> SwapState(const StateFactory* states);
   void Join() { thread_->join(); }
 
  private:
   void Run();
+  // Called by the packet thread between blocks, to handle any pending swap.
+  void MaybeSwap() {
+    if (__builtin_expect(swap_requested_.load(std::memory_order_acquire),
+                         false)) {
+      DoSwap();
+    }
+  }
+  void DoSwap();
+
+  // Packets are handed to our state in batches of up to this many, all from
+  // the same block.
+  static const size_t kBatchSize = 16;
 
+  std::unique_ptr<State> state_;  // owned by the packet thread while it runs
+  std::atomic<bool> swap_requested_;
+  // Guards the swap request, and the packet thread's response to it.
   std::mutex mu_;
-  std::unique_ptr<State> state_;
+  std::condition_variable swapped_;
+  const StateFactory* swap_factory_;  // new state's factory
+  std::unique_ptr<State> swapped_out_;  // old state, once swapped
+  bool finished_;  // true once the packet thread has exited
   testimony t_;
   Notification* last_;
+  Sampler sampler_;  // used only by the packet thread
   std::unique_ptr<std::thread> thread_;
 };
 
 // Packet provides data on a single testimony packet.
 class Packet {
  public:
+  // Packets are normally filled in by a TestimonyThread, but may also be
+  // pointed at frames from elsewhere, say to replay them.
+  Packet() : hdr_(nullptr), sampling_interval_(1), parsed_(false) {}
   virtual ~Packet() {}
+  // Points us at a new packet, whose headers are parsed only if 'parse'.
+  void Reset(const struct tpacket3_hdr* hdr, bool parse,
+             uint32_t sampling_interval);
   StringPiece data() const;
   int64_t ts_nanos() const;
   const struct tpacket3_hdr* hdr() const { return hdr_; }
-  const Headers& headers() const { return headers_; }
+  // If the packet thread is sampling, this packet was the one taken out of
+  // sampling_interval() packets, and stands for all of them.
+  uint32_t sampling_interval() const { return sampling_interval_; }
+  const Headers& headers() const {
+    DCHECK(parsed_);
+    return headers_;
+  }
 
  private:
   friend class TestimonyThread;
-  explicit Packet(const struct tpacket3_hdr* hdr);
+  explicit Packet(const struct tpacket3_hdr* hdr) { Reset(hdr, true, 1); }
   const struct tpacket3_hdr* hdr_;
+  uint32_t sampling_interval_;
   Headers headers_;
+  bool parsed_;
   DISALLOW_COPY_AND_ASSIGN(Packet);
 };
 
@@ -0,0 +1,70 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <glog/logging.h>
+
+namespace clerk {
+
+ThreadPool::ThreadPool(size_t threads)
+    : fn_(nullptr), next_(0), size_(0), running_(0), stop_(false) {
+  CHECK_GT(threads, 0);
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back([this]() { Work(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> ml(mu_);
+    CHECK(fn_ == nullptr) << "ThreadPool destroyed during Run";
+    stop_ = true;
+  }
+  work_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void ThreadPool::Run(size_t n, const std::function<void(size_t)>& fn) {
+  if (n == 0) return;
+  std::unique_lock<std::mutex> ml(mu_);
+  CHECK(fn_ == nullptr) << "ThreadPool::Run called concurrently";
+  fn_ = &fn;
+  next_ = 0;
+  size_ = n;
+  work_.notify_all();
+  done_.wait(ml, [this]() { return next_ == size_ && running_ == 0; });
+  fn_ = nullptr;
+}
+
+void ThreadPool::Work() {
+  std::unique_lock<std::mutex> ml(mu_);
+  while (true) {
+    work_.wait(ml, [this]() { return stop_ || next_ < size_; });
+    if (stop_) return;
+    size_t i = next_++;
+    running_++;
+    const std::function<void(size_t)>* fn = fn_;
+    ml.unlock();
+    (*fn)(i);
+    ml.lock();
+    if (--running_ == 0 && next_ == size_) {
+      done_.notify_all();
+    }
+  }
+}
+
+}  // namespace clerk
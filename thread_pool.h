@@ -0,0 +1,63 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_THREAD_POOL_H_
+#define CLERK_THREAD_POOL_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "util.h"
+
+namespace clerk {
+
+// ThreadPool is a fixed set of threads, started once, which run batches of
+// tasks.  The main thread uses one to merge and export flows each interval,
+// rather than starting new threads every time.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t threads);
+  // Waits for all threads to exit.  Must not be called during Run.
+  ~ThreadPool();
+
+  size_t size() const { return threads_.size(); }
+
+  // Runs fn(0), ..., fn(n-1) on the pool's threads, returning once they've
+  // all finished.  Only one Run may be in progress at a time.
+  void Run(size_t n, const std::function<void(size_t)>& fn);
+
+ private:
+  void Work();
+
+  std::mutex mu_;
+  std::condition_variable work_;  // signalled when there's work, or on stop
+  std::condition_variable done_;  // signalled when a batch finishes
+  const std::function<void(size_t)>* fn_;  // current batch's function
+  size_t next_;                            // next task to start
+  size_t size_;                            // tasks in current batch
+  size_t running_;  // tasks started but not yet finished
+  bool stop_;
+  std::vector<std::thread> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_THREAD_POOL_H_
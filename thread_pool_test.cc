@@ -0,0 +1,41 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "thread_pool.h"
+
+namespace clerk {
+
+class ThreadPoolTest : public ::testing::Test {};
+
+TEST_F(ThreadPoolTest, TestRun) {
+  ThreadPool pool(4);
+  EXPECT_EQ(pool.size(), 4);
+  // Run many batches, of more and fewer tasks than threads, checking each
+  // task runs exactly once and all are done by the time Run returns.
+  for (size_t n = 0; n < 20; n++) {
+    std::vector<std::atomic<int>> runs(n);
+    for (auto& r : runs) r = 0;
+    pool.Run(n, [&runs](size_t i) { runs[i]++; });
+    for (size_t i = 0; i < n; i++) {
+      EXPECT_EQ(runs[i], 1) << n << " " << i;
+    }
+  }
+}
+
+}  // namespace clerk
@@ -0,0 +1,175 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CLERK_TIMER_WHEEL_H_
+#define CLERK_TIMER_WHEEL_H_
+
+// TimerWheel is a hierarchical timing wheel:  it schedules keys to fire at
+// given times, with O(1) work per key to schedule and to fire, however many
+// keys are scheduled.
+//
+// Time is counted in ticks.  Level 0 has a slot for each of the next kSlots
+// ticks, and each level above has kSlots slots each covering kSlots times as
+// many ticks as a slot of the level below.  A key goes in the lowest level
+// whose span reaches its deadline.  As time advances past each level 0 slot,
+// its keys fire; whenever level 0 wraps around, the next slot of level 1 is
+// cascaded down into it, and so on up.  So each key moves down at most once
+// per level before it fires.
+//
+// Keys fire in the tick of their deadline, give or take the whole tick, so
+// callers that want exact deadlines must check whether a fired key is really
+// due, and reschedule it if not.  That also makes timers cheap to push back:
+// rather than moving a key each time its deadline changes, leave it, and
+// reschedule it when it fires early.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+namespace clerk {
+
+template <class K>
+class TimerWheel {
+ public:
+  static const size_t kBits = 6;
+  static const size_t kSlots = 1 << kBits;
+  static const size_t kLevels = 4;
+
+  // An entry in the wheel, exposed so callers can account for its size.
+  struct Entry {
+    K key;
+    uint64_t tick;  // deadline
+  };
+
+  // Creates a wheel whose ticks are 'tick_ns' long, starting at 'now_ns'.
+  TimerWheel(uint64_t tick_ns, uint64_t now_ns)
+      : tick_ns_(tick_ns), now_(now_ns / tick_ns), size_(0) {}
+
+  // Number of keys scheduled.
+  size_t size() const { return size_; }
+
+  // Schedules 'key' to fire once time reaches 'deadline_ns'.  Deadlines
+  // already past fire on the next Advance.  A key may be scheduled more than
+  // once, and then fires once per time it was scheduled.
+  void Schedule(const K& key, uint64_t deadline_ns) {
+    Insert(Entry{key, deadline_ns / tick_ns_});
+    size_++;
+  }
+
+  // Advances the wheel to 'now_ns', calling fn(key) for each key whose
+  // deadline is in or before now_ns's tick.  fn may Schedule keys, including
+  // the one it's called with.  Keys due in now_ns's tick fire again on the
+  // next Advance, if rescheduled for that tick.
+  template <class F>
+  void Advance(uint64_t now_ns, F fn) {
+    const uint64_t to = now_ns / tick_ns_;
+    if (to < now_) return;
+    if (to - now_ >= kSlots * kSlots) {
+      // A big jump.  Rather than step through every tick, fire or
+      // reschedule everything at once.
+      std::vector<Entry> all;
+      for (auto& level : slots_) {
+        for (auto& slot : level) {
+          all.insert(all.end(), slot.begin(), slot.end());
+          slot.clear();
+        }
+      }
+      now_ = to;
+      for (const Entry& e : all) {
+        if (e.tick <= to) {
+          size_--;
+          fn(e.key);
+        } else {
+          Insert(e);
+        }
+      }
+      return;
+    }
+    for (uint64_t t = now_; t <= to; t++) {
+      now_ = t;
+      // Crossing into a new level 0 revolution, bring the keys due in it down
+      // from the levels above, highest first.
+      if (t % kSlots == 0) {
+        for (size_t level = kLevels - 1; level > 0; level--) {
+          if (t % (uint64_t(1) << (kBits * level)) == 0) {
+            Cascade(level, t);
+          }
+        }
+      }
+      std::vector<Entry> due;
+      due.swap(slots_[0][t % kSlots]);
+      for (const Entry& e : due) {
+        if (e.tick <= to) {
+          size_--;
+          fn(e.key);
+        } else {
+          Insert(e);  // a revolution or more away yet
+        }
+      }
+    }
+  }
+
+  // Drops every scheduled key for which keep(key) returns false.  Takes time
+  // proportional to the number of keys scheduled.
+  template <class F>
+  void Filter(F keep) {
+    for (auto& level : slots_) {
+      for (auto& slot : level) {
+        size_t kept = 0;
+        for (size_t i = 0; i < slot.size(); i++) {
+          if (keep(slot[i].key)) slot[kept++] = slot[i];
+        }
+        size_ -= slot.size() - kept;
+        slot.resize(kept);
+      }
+    }
+  }
+
+ private:
+  // Puts an entry in the slot of the lowest level that reaches its deadline.
+  void Insert(const Entry& e) {
+    const uint64_t tick = std::max(e.tick, now_);
+    const uint64_t delta = tick - now_;
+    size_t level = 0;
+    while (level < kLevels - 1 && (delta >> (kBits * (level + 1))) != 0) {
+      level++;
+    }
+    // Deadlines past the top level's reach wait in its furthest slot, and are
+    // reinserted each time it's cascaded until they're in reach.
+    uint64_t slot_tick = tick;
+    if ((delta >> (kBits * kLevels)) != 0) {
+      slot_tick = now_ + (uint64_t(kSlots - 1) << (kBits * level));
+    }
+    slots_[level][(slot_tick >> (kBits * level)) % kSlots].push_back(e);
+  }
+  // Moves the entries of the given level's slot for tick t down the wheel.
+  void Cascade(size_t level, uint64_t t) {
+    std::vector<Entry> entries;
+    entries.swap(slots_[level][(t >> (kBits * level)) % kSlots]);
+    for (const Entry& e : entries) {
+      Insert(e);
+    }
+  }
+
+  const uint64_t tick_ns_;
+  uint64_t now_;  // current tick, whose level 0 slot may still hold keys
+  size_t size_;
+  std::vector<Entry> slots_[kLevels][kSlots];
+};
+
+}  // namespace clerk
+
+#endif  // CLERK_TIMER_WHEEL_H_
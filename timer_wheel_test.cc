@@ -0,0 +1,93 @@
+// Copyright 2016 Google Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <map>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "timer_wheel.h"
+
+namespace clerk {
+
+class TimerWheelTest : public ::testing::Test {};
+
+TEST_F(TimerWheelTest, TestFire) {
+  TimerWheel<int> w(10, 1000);
+  w.Schedule(1, 1005);  // this tick
+  w.Schedule(2, 1500);  // level 0
+  w.Schedule(3, 1000 + 10 * 100);  // level 1
+  w.Schedule(4, 1000 + 10 * 10000);  // level 2
+  w.Schedule(5, 500);  // already past
+  EXPECT_EQ(5, w.size());
+  std::vector<int> fired;
+  auto fire = [&fired](int k) { fired.push_back(k); };
+  w.Advance(1000, fire);
+  EXPECT_EQ(std::vector<int>({1, 5}), fired);
+  fired.clear();
+  w.Advance(1499, fire);
+  EXPECT_TRUE(fired.empty());
+  w.Advance(1500, fire);
+  EXPECT_EQ(std::vector<int>({2}), fired);
+  fired.clear();
+  w.Advance(1000 + 10 * 100, fire);
+  EXPECT_EQ(std::vector<int>({3}), fired);
+  fired.clear();
+  // Jumping far ahead fires everything due at once.
+  w.Advance(1000 + 10 * 10000 + 5, fire);
+  EXPECT_EQ(std::vector<int>({4}), fired);
+  EXPECT_EQ(0, w.size());
+}
+
+TEST_F(TimerWheelTest, TestFilter) {
+  TimerWheel<int> w(10, 1000);
+  for (int k = 0; k < 10; k++) {
+    w.Schedule(k, 1000 + k * 1000);
+  }
+  w.Filter([](int k) { return k % 2 == 0; });
+  EXPECT_EQ(5, w.size());
+  std::vector<int> fired;
+  w.Advance(1000 + 10 * 1000, [&fired](int k) { fired.push_back(k); });
+  EXPECT_EQ(std::vector<int>({0, 2, 4, 6, 8}), fired);
+  EXPECT_EQ(0, w.size());
+}
+
+TEST_F(TimerWheelTest, TestRandom) {
+  // Keys fire in the tick of their deadline, never before and never after,
+  // however far ahead they're scheduled and however the wheel advances.
+  std::mt19937_64 rng(1);
+  TimerWheel<int> w(1, 0);
+  std::map<int, uint64_t> deadlines;
+  uint64_t now = 0;
+  for (int k = 0; k < 20000; k++) {
+    uint64_t d = now + rng() % (1 << (rng() % 26));
+    deadlines[k] = d;
+    w.Schedule(k, d);
+    if (k % 100 == 0) {
+      now += rng() % 5000;
+      w.Advance(now, [&](int key) {
+        ASSERT_LE(deadlines[key], now) << key;
+        deadlines.erase(key);
+      });
+      // Everything due has fired.
+      for (const auto& iter : deadlines) {
+        ASSERT_GT(iter.second, now) << iter.first;
+      }
+    }
+  }
+  EXPECT_EQ(deadlines.size(), w.size());
+}
+
+}  // namespace clerk
@@ -15,27 +15,24 @@
 #ifndef CLERK_UTIL_H_
 #define CLERK_UTIL_H_
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 
 using namespace std;
 
+// Notification is a one-shot flag.  HasBeenNotified is a single atomic load,
+// cheap enough to check in packet-processing loops.
 class Notification {
  public:
   Notification() : done_(false) {}
-  bool HasBeenNotified() {
-    std::unique_lock<mutex> ml(mu_);
-    return done_;
-  }
-  void Notify() {
-    std::unique_lock<mutex> ml(mu_);
-    done_ = true;
+  bool HasBeenNotified() const {
+    return done_.load(std::memory_order_acquire);
   }
+  void Notify() { done_.store(true, std::memory_order_release); }
 
  private:
-  bool done_;
-  std::mutex mu_;
-  std::condition_variable cond_;
+  std::atomic<bool> done_;
 };
 
 #define DISALLOW_COPY_AND_ASSIGN(Type) \